@@ -0,0 +1,37 @@
+#ifndef VPT_CHECKPOINT_HPP
+#define VPT_CHECKPOINT_HPP
+
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include <vpt/film.hpp>
+#include <vpt/tile_provider.hpp>
+
+namespace vpt {
+
+/**
+  The progress of a render: the state of each tile (its film is saved alongside), and what identifies the render it belongs to.
+  As the RNG is seeded from the job index and the waves of a tile are always accumulated in order, resuming from a checkpoint gives the same image as an uninterrupted render.
+*/
+struct Checkpoint {
+  uint32_t seed;
+  uint64_t config_hash;
+  std::vector<TileProvider::tile_state> tiles;
+
+  /**
+    @brief Write the checkpoint and the film. They are written to a temporary file which is then renamed, so the previous checkpoint survives a crash while writing.
+    @return false on failure.
+  */
+  bool save(const std::filesystem::path& path, const Film& film) const;
+
+  /**
+    @brief Load a checkpoint written by save(), and its film into the specified one.
+    @return std::nullopt if it can't be read, or if its film has a different size.
+  */
+  static std::optional<Checkpoint> load(const std::filesystem::path& path, Film& film);
+};
+
+} // namespace vpt
+
+#endif // !VPT_CHECKPOINT_HPP
@@ -5,14 +5,18 @@
 
 namespace vpt {
 
+static inline const Eigen::Matrix3f& xyz_to_linsrgb_matrix() {
+  static const Eigen::Matrix3f m = (Eigen::Matrix3f() <<
+     3.240479, -1.537150, -0.498535,
+    -0.969256,  1.875991,  0.041556,
+     0.055648, -0.204043,  1.057311
+  ).finished();
+
+  return m;
+}
+
 static inline Eigen::Vector3f xyz_to_linsrgb(const Eigen::Vector3f& xyz) {
-  Eigen::Matrix3f m;
-  
-  m <<  3.240479, -1.537150, -0.498535,
-       -0.969256,  1.875991,  0.041556,
-        0.055648, -0.204043,  1.057311;
-  
-  return m * xyz;
+  return xyz_to_linsrgb_matrix() * xyz;
 }
 
 static inline Eigen::Vector3f linsrgb_to_srgb(const Eigen::Vector3f linsrgb) {
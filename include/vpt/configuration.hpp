@@ -2,13 +2,23 @@
 #define VPT_CONFIGURATION_HPP
 
 #include <filesystem>
+#include <string>
+#include <vector>
 
 #include <vpt/image.hpp>
 
 namespace vpt {
 
+/** The format is chosen from the extension of the output path: .png, or .pfm and .exr for float images. */
 struct OutputImage {
-  
+  // Bits per sample of PNG images, 8 or 16
+  unsigned int png_bit_depth;
+
+  // The color space of float images. Linear sRGB is what most tools expect, XYZ is the raw film.
+  enum class ColorSpace {
+    LinearSRGB,
+    XYZ
+  } float_color_space;
 };
 
 struct CameraParameters {
@@ -20,6 +30,29 @@ struct CameraParameters {
   float imaging_ratio;
 };
 
+struct CameraKey {
+  int frame;
+  CameraParameters camera;
+};
+
+/** One of several views of the volume rendered together, e.g. for a turntable. */
+struct ViewParameters {
+  CameraParameters camera;
+
+  // Relative to the output path given on the command line, which is then a directory
+  std::filesystem::path output_path;
+};
+
+/** Used when the volume path is a pattern, with a run of '#' standing for the zero padded frame number (e.g. "fire_####.nvdb"). */
+struct SequenceParameters {
+  // The frames [first_frame, last_frame] are rendered
+  int first_frame;
+  int last_frame;
+
+  // The camera at some frames, linearly interpolated in between and held before the first and after the last. If empty, camera_parameters is used for all the frames.
+  std::vector<CameraKey> camera_keys;
+};
+
 struct InfiniteLightParameters {
   Eigen::Vector3f xyz;
   float multiplier;
@@ -31,7 +64,38 @@ struct DistantLightParameters {
   Eigen::Vector3f inv_direction;
 };
 
+struct ShadowParameters {
+  enum class Mode {
+    Exact, // Trace a shadow ray at each scattering event
+    Cached // Look up the transmittance in a precomputed grid (biased)
+  } mode;
+
+  // The transmittance estimator used by the exact mode
+  enum class Estimator {
+    RatioTracking,        // Track the whole density against the majorant
+    ResidualRatioTracking // Integrate the minorant analytically, and only track the residual
+  } estimator;
+
+  // Size in voxels of the cells of the transmittance grid used by the cached mode
+  float cell_size;
+};
+
+struct AdaptiveSamplingParameters {
+  bool enabled;
+
+  // A tile gets no more waves once the estimated relative error of its luminance is below this
+  float relative_error;
+
+  // Waves every tile gets before its error is estimated. num_waves is the cap.
+  unsigned int min_waves;
+};
+
 struct WorkerParameters {
+  enum class Engine {
+    Megakernel, // Each path is traced from start to end before moving on to the next
+    Wavefront   // The paths of a batch of tiles are advanced together, one stage at a time
+  } engine;
+
   struct SinglePixelMode {
     bool enabled;
     image_point_t coord;
@@ -40,6 +104,8 @@ struct WorkerParameters {
   bool use_jitter;
   InfiniteLightParameters infinite_light;
   DistantLightParameters distant_light;
+  ShadowParameters shadows;
+  AdaptiveSamplingParameters adaptive_sampling;
   unsigned int max_depth;
 };
 
@@ -50,22 +116,114 @@ struct VolumeParameters {
   float sigma_s;
   float temperature_offset;
   float temperature_scale;
+
+  // Size in voxels of the cells of the coarse majorant grid. If 0, rays are traversed over the density tree instead.
+  unsigned int majorant_grid_cell_size;
+
+  // Whether to save the tree majorants to a sidecar file next to the volume, and load them from it on later runs.
+  bool cache_majorants;
+};
+
+struct VolumeLoading {
+  // Map the uncompressed grids of the volume file into memory, rather than reading them. Renders of the same file on one host then share them through the page cache.
+  bool mmap;
+
+  // The grids in a volume file are usually not aligned as NanoVDB needs them to be, so they must be copied out of the mapping.
+  // If so, save an aligned copy to a sidecar file next to the volume, and map that on later runs.
+  bool aligned_cache;
+
+  // Fault in the whole mapping upfront (MAP_POPULATE), rather than on the first access while rendering.
+  bool populate;
+
+  // Ask for transparent huge pages for the mapping. Only some kernels and filesystems honor it for file mappings.
+  bool huge_pages;
+
+  // If > 0, at most this many MiB of density leaves are kept resident, and the others are paged in from the mapping on demand. For volumes larger than RAM.
+  unsigned int leaf_cache_mib;
+};
+
+struct BudgetParameters {
+  // Wall clock time in seconds for the rendering, startup excluded. Waves which are not expected to end in time are not started. If 0, there is no limit.
+  float time_limit;
+
+  // Expected throughput in samples per second over all the workers, used to plan the first waves until the actual one is measured. If 0, it is unknown.
+  // Only valid with a time limit.
+  float samples_per_second;
 };
 
 struct Configuration {
   unsigned int seed;
   image_size_t output_size;
   image_size_t tile_size;
+
+  // The order in which the workers go over the tiles. Only the speed depends on it, not the image.
+  enum class TileOrder {
+    Raster,  // Each worker gets a contiguous band of tiles, in raster order
+    Hilbert, // The workers take turns along a Hilbert curve over the tiles, so they render neighbouring tiles at the same time
+    Spiral,  // The workers take turns along a square spiral, from the centre of the image outwards
+    Cost     // The workers take turns from the tile expected to be the most expensive to the cheapest (see estimate_tile_costs)
+  } tile_order;
+
   unsigned int num_waves;
   unsigned int num_workers;
+
+  // Render without opening the viewer window, then save and exit. Also forced by --headless on the command line.
+  bool headless;
+
+  // In the viewer, the first waves trace one path per 2^n x 2^n block of pixels, for n = preview_levels..1, so that a coarse image shows up quickly.
+  // They are only shown, not part of the final image. If 0, the viewer starts with the full waves.
+  unsigned int preview_levels;
+
+  BudgetParameters budget;
+
+  // Write a checkpoint next to the output image every this many waves, and at the end. If 0, checkpoints are disabled.
+  unsigned int checkpoint_period;
+
+  OutputImage output_image;
+
   CameraParameters camera_parameters;
+
+  // If not empty, these views are rendered (headless) instead of camera_parameters, sharing the volume and the workers
+  std::vector<ViewParameters> views;
+
+  SequenceParameters sequence;
   WorkerParameters worker_parameters;
   std::filesystem::path volume_path;
+  VolumeLoading volume_loading;
   VolumeParameters volume_parameters;
 };
 
 Configuration read_configuration(const std::filesystem::path& path);
 
+/** A render submitted to the server (see serve()). */
+struct RenderJob {
+  // Echoed in the reply, to tell the jobs apart
+  std::string id;
+
+  // Where the result is saved: a raw film if the extension is .vptfilm, an image otherwise. If empty, the raw film is sent back with the reply.
+  std::filesystem::path output_path;
+
+  Configuration scene;
+};
+
+/** @brief Parse a render job from JSON. @return false, with the reason in error, if it is malformed. */
+bool parse_render_job(const std::string& json, RenderJob& job, std::string& error);
+
+/** @return Whether the path is a frame number pattern - i.e. it has a run of '#'. */
+bool is_frame_pattern(const std::filesystem::path& path);
+
+/** @return The path with the (first) run of '#' replaced by the frame number, zero padded to its length. */
+std::filesystem::path frame_path(const std::filesystem::path& pattern, int frame);
+
+/** @return The camera parameters at the frame of the sequence. */
+CameraParameters camera_at_frame(const Configuration& cfg, int frame);
+
+/** @return A hash of the parameters which affect the rendered samples - i.e. all of them, except the number of waves, workers and the like. */
+uint64_t render_hash(const Configuration& cfg);
+
+/** @return A hash of the parameters which the loaded and preprocessed volume (see LoadedVolume) depends on, besides its path. */
+uint64_t volume_hash(const Configuration& cfg);
+
 } // namespace vpt
 
 #endif // !VPT_CONFIGURATION_HPP
\ No newline at end of file
@@ -0,0 +1,117 @@
+#ifndef VPT_DENSITY_SAMPLER_HPP
+#define VPT_DENSITY_SAMPLER_HPP
+
+#include <span>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-private-field"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include <nanovdb/math/SampleFromVoxels.h>
+#pragma GCC diagnostic pop
+
+#include <vpt/volume_grids.hpp>
+#include <vpt/leaf_pager.hpp>
+
+namespace vpt {
+
+/**
+  Pins the values of a leaf, and of its +x, +y and +z face neighbours.
+  These are all the voxels read by the trilinear stencil of the points in the leaf, except near its edges and corners.
+*/
+template <typename BuildT>
+struct LeafStencilCache {
+  using CoordT = nanovdb::math::Coord;
+  using AccessorT = typename GridTypes<BuildT>::AccessorT;
+  using LeafT = typename GridTypes<BuildT>::LeafT;
+
+  /**
+    @brief Pin the leaf containing ijk, unless it is already pinned.
+    @param pager If not null, the pinned leaves are touched in it.
+    @return false if there is no leaf containing ijk.
+  */
+  bool pin(const CoordT& ijk, const AccessorT& acc, const LeafPager* pager);
+
+  /**
+    @brief Fetch the 8 voxels of the stencil with lower corner ijk, which must be in the pinned leaf.
+    In order: 000, 001, 010, 011, 100, 101, 110, 111 (the bits being x, y, z).
+    @return false if the stencil reads a voxel outside the pinned leaves.
+  */
+  bool fetch(const CoordT& ijk, float (&v)[8]) const;
+
+  const CoordT& origin() const { return m_origin; }
+  const LeafT* leaf() const { return m_leaf; }
+
+  /** @return How many leaves were touched in the pager. */
+  uint64_t num_touches() const { return m_num_touches; }
+
+private:
+  CoordT m_origin = CoordT(std::numeric_limits<int32_t>::max());
+
+  // Null if there is no leaf
+  const LeafT* m_leaf = nullptr;
+  const LeafT* m_neighbours[3] = { nullptr, nullptr, nullptr };
+
+  uint64_t m_num_touches = 0;
+};
+
+/**
+  Trilinear interpolation of the density grid, in batches of points.
+
+  The current leaf is pinned, so consecutive lookups in the same leaf don't go through the accessor.
+  Stencils which need voxels outside of the pinned leaves fall back to the NanoVDB sampler.
+  If the leaves are paged, all the leaves read are touched in the pager (see LeafPager): the pinned ones, and those of the stencils which fall back.
+  The values of quantized grids are decoded as they are read.
+*/
+template <typename BuildT>
+struct DensitySampler {
+  using AccessorT = typename GridTypes<BuildT>::AccessorT;
+
+  explicit DensitySampler(const AccessorT& acc, const LeafPager* pager = nullptr);
+  ~DensitySampler();
+
+  DensitySampler(const DensitySampler&) = delete;
+  DensitySampler& operator=(const DensitySampler&) = delete;
+
+  /** @return The interpolated density at the index space point. */
+  float operator()(const nanovdb::Vec3f& point) const;
+
+  /** @brief Compute the interpolated density at each of the index space points. */
+  void operator()(std::span<const nanovdb::Vec3f> points, std::span<float> out) const;
+
+private:
+  const AccessorT& m_acc;
+  const LeafPager* m_pager;
+  nanovdb::math::SampleFromVoxels<AccessorT, 1> m_fallback;
+
+  mutable LeafStencilCache<BuildT> m_cache;
+  mutable uint64_t m_num_fallback_touches = 0;
+};
+
+/**
+  Trilinear interpolation of the temperature grid with the NanoVDB sampler.
+  If its leaves are paged along with the density ones, the leaves read are touched in the pager.
+*/
+struct TemperatureSampler {
+  TemperatureSampler(const VolumeGrids& grids, const LeafPager* pager);
+  ~TemperatureSampler();
+
+  TemperatureSampler(const TemperatureSampler&) = delete;
+  TemperatureSampler& operator=(const TemperatureSampler&) = delete;
+
+  /** @return The interpolated temperature at the index space point. */
+  float operator()(const nanovdb::Vec3f& point) const;
+
+private:
+  VolumeGrids::TemperatureAccessorT m_acc;
+  const LeafPager* m_pager;
+  nanovdb::math::SampleFromVoxels<VolumeGrids::TemperatureAccessorT, 1> m_sampler;
+
+  mutable uint64_t m_num_touches = 0;
+};
+
+} // namespace vpt
+
+#endif // !VPT_DENSITY_SAMPLER_HPP
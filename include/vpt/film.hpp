@@ -0,0 +1,179 @@
+#ifndef VPT_FILM_HPP
+#define VPT_FILM_HPP
+
+#include <iosfwd>
+#include <optional>
+#include <atomic>
+#include <span>
+#include <vector>
+
+#include <vpt/image.hpp>
+#include <vpt/configuration.hpp>
+
+namespace vpt {
+
+/**
+  Accumulates the samples of each pixel: the sum of the XYZ values, the number of samples and the sum of the squared luminance (Y).
+  The latter is used to estimate the variance of the pixels.
+
+  Pixels are not synchronized - each tile must be written by one thread at a time.
+  The film also tracks which blocks of pixels changed since they were last taken, so that the viewer only updates those.
+*/
+struct Film {
+  Film(image_size_t size);
+
+  inline void add_sample(const image_point_t& pt, const Eigen::Vector3f& xyz) {
+    auto& px = m_radiance.data()(pt.y(), pt.x());
+    px.topRows<3>() += xyz;
+    px.w() += 1.0f;
+
+    m_Y2.data()(pt.y(), pt.x()).x() += xyz.y() * xyz.y();
+  }
+
+  /**
+    @brief Add a sample to the preview of a block of pixels (see enable_preview).
+    It goes to a separate layer, which is only shown until the pixels get samples of their own - so it does not bias the film.
+  */
+  inline void add_preview_sample(const image_rect_t& block, const Eigen::Vector3f& xyz) {
+    Eigen::Vector4f sample;
+    sample << xyz, 1.0f;
+
+    auto px = m_preview->view(block);
+    for (image_index_t y = 0; y < px.rows(); ++y)
+      for (image_index_t x = 0; x < px.cols(); ++x)
+        px(y, x) += sample;
+  }
+
+  /** @brief Allocate the preview layer, for the coarse samples of the first waves. */
+  void enable_preview();
+
+  /** @return The preview layer: the sum of the XYZ values (xyz) and the sample count (w) of the blocks each pixel was in, or nullptr if not enabled. */
+  const Image<float, 4>* preview() const { return m_preview ? &*m_preview : nullptr; }
+
+  /**
+    @return An estimate of the relative error of the luminance of the pixels in the rect,
+    i.e. the RMS standard error of the pixel means over the mean pixel luminance.
+  */
+  float relative_error(const image_rect_t& rect) const;
+
+  /** @return The sum of the XYZ values (xyz) and the sample count (w) of each pixel. */
+  const Image<float, 4>& radiance() const { return m_radiance; }
+
+  image_size_t size() const { return m_radiance.size(); }
+
+  /** @brief Write the raw accumulators. @return false on failure. */
+  bool write(std::ostream& os) const;
+
+  /** @brief Read the raw accumulators written by write() from a film of the same size. @return false on failure. */
+  bool read(std::istream& is);
+
+  /** @return The number of bytes written by write(). */
+  size_t write_size() const;
+
+  /** @brief Add the samples of another film of the same size. */
+  Film& operator+=(const Film& other);
+
+  /** @brief Flag the blocks overlapping the rect as changed. Thread safe. */
+  void mark_dirty(const image_rect_t& rect);
+
+  /** @return The rects which changed since the last call, and clear their flags. Horizontally adjacent blocks are merged. */
+  std::vector<image_rect_t> take_dirty();
+
+private:
+  static constexpr image_index_t DIRTY_BLOCK_SIZE = 64;
+
+  void mark_all_dirty();
+
+  Image<float, 4> m_radiance;
+  Image<float, 1> m_Y2;
+
+  // Not part of the film - neither saved nor merged
+  std::optional<Image<float, 4>> m_preview;
+
+  image_size_t m_num_blocks;
+  std::vector<std::atomic<bool>> m_dirty;
+};
+
+/** @brief Tone map the film to 8 bit sRGB. */
+void film_to_image(const Film& film, Image<unsigned char, 3>& image, unsigned int num_threads = 1);
+
+/**
+  @brief Save the film as an image, in the format given by the extension of the path (see OutputImage).
+  The film is converted in parallel, in stripes of rows.
+  @return false on failure.
+*/
+bool save_film_image(const std::filesystem::path& path, const Film& film, const OutputImage& params, unsigned int num_threads);
+
+/**
+  Tone maps parts of the film to 8 bit sRGB for the viewer.
+  Much faster than film_to_image, as the pixels are converted four at a time (with SSE) and the sRGB transfer function is a lookup table - but a bit less precise in the darks.
+*/
+struct PreviewToneMapper {
+  PreviewToneMapper();
+
+  /** @brief Tone map the rects of the film into the image, in parallel: the rows of all the rects are split in bands across the threads. */
+  void operator()(const Film& film, Image<unsigned char, 3>& image, std::span<const image_rect_t> rects, unsigned int num_threads) const;
+
+private:
+  static constexpr int LUT_SIZE = 1 << 14;
+
+  /** @brief Tone map width pixels of row y, from column x. */
+  void tone_map_row(const Film& film, Image<unsigned char, 3>& image, image_index_t y, image_index_t x, image_index_t width) const;
+
+  // Linear [0, 1] -> 8 bit sRGB
+  std::vector<unsigned char> m_lut;
+};
+
+/** Identifies the render a film file belongs to, and the waves whose samples it holds. */
+struct FilmInfo {
+  uint32_t seed;
+  uint64_t config_hash;
+  uint32_t wave_begin; // The samples are from the waves in [wave_begin, wave_end), counting from 0
+  uint32_t wave_end;
+};
+
+/**
+  @brief Save the raw film, to be merged with the films of other wave ranges of the same render.
+  @return false on failure.
+*/
+bool save_film(const std::filesystem::path& path, const FilmInfo& info, const Film& film);
+
+/** @brief Write the raw film to a stream, in the same format as save_film(). @return false on failure. */
+bool write_film(std::ostream& os, const FilmInfo& info, const Film& film);
+
+/** @return The film saved by save_film(), or std::nullopt if it can't be read. */
+std::optional<Film> load_film(const std::filesystem::path& path, FilmInfo& info);
+
+/**
+  Merges the films of different wave ranges of the same render (see save_film), given in any order.
+  The films are summed as they are added, so only the merged one is kept in memory. Their wave ranges are checked once they are all in.
+*/
+struct FilmMerger {
+  struct Result {
+    Film film;
+    FilmInfo info;   // The waves run from the first range to the last one
+    bool contiguous; // Whether no waves are missing between the ranges
+  };
+
+  /** @brief Add a film loaded from path, which names it in the messages. @return false if it belongs to another render than the previous ones (logged). */
+  bool add(const std::filesystem::path& path, const FilmInfo& info, Film&& film);
+
+  /**
+    @return The merged films, or std::nullopt if there are none, or if the wave ranges of some of them overlap (logged):
+    the same wave twice means the same samples twice - that's not more samples, that's a bug.
+  */
+  std::optional<Result> finish();
+
+private:
+  struct Part {
+    std::filesystem::path path;
+    FilmInfo info;
+  };
+
+  std::vector<Part> m_parts;
+  std::optional<Film> m_film;
+};
+
+} // namespace vpt
+
+#endif // !VPT_FILM_HPP
@@ -20,7 +20,14 @@ namespace detail {
   template <typename T, int N_channels>
   inline constexpr bool supports_save_v = supports_save<T, N_channels>::value;
 
+  template <typename T, int N_channels>
+  inline constexpr bool supports_save_float_v = std::is_same_v<T, float> && N_channels == 3;
+
+  /** @brief Save an RGB image as PNG. 16 bit samples are in the native byte order (spng swaps them). */
   bool save_image(const std::filesystem::path& path, const char* data, int width, int height, int byte_depth);
+
+  /** @brief Save a float RGB image as PFM or (uncompressed) OpenEXR, depending on the extension of the path. */
+  bool save_float_image(const std::filesystem::path& path, const float* data, int width, int height);
 }
 
 using image_index_t = Eigen::Index;
@@ -51,8 +58,11 @@ struct Image {
   inline auto view(const image_rect_t& r) { return data().block(r.start.y(), r.start.x(), r.size.y(), r.size.x()); }
 
   template <typename Dummy = bool>
-  std::enable_if_t<detail::supports_save_v<T, N_channels>, Dummy> save(const std::filesystem::path& path) {
-    return detail::save_image(path, reinterpret_cast<char*>(m_data.data()->data()), size().x(), size().y(), sizeof(T));
+  std::enable_if_t<detail::supports_save_v<T, N_channels> || detail::supports_save_float_v<T, N_channels>, Dummy> save(const std::filesystem::path& path) {
+    if constexpr (std::is_same_v<T, float>)
+      return detail::save_float_image(path, m_data.data()->data(), size().x(), size().y());
+    else
+      return detail::save_image(path, reinterpret_cast<char*>(m_data.data()->data()), size().x(), size().y(), sizeof(T));
   }
 
 private:
@@ -0,0 +1,146 @@
+#ifndef VPT_LEAF_PAGER_HPP
+#define VPT_LEAF_PAGER_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <vpt/volume_grids.hpp>
+
+namespace vpt {
+
+/**
+  Bounds the memory used by the leaves of memory-mapped grids, for volumes larger than RAM.
+
+  The leaves of a grid are contiguous at the end of its buffer. They are split in blocks, and the blocks are paged in on demand
+  (by the kernel, when they are read) and out in least recently used order (approximately - with the CLOCK algorithm),
+  so that at most budget bytes of them are resident. The rest of the trees stays resident, as do the majorants, which are not in the grids.
+
+  Evicting a block just drops its pages from the mapping: the grids are never written, so a read of an evicted block is always safe - it faults the block back in.
+  The renderer touches the leaves it reads, but a read may still fault in a block the pager doesn't know about: a preprocessing pass, or a reader still in
+  a block which was just evicted. So the pager also checks which blocks are actually mapped (in /proc/self/pagemap) a few at a time as it faults blocks in,
+  and adopts those it finds, to evict them in turn.
+*/
+struct LeafPager {
+  struct Stats {
+    uint64_t touches;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t adopted;      // Blocks found mapped without having been touched
+    size_t resident_bytes; // As accounted for by the pager
+    size_t mapped_bytes;   // As measured in the page tables
+    size_t budget_bytes;
+  };
+
+  /** @brief Start with all the leaves of the grids evicted. The grids must point into the same file mapping. The temperature grid is optional. */
+  template <typename BuildT>
+  LeafPager(const nanovdb::NanoGrid<BuildT>& density, const VolumeGrids::TemperatureGridT* temperature, size_t budget_bytes)
+    : LeafPager(temperature ? std::vector { leaves_of(density), leaves_of(*temperature) } : std::vector { leaves_of(density) }, budget_bytes)
+  {}
+
+  ~LeafPager();
+
+  LeafPager(const LeafPager&) = delete;
+  LeafPager& operator=(const LeafPager&) = delete;
+
+  /** @brief Mark the block of the leaf as recently used, faulting it in (and evicting others) if needed. Thread safe. */
+  inline void touch(const void* leaf) const {
+    size_t block = (reinterpret_cast<uintptr_t>(leaf) >> BLOCK_SHIFT) - m_first_block;
+
+    uint8_t state = m_blocks[block].load(std::memory_order_relaxed);
+    if (state == REFERENCED)
+      return;
+
+    if (state == UNREFERENCED and m_blocks[block].compare_exchange_strong(state, REFERENCED, std::memory_order_relaxed))
+      return;
+
+    fault(block);
+  }
+
+  /**
+    @brief Touch the leaves read by the trilinear stencil with lower corner ijk, for the reads which don't pin them (see LeafStencilCache).
+    @return How many leaves were touched.
+  */
+  template <typename AccessorT>
+  unsigned int touch_stencil(const AccessorT& acc, const nanovdb::math::Coord& ijk) const {
+    unsigned int ans = 0;
+    for (int c = 0; c < 8; ++c) {
+      if (const auto* leaf = acc.probeLeaf(ijk.offsetBy((c >> 2) & 1, (c >> 1) & 1, c & 1))) {
+        touch(leaf);
+        ++ans;
+      }
+    }
+    return ans;
+  }
+
+  /** @brief Count touches, which are counted by the callers (e.g. per ray) to keep the shared counters out of the hot path. */
+  void record_touches(uint64_t n) const { m_touches.fetch_add(n, std::memory_order_relaxed); }
+
+  /** @brief Also measures the mapped bytes, so it reads the page tables of all the leaves. */
+  Stats stats() const;
+
+private:
+  static constexpr unsigned int BLOCK_SHIFT = 20;
+  static constexpr size_t BLOCK_SIZE = size_t(1) << BLOCK_SHIFT;
+
+  enum : uint8_t { ABSENT, REFERENCED, UNREFERENCED };
+
+  using range_t = std::pair<uintptr_t, uintptr_t>;
+
+  template <typename BuildT>
+  static range_t leaves_of(const nanovdb::NanoGrid<BuildT>& grid) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(grid.tree().getFirstLeaf());
+    return { begin, begin + grid.tree().template nodeCount<typename GridTypes<BuildT>::LeafT>() * sizeof(typename GridTypes<BuildT>::LeafT) };
+  }
+
+  /** Each of the leaves ranges is [begin, end). */
+  LeafPager(std::vector<range_t> leaves, size_t budget_bytes);
+
+  /** Slow path of touch() - the block is not resident. Called with the mutex unlocked. */
+  void fault(size_t block) const;
+
+  /** @brief Evict blocks until the resident ones fit in the budget, sparing the specified one. Called with the mutex locked. */
+  void sweep(size_t spared) const;
+
+  /** @brief If the block is absent but any of its leaf pages is mapped, adopt it as resident. Called with the mutex locked. */
+  void adopt_if_mapped(size_t block) const;
+
+  /** @brief Call f(begin, end) on each page aligned range of the block which only holds leaves, or which holds any of them. */
+  template <typename F>
+  void for_each_leaf_pages(size_t block, bool only_leaves, F&& f) const;
+
+  /** @brief Drop the pages of the block which only hold leaves. */
+  void evict(size_t block) const;
+
+  /** @return How many of the pages of the block which only hold leaves are mapped, or 0 if the page tables can't be read. */
+  size_t mapped_pages(size_t block) const;
+
+  // Sorted, and within the same mapping
+  std::vector<range_t> m_leaves;
+  uintptr_t m_first_block;
+
+  size_t m_num_blocks;
+  size_t m_budget_blocks;
+
+  std::unique_ptr<std::atomic<uint8_t>[]> m_blocks;
+
+  // /proc/self/pagemap, or -1 if it can't be read
+  int m_pagemap_fd;
+
+  // Guards the faults and evictions, and the clock hands
+  mutable std::mutex m_mtx;
+  mutable size_t m_clock_hand = 0;
+  mutable size_t m_adopt_hand = 0;
+  mutable size_t m_resident_blocks = 0;
+
+  mutable std::atomic<uint64_t> m_touches = 0;
+  mutable std::atomic<uint64_t> m_misses = 0;
+  mutable std::atomic<uint64_t> m_evictions = 0;
+  mutable std::atomic<uint64_t> m_adopted = 0;
+};
+
+} // namespace vpt
+
+#endif // !VPT_LEAF_PAGER_HPP
@@ -0,0 +1,29 @@
+#ifndef VPT_LOADED_VOLUME_HPP
+#define VPT_LOADED_VOLUME_HPP
+
+#include <filesystem>
+
+#include <vpt/configuration.hpp>
+#include <vpt/volume_grids.hpp>
+#include <vpt/volume.hpp>
+
+namespace vpt {
+
+/**
+  A volume loaded and preprocessed for rendering with a configuration: its majorants, the shadows if they are cached, and the leaf pager if enabled.
+  The majorants are cached next to the volume if the configuration says so.
+*/
+struct LoadedVolume {
+  VolumeGrids grids;
+  Volume vol; // Refers to the grids, so it's declared after them
+
+  /** @throws VolumeLoadError If the grids can't be loaded. */
+  LoadedVolume(const Configuration& cfg, const std::filesystem::path& path);
+
+  LoadedVolume(const LoadedVolume&) = delete;
+  LoadedVolume& operator=(const LoadedVolume&) = delete;
+};
+
+} // namespace vpt
+
+#endif // !VPT_LOADED_VOLUME_HPP
@@ -0,0 +1,106 @@
+#ifndef VPT_MAJORANT_GRID_HPP
+#define VPT_MAJORANT_GRID_HPP
+
+#include <vector>
+
+#include <Eigen/Dense>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-private-field"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include <nanovdb/math/Ray.h>
+#pragma GCC diagnostic pop
+
+#include <vpt/volume_grids.hpp>
+
+namespace vpt {
+
+/**
+  A dense grid of coarse cells over the density grid index space, each storing a majorant and a minorant of the density.
+  They bound the interpolated density at any point inside of the cell, from above and below respectively.
+*/
+struct MajorantGrid {
+  using RayT = nanovdb::math::Ray<float>;
+
+  /**
+    A plain 3D-DDA (Amanatides & Woo) over the cells of a MajorantGrid.
+    The ray is expected to be in density index space, and already clipped to the density bounding box.
+  */
+  struct DDA {
+    DDA(const MajorantGrid& grid, const RayT& ray);
+
+    const Eigen::Vector3i& cell() const { return m_cell; }
+
+    /** @return The time at which the ray entered the current cell. */
+    float time() const { return m_t; }
+
+    /** @return The time at which the ray will leave the current cell. */
+    float exit_time() const { return std::min(m_t_next.minCoeff(), m_t_end); }
+
+    bool done() const { return m_done; }
+
+    /** Step to the next cell. @return false if the ray left the grid. */
+    bool step();
+
+  private:
+    const MajorantGrid& m_grid;
+
+    Eigen::Vector3i m_cell;
+    Eigen::Vector3i m_step;
+    Eigen::Vector3f m_t_next;
+    Eigen::Vector3f m_t_delta;
+
+    float m_t;
+    float m_t_end;
+    bool m_done;
+  };
+
+  /**
+    @brief Build the majorant grid from the density grid.
+    @param cell_size The size of each cell in voxels.
+  */
+  template <typename BuildT>
+  MajorantGrid(const nanovdb::NanoGrid<BuildT>& density, unsigned int cell_size);
+
+  unsigned int cell_size() const { return m_cell_size; }
+  const Eigen::Vector3i& resolution() const { return m_resolution; }
+
+  /** @return The index space coordinate of the lower corner of the cell (0, 0, 0). */
+  const Eigen::Vector3i& origin() const { return m_origin; }
+
+  inline float majorant(const Eigen::Vector3i& cell) const { return m_majorants[linear_index(cell)]; }
+  inline float minorant(const Eigen::Vector3i& cell) const { return m_minorants[linear_index(cell)]; }
+
+  inline bool contains(const Eigen::Vector3i& cell) const {
+    return (cell.array() >= 0).all() and (cell.array() < m_resolution.array()).all();
+  }
+
+  /** @return The cell containing the specified index space point, clamped to the grid. */
+  Eigen::Vector3i cell_of(const Eigen::Vector3f& idx) const;
+
+  size_t size_bytes() const { return (m_majorants.size() + m_minorants.size()) * sizeof(float); }
+
+private:
+  inline size_t linear_index(const Eigen::Vector3i& cell) const {
+    return (static_cast<size_t>(cell.z()) * m_resolution.y() + cell.y()) * m_resolution.x() + cell.x();
+  }
+
+  /**
+    Raise the majorant (and lower the minorant) of all the cells whose samples may read any voxel in the (inclusive) voxel bbox,
+    and count the voxels they read in the coverage of the cells.
+  */
+  void splat(const nanovdb::math::BBox<nanovdb::math::Coord>& voxels, float max_value, float min_value, std::vector<uint64_t>& coverage);
+
+  unsigned int m_cell_size;
+  Eigen::Vector3i m_origin;
+  Eigen::Vector3i m_resolution;
+  std::vector<float> m_majorants;
+  std::vector<float> m_minorants;
+};
+
+} // namespace vpt
+
+#endif // !VPT_MAJORANT_GRID_HPP
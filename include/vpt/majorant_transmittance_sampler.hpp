@@ -1,8 +1,11 @@
 #ifndef VPT_MAJORANT_TRANSMITTANCE_SAMPLER
 #define VPT_MAJORANT_TRANSMITTANCE_SAMPLER
 
+#include <array>
+
 #include <vpt/volume.hpp>
 #include <vpt/random.hpp>
+#include <vpt/density_sampler.hpp>
 
 namespace vpt {
 
@@ -12,30 +15,50 @@ struct MediumProperties {
   float density;
 };
 
+template <typename BuildT>
 struct MajorantTransmittanceSampler {
+  using GridT = typename GridTypes<BuildT>::GridT;
+  using AccessorT = typename GridTypes<BuildT>::AccessorT;
+
   MajorantTransmittanceSampler(
-    RayMajorantIterator& it,
+    RayMajorantIterator<BuildT>& it,
     RandomNumberGenerator& rng,
-    const VolumeGrids::GridT& density_grid,
-    const VolumeGrids::AccessorT& density_accessor,
-    float sigma_t
+    const GridT& density_grid,
+    const AccessorT& density_accessor,
+    float sigma_t,
+    const LeafPager* leaf_pager = nullptr
   );
 
-  float T_maj() const { return m_T_maj; }
-
   std::optional<MediumProperties> next();
 private:
-  float m_T_maj;
+  /*
+  The tentative collisions do not depend on the density, so we can draw a batch of them in advance and
+  look up their densities all at once. The batch never crosses a segment boundary.
+  Most walks stop at one of the first collisions of a segment, so the batches start with a single collision and
+  double up to BATCH_SIZE: the lookups past the collision the walk stops at are never more than those before it.
+  */
+  static constexpr size_t BATCH_SIZE = 16;
+
+  /** Draw the next batch of tentative collisions in the current segment. */
+  void fill_batch();
 
   float m_sigma_t;
 
   RandomNumberGenerator& m_rng;
-  RayMajorantIterator m_iterator;
+  RayMajorantIterator<BuildT> m_iterator;
+
+  const GridT& m_density_grid;
+  DensitySampler<BuildT> m_density_sampler;
 
-  const VolumeGrids::GridT& m_density_grid;
-  nanovdb::math::SampleFromVoxels<VolumeGrids::AccessorT, 1> m_density_sampler;
+  std::optional<typename RayMajorantIterator<BuildT>::Segment> m_segment;
 
-  std::optional<RayMajorantIterator::Segment> m_segment;
+  // The current batch of tentative collisions
+  float m_batch_sigma_maj;
+  size_t m_batch_capacity; // Of the next batch
+  size_t m_batch_size;
+  size_t m_batch_idx;
+  std::array<nanovdb::Vec3f, BATCH_SIZE> m_batch_points;
+  std::array<float, BATCH_SIZE> m_batch_density;
 };
 
 } // namespace vpt
@@ -0,0 +1,57 @@
+#ifndef VPT_PARALLEL_HPP
+#define VPT_PARALLEL_HPP
+
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+namespace vpt {
+
+namespace detail {
+
+/**
+  @brief Call work on the calling thread, and on up to num_helpers threads of a pool shared by the whole process. Return once all the calls have returned.
+  The pool starts threads as it needs them, and keeps them for the next calls - which also come from the viewer or the server, so the helpers may be busy with another call.
+  Those which are not free by the time the calling thread is done are not waited for: work must be done by then whoever joined in.
+*/
+void run_with_helpers(unsigned int num_helpers, const std::function<void()>& work);
+
+} // namespace detail
+
+/**
+  @brief Call body(state, i) for each i in [0, count), distributing the indices across num_threads threads: the calling thread and helpers from a shared pool.
+  Each thread creates its own state by calling make_state() once (e.g. a grid accessor, which is not thread safe).
+  Indices are handed out in chunks of chunk_size through a shared counter, so the load is balanced even when the cost per index varies.
+*/
+template <typename MakeState, typename Body>
+static inline void parallel_for(size_t count, unsigned int num_threads, MakeState&& make_state, Body&& body, size_t chunk_size = 64) {
+  num_threads = std::max(1u, std::min<unsigned int>(num_threads, static_cast<unsigned int>((count + chunk_size - 1) / chunk_size)));
+
+  std::atomic<size_t> next(0);
+
+  auto work = [&]() {
+    auto state = make_state();
+
+    for (;;) {
+      size_t begin = next.fetch_add(chunk_size, std::memory_order_relaxed);
+      if (begin >= count)
+        break;
+
+      size_t end = std::min(count, begin + chunk_size);
+      for (size_t i = begin; i < end; ++i)
+        body(state, i);
+    }
+  };
+
+  if (num_threads == 1) {
+    work();
+    return;
+  }
+
+  // The calling thread works too.
+  detail::run_with_helpers(num_threads - 1, work);
+}
+
+} // namespace vpt
+
+#endif // !VPT_PARALLEL_HPP
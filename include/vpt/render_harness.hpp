@@ -0,0 +1,29 @@
+#ifndef VPT_RENDER_HARNESS_HPP
+#define VPT_RENDER_HARNESS_HPP
+
+#include <span>
+
+#include <vpt/configuration.hpp>
+#include <vpt/volume.hpp>
+#include <vpt/film.hpp>
+#include <vpt/tile_provider.hpp>
+#include <vpt/worker.hpp>
+
+/*
+Renders to completion with threads of their own, for the benchmarks and the tests - which compare their films and throughputs, rather than show or save them as vpt does.
+*/
+
+namespace vpt {
+
+/** @brief Render the jobs of the tile provider into the views with num_workers threads, each seeded as in the configuration. Returns once they are all done. */
+void render_with_threads(const Configuration& cfg, const Volume& vol, std::span<const View> views, TileProvider& provider, unsigned int num_workers);
+
+/** @return The number of samples in the film. With adaptive sampling, the pixels don't all have the same number of them. */
+double total_samples(const Film& film);
+
+/** @return Whether the films hold the same bits: sums, sample counts and squared luminances. */
+bool same_film(const Film& a, const Film& b);
+
+} // namespace vpt
+
+#endif // !VPT_RENDER_HARNESS_HPP
@@ -0,0 +1,35 @@
+#ifndef VPT_SERVER_HPP
+#define VPT_SERVER_HPP
+
+#include <filesystem>
+
+namespace vpt {
+
+struct ServerParameters {
+  // The Unix domain socket to listen on. If empty, the jobs are read from stdin and the replies written to stdout.
+  std::filesystem::path socket_path;
+
+  // The workers shared by all the jobs. The num_workers of the jobs is ignored.
+  unsigned int num_workers;
+
+  // How many loaded volumes are kept for later jobs. When full, the least recently used one is dropped.
+  size_t max_cached_volumes;
+};
+
+/**
+  @brief Render the jobs submitted to the server, until it is interrupted - or until stdin is closed, if it reads from there.
+
+  Jobs are RenderJob objects in JSON, one per line. Their volume paths are relative to the working directory of the server.
+  They are rendered one at a time, in the order they are received, each of them by all the workers.
+  Loaded volumes are cached by path and volume_hash(), so that the jobs on the same volume skip loading and preprocessing it.
+
+  Each job gets a reply, a line of JSON with its id, whether it succeeded (or why not), whether its volume was cached and how long each step took.
+  If the job has no output path, the raw film follows the reply, in the format of save_film() and with its size in the reply.
+
+  @return The exit status.
+*/
+int serve(const ServerParameters& params);
+
+} // namespace vpt
+
+#endif // !VPT_SERVER_HPP
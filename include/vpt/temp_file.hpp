@@ -0,0 +1,34 @@
+#ifndef VPT_TEMP_FILE_HPP
+#define VPT_TEMP_FILE_HPP
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vpt {
+
+/**
+  @return A new empty file next to path, with a name of its own (path.tmp.XXXXXX), to write and then rename to path.
+  Several processes writing the same path at once each get their own file, so none of them truncates or renames a file another is still writing.
+  std::nullopt if it can't be created.
+*/
+static inline std::optional<std::filesystem::path> create_temp_file(const std::filesystem::path& path) {
+  std::string name = path.string() + ".tmp.XXXXXX";
+
+  int fd = mkstemp(name.data());
+  if (fd < 0)
+    return std::nullopt;
+
+  // mkstemp only lets the owner read it, but the other users may share the file it becomes
+  fchmod(fd, 0644);
+  close(fd);
+
+  return name;
+}
+
+} // namespace vpt
+
+#endif // !VPT_TEMP_FILE_HPP
@@ -0,0 +1,36 @@
+#ifndef VPT_TILE_ORDER_HPP
+#define VPT_TILE_ORDER_HPP
+
+#include <span>
+#include <vector>
+
+#include <vpt/configuration.hpp>
+#include <vpt/tile_provider.hpp>
+#include <vpt/volume.hpp>
+#include <vpt/worker.hpp>
+
+/*
+The orders of the tiles for TileProvider::set_order.
+The workers take turns along the order, so with an order which keeps neighbouring tiles close, they trace rays through the same parts of the volume at the same time - and share more of its leaves in the cache.
+*/
+
+namespace vpt {
+
+/** @return The tiles of a grid of num_tiles along a Hilbert curve, over the smallest power of two square which covers the grid. */
+std::vector<TileProvider::tile_index_t> hilbert_tile_order(const TileProvider::tile_size_t& num_tiles);
+
+/** @return The tiles of a grid of num_tiles along a square spiral, ring after ring from the centre outwards. */
+std::vector<TileProvider::tile_index_t> spiral_tile_order(const TileProvider::tile_size_t& num_tiles);
+
+/**
+  @return A rough estimate of how expensive each tile of the views is to render: the majorant optical depth along the camera ray through its centre, summed over the views.
+  That is the expected number of collisions the delta tracking samples along the camera ray. The scattered paths are not accounted for.
+*/
+std::vector<float> estimate_tile_costs(const Volume& vol, std::span<const View> views, const TileProvider& tp);
+
+/** @brief Give the tile provider the tile order of the configuration, if it is not Raster (which the provider does by itself). Must be called before the workers start. */
+void order_tiles(const Configuration& cfg, const Volume& vol, std::span<const View> views, TileProvider& tp);
+
+} // namespace vpt
+
+#endif // !VPT_TILE_ORDER_HPP
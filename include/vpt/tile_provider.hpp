@@ -2,34 +2,64 @@
 #define VPT_TILEPROVIDER_HPP
 
 #include <mutex>
+#include <chrono>
+#include <deque>
+#include <atomic>
+#include <optional>
+#include <functional>
+#include <utility>
+#include <span>
 #include <vpt/image.hpp>
 
 namespace vpt {
 
+/**
+  Hands out (tile, wave) jobs to the workers.
+
+  Each worker owns a deque of jobs for a contiguous block of tiles, and steals from the others when it runs out.
+  Or, if the tiles are given an order (see set_order), the workers take turns along it - so that at any time they render tiles which are close in that order.
+  The job for the next wave of a tile is only queued once the previous one is done, so a tile is never rendered by two threads at once.
+
+  There may be several views of the same size, whose tiles are interleaved: tile t of all the views, then tile t + 1, and so on.
+  So each worker starts on the same block of every view, and the workers stay busy until the last view is done.
+
+  Optionally, the tiles go through preview levels before their first wave (see set_preview), which trace one path per block of pixels rather than per pixel.
+*/
 struct TileProvider {
   using tile_index_t = unsigned int;
+  using worker_index_t = unsigned int;
   using tile_point_t = Eigen::Vector2<tile_index_t>;
   using tile_size_t = tile_point_t;
   using wave_index_t = unsigned int;
 
   struct token {
-    image_rect_t compute_rect() { return m_tp.compute_tile_rect(m_idx); }
+    image_rect_t compute_rect() { return m_tp.compute_tile_rect(m_tp.view_tile(m_idx)); }
+    size_t view() const { return m_idx % m_tp.m_num_views; }
     bool valid() const { return m_idx != INVALID_IDX; }
     size_t wave() const { return m_wave_idx; }
     size_t jid() const { return m_jid; }
     operator bool() const { return valid(); }
 
+    /** @return The size of the blocks of pixels which share a path: 1 for the waves, more for the preview levels. */
+    image_index_t preview_block() const { return image_index_t(1) << m_preview_level; }
+
+    /** @brief The tile is good enough - don't give it any more waves. */
+    void mark_converged() { m_converged = true; }
+
     ~token() {
       if (valid()) {
-        m_tp.m_tile_wave[m_idx] = m_wave_idx;
-        m_tp.m_tile_wave[m_idx].notify_all();
+        m_tp.complete(m_worker_idx, m_idx, m_wave_idx, m_preview_level, m_converged, std::chrono::steady_clock::now() - m_start);
+        m_tp.review_held_jobs();
       }
     }
     token(const token&) = delete;
     token& operator=(const token&) = delete;
 
-    // We don't need moving for now...
-    token(token&&) = delete;
+    // Moving leaves the other token invalid, so that the job is completed once. It can't be assigned, as it refers to its provider.
+    token(token&& other) noexcept
+      : m_idx(std::exchange(other.m_idx, INVALID_IDX)), m_tp(other.m_tp), m_worker_idx(other.m_worker_idx), m_wave_idx(other.m_wave_idx),
+        m_preview_level(other.m_preview_level), m_jid(other.m_jid), m_converged(other.m_converged), m_start(other.m_start)
+    { }
     token& operator=(token&&) = delete;
 
   private:
@@ -38,34 +68,94 @@ struct TileProvider {
     friend TileProvider;
 
     static token invalid(TileProvider& tp) {
-      return token { tp, INVALID_IDX, 0, 0 };
+      return token { tp, 0, INVALID_IDX, 0, 0, 0 };
     }
 
-    token(TileProvider& tp, unsigned int idx, wave_index_t wave_idx, size_t jid)
-      : m_idx(idx), m_tp(tp), m_wave_idx(wave_idx), m_jid(jid)
+    token(TileProvider& tp, worker_index_t worker_idx, unsigned int idx, wave_index_t wave_idx, unsigned int preview_level, size_t jid)
+      : m_idx(idx), m_tp(tp), m_worker_idx(worker_idx), m_wave_idx(wave_idx), m_preview_level(preview_level), m_jid(jid), m_converged(false),
+        m_start(std::chrono::steady_clock::now())
     { }
 
     tile_index_t m_idx;
     TileProvider& m_tp;
+    worker_index_t m_worker_idx;
     wave_index_t m_wave_idx;
+    unsigned int m_preview_level;
     size_t m_jid;
+    bool m_converged;
+    std::chrono::steady_clock::time_point m_start;
   };
 
   friend token;
 
-  TileProvider(const image_size_t& img_size, wave_index_t waves, const image_size_t& tile_size);
+  /** The progress of a tile, as saved in a checkpoint. */
+  struct tile_state {
+    wave_index_t wave; // The last wave which was completed
+    bool converged;    // If true, the tile gets no more waves
+  };
+
+  using checkpoint_fn = std::function<void(std::span<const tile_state>)>;
+
+  TileProvider(const image_size_t& img_size, wave_index_t waves, const image_size_t& tile_size, worker_index_t num_workers, size_t num_views = 1);
+
+  /** @return The number of tiles of a view along each axis. */
+  const tile_size_t& num_tiles() const { return m_num_tiles; }
+
+  /** @return The pixels of the tile with the specified index within its view. */
+  image_rect_t compute_tile_rect(tile_index_t view_tile_idx) const;
 
-  token next();
+  /**
+    @brief Hand out the jobs in the specified order of the tiles (indices within a view, each of them once): the workers get every num_workers-th one of them, in turns.
+    So the workers start on neighbouring tiles, and keep to them wave after wave, if neighbouring tiles are close in the order. The tile t of each view follows that of the previous view.
+    Must be called before the workers start. It also applies to the jobs queued by restore() and later calls.
+  */
+  void set_order(std::span<const tile_index_t> order);
+
+  /**
+    @return The next job for the specified worker, or an invalid token if there are no jobs left.
+    @param wait If false, also return an invalid token rather than wait for the running jobs to queue more. A worker which holds tokens must not wait,
+    as the jobs it would wait for may be the successors of its own.
+  */
+  token next(worker_index_t worker_idx, bool wait = true);
   void stop_at_next_wave();
   void stop_now();
 
+  /**
+    @brief Only start the waves which are expected to be complete within time_limit from reset_eta().
+    Until a wave worth of jobs is done, a wave which is not expected to fit is held back rather than given up, as the estimate of the throughput is still rough.
+    @param samples_per_second The expected throughput, used until enough jobs are done to measure it. If 0, it is always measured.
+  */
+  void set_time_budget(std::chrono::duration<float> time_limit, float samples_per_second);
+
+  /**
+    @brief Every period waves, hold the next wave back until all the tiles are done with the current one, then call fn with the state of the tiles.
+    Nothing is being rendered while fn runs, so the film is consistent with the tile states.
+  */
+  void set_checkpoint(wave_index_t period, checkpoint_fn fn);
+
+  /** @return The state of each tile. Only consistent when no job is running, e.g. after the workers are done. */
+  std::vector<tile_state> tile_states() const;
+
+  /** @brief Continue from the specified tile states (e.g. loaded from a checkpoint), instead of from scratch. Must be called before the workers start. */
+  void restore(std::span<const tile_state> tiles);
+
+  /**
+    @brief Before their first wave, give the tiles which have none yet the preview levels from levels down to 1, each tracing one path per 2^level x 2^level block of pixels.
+    So a coarse image shows up quickly. The preview samples go to the preview of the film, and don't count towards the progress.
+    Must be called before the workers start, and after restore().
+  */
+  void set_preview(unsigned int levels);
+
   void reset_eta() {
     m_start_t = std::chrono::steady_clock::now();
   }
 
   std::chrono::duration<float> eta() const {
     float progress = progress_ratio();
-    float avg_progress_rate = progress / std::chrono::duration<float>(std::chrono::steady_clock::now() - m_start_t).count();
+
+    // Only the progress made since the start counts towards the rate, not the one restored from a checkpoint.
+    float restored_progress = static_cast<float>(m_restored_jobs) / static_cast<float>(m_wave_start_monitor.requested_waves * m_tile_wave.size());
+    float avg_progress_rate = (progress - restored_progress) / std::chrono::duration<float>(std::chrono::steady_clock::now() - m_start_t).count();
     return std::chrono::duration<float>((1 - progress) / avg_progress_rate);
   }
 
@@ -73,20 +163,88 @@ struct TileProvider {
     return static_cast<unsigned int>(progress_ratio() * 100.0f);
   }
 
+  /** @brief Log how many jobs each worker processed, and how many of them were stolen. */
+  void log_stats() const;
+
 private:
+  struct job {
+    tile_index_t tile_idx;
+    wave_index_t wave_idx;
+    unsigned int preview_level = 0; // If > 0, the preview level to go through before the wave
+  };
+
+  struct parked_job {
+    worker_index_t worker_idx;
+    job j;
+  };
+
+  struct worker_queue {
+    std::mutex mtx;
+    std::deque<job> jobs;
+
+    // Stats
+    size_t processed = 0;
+    size_t stolen = 0;
+  };
+
   float progress_ratio() const {
-    size_t max_jid = m_wave_start_monitor.requested_waves * m_tile_wave.size();
-    return static_cast<float>(m_job_idx) / static_cast<float>(max_jid);
+    size_t max_jobs = m_wave_start_monitor.requested_waves * m_tile_wave.size();
+    return static_cast<float>(m_restored_jobs + m_completed_jobs + m_skipped_jobs) / static_cast<float>(max_jobs);
   }
 
-  image_rect_t compute_tile_rect(tile_index_t tile_idx) const;
-  bool wave_should_be_processed(wave_index_t idx);
+  /** @return The index of the tile within its view. */
+  tile_index_t view_tile(tile_index_t tile_idx) const { return static_cast<tile_index_t>(tile_idx / m_num_views); }
+
+  enum class wave_verdict {
+    Process, // The wave of the job started
+    Drop,    // The wave will not start, so the tile is done
+    Hold     // Not decided yet - the job was held back (see review_held_jobs)
+  };
+
+  /** @brief Decide whether the wave of a job popped by the specified worker is to be processed, starting it if it's the first job of the wave. */
+  wave_verdict judge_wave(worker_index_t worker_idx, const job& j);
+
+  enum class budget_fit { Yes, No, Unsure };
+
+  /**
+    @return Whether all the jobs up to and including the specified wave are expected to be done within the time budget.
+    Unsure if they are not expected to, but too few jobs are done yet to tell - unless final, e.g. when there's nothing left running to measure.
+    Called with the wave start monitor locked.
+  */
+  budget_fit wave_fits_in_budget(wave_index_t idx, bool final) const;
+
+  /** @brief If jobs are held back, decide their wave again with the jobs done since. */
+  void review_held_jobs();
+
+  /** @brief Pop a job from the front of the worker deque. */
+  std::optional<job> pop(worker_queue& queue);
+
+  /** @brief Push a job to the back of the worker deque, and wake up an idle worker if there is one. */
+  void push(worker_queue& queue, const job& j);
+
+  /** @brief Called when a job is done, after job_time. Queues the job for the next preview level or wave of the tile, unless it converged. */
+  void complete(worker_index_t worker_idx, tile_index_t tile_idx, wave_index_t wave_idx, unsigned int preview_level, bool converged, std::chrono::steady_clock::duration job_time);
+
+  /** @brief A job was dropped, or completed without a successor. */
+  void retire_job();
+
+  /** @brief Hand out the first jobs to the workers, giving each of them a contiguous block of tiles - or turns along the order of the tiles, if any. */
+  void distribute(std::vector<job> jobs);
+
+  /** @brief Hold back a job until the next checkpoint. */
+  void park(worker_index_t worker_idx, const job& j);
+
+  /** @brief If all the jobs left are parked, write the checkpoint and release them. */
+  void try_checkpoint();
 
   struct wave_start_monitor {
     std::mutex mtx;
     wave_index_t requested_waves;
     wave_index_t max_wave_idx;
 
+    // The jobs of wave max_wave_idx + 1, until it is decided whether it starts
+    std::vector<parked_job> held;
+
     explicit wave_start_monitor(wave_index_t requested_waves)
       : requested_waves(requested_waves),
         max_wave_idx(0) 
@@ -95,15 +253,56 @@ private:
 
   std::chrono::steady_clock::time_point m_start_t;
 
-  bool m_force_stop;
+  // The time budget, starting from m_start_t. Zero if there is none.
+  std::chrono::duration<float> m_time_limit;
+  float m_expected_jobs_per_second;
+
+  // The time the workers spent on the waves completed since the start, to measure the throughput before the wall clock can
+  std::atomic_uint64_t m_job_ns;
+
+  // The size of the held jobs of the wave start monitor, to check it without locking
+  std::atomic_size_t m_num_held;
+
+  // Set by stop_now() from another thread than the workers
+  std::atomic<bool> m_force_stop;
 
   image_size_t m_img_size;
   image_size_t m_tile_size;
 
   tile_size_t m_num_tiles;
+  size_t m_num_views;
+
+  std::vector<worker_queue> m_queues;
+
+  // Jobs which are either queued or being processed. When it reaches zero, there's nothing left to do.
+  std::atomic_size_t m_outstanding_jobs;
+  std::atomic_size_t m_completed_jobs;
+
+  // Jobs which will never run because their tile converged early
+  std::atomic_size_t m_skipped_jobs;
 
-  std::atomic_size_t m_job_idx;
+  // Bumped whenever a job is pushed (or the last job retires), for the idle workers to wait on.
+  std::atomic_uint32_t m_generation;
+
+  // The workers waiting on the generation, so that pushing a job only notifies when there are some
+  std::atomic_uint32_t m_num_waiting;
+
+  // Jobs done before restoring from a checkpoint (including the skipped ones), for the progress.
+  size_t m_restored_jobs;
+
+  // The position of each tile of a view in the order of set_order(), empty if there is none
+  std::vector<tile_index_t> m_tile_rank;
+
+  // The last wave completed by each tile, and whether it converged
   std::vector<std::atomic<wave_index_t>> m_tile_wave;
+  std::vector<std::atomic<bool>> m_tile_converged;
+
+  wave_index_t m_checkpoint_period;
+  checkpoint_fn m_checkpoint_fn;
+
+  // The jobs of the next wave, held back until the checkpoint is written
+  std::mutex m_barrier_mtx;
+  std::vector<parked_job> m_parked;
 };
 
 } // namespace vpt
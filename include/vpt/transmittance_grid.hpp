@@ -0,0 +1,55 @@
+#ifndef VPT_TRANSMITTANCE_GRID_HPP
+#define VPT_TRANSMITTANCE_GRID_HPP
+
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include <vpt/volume_grids.hpp>
+#include <vpt/leaf_pager.hpp>
+
+namespace vpt {
+
+/**
+  A dense grid of transmittance values towards a distant light (a deep shadow map), aligned with the light direction.
+  Looking up the transmittance is a trilinear interpolation, in place of tracing a shadow ray.
+  The bias is controlled by the size of the cells.
+*/
+struct TransmittanceGrid {
+  /**
+    @brief Integrate the optical depth along each column of cells parallel to the light direction.
+    @param wi The (world space) direction towards the light.
+    @param sigma_t The extinction coefficient per unit density.
+    @param cell_size The size of each cell in voxels of the density grid.
+    @param pager If not null, the pager of the density leaves, which the pass reads through.
+  */
+  template <typename BuildT>
+  TransmittanceGrid(const nanovdb::NanoGrid<BuildT>& density, const Eigen::Vector3f& wi, float sigma_t, float cell_size, unsigned int num_threads, const LeafPager* pager = nullptr);
+
+  /** @return The transmittance from the world space point to the light. */
+  float transmittance(const Eigen::Vector3f& world) const;
+
+  const Eigen::Vector3i& resolution() const { return m_resolution; }
+  size_t size_bytes() const { return m_transmittance.size() * sizeof(float); }
+
+private:
+  inline size_t linear_index(int x, int y, int z) const {
+    return (static_cast<size_t>(z) * m_resolution.y() + y) * m_resolution.x() + x;
+  }
+
+  // World to light space rotation. The z axis points towards the light.
+  Eigen::Matrix3f m_world_to_light;
+
+  // Light space coordinates of the lower corner of the grid
+  Eigen::Vector3f m_origin;
+
+  float m_cell_size; // in world units
+  Eigen::Vector3i m_resolution;
+
+  // Transmittance at the center of each cell
+  std::vector<float> m_transmittance;
+};
+
+} // namespace vpt
+
+#endif // !VPT_TRANSMITTANCE_GRID_HPP
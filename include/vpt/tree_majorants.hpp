@@ -0,0 +1,90 @@
+#ifndef VPT_TREE_MAJORANTS_HPP
+#define VPT_TREE_MAJORANTS_HPP
+
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+#include <vpt/volume_grids.hpp>
+
+namespace vpt {
+
+/**
+  Majorant densities for every node and tile of the density tree, accounting for the effect of interpolation.
+
+  The majorants are stored on the side rather than in the node statistics, because tiles hold real density values
+  which the interpolator reads, and so they cannot be inflated in place.
+*/
+template <typename BuildT>
+struct TreeMajorants {
+  using CoordT = nanovdb::math::Coord;
+
+  using GridT = typename GridTypes<BuildT>::GridT;
+  using AccessorT = typename GridTypes<BuildT>::AccessorT;
+  using LeafT = typename GridTypes<BuildT>::LeafT;
+  using LowerT = typename GridTypes<BuildT>::LowerT;
+  using UpperT = typename GridTypes<BuildT>::UpperT;
+
+  struct Node {
+    float majorant;
+    float minorant; // A lower bound of the density, only computed for the leaves (0 elsewhere)
+    uint32_t dim;
+  };
+
+  /**
+    @brief Compute the majorants bottom-up, from the leaves to the root.
+    @param order The size of the stencil used by the interpolator minus 1 divided by 2. For example, for the trilinear interpolator this is 1.
+    @param num_threads The number of threads the nodes of each level are distributed across.
+  */
+  TreeMajorants(const GridT& density, unsigned int order, unsigned int num_threads);
+
+  /**
+    @brief Load the majorants from a cache file previously written by save().
+    @return std::nullopt if the file does not exist, or if it was computed for a different grid (as identified by grid_hash), order or format version.
+  */
+  static std::optional<TreeMajorants> load(const std::filesystem::path& path, const GridT& density, unsigned int order, uint64_t grid_hash);
+
+  /** @brief Save the majorants to a cache file. Failures are only logged, as the cache is just an optimization. */
+  void save(const std::filesystem::path& path, uint64_t grid_hash) const;
+
+  /** @return A hash of the whole grid buffer, which identifies the grid in the cache files. */
+  static uint64_t grid_hash(const GridT& density, unsigned int num_threads);
+
+  /**
+    @return The majorant and the dimension of the largest node-aligned region containing ijk which is bounded by a single majorant.
+    That is: the leaf or the tile containing ijk, or a whole internal node if its majorant is zero.
+  */
+  Node lookup(const CoordT& ijk, const AccessorT& acc) const;
+
+  float leaf_majorant(const LeafT* leaf) const { return m_leaf[leaf - m_first_leaf]; }
+  float leaf_minorant(const LeafT* leaf) const { return m_leaf_min[leaf - m_first_leaf]; }
+
+private:
+  /** Allocate the (uninitialized) majorant arrays. */
+  TreeMajorants(const GridT& density, unsigned int order);
+
+  const GridT& m_density;
+  unsigned int m_order;
+
+  const LeafT* m_first_leaf;
+  const LowerT* m_first_lower;
+  const UpperT* m_first_upper;
+
+  // Per node majorants
+  std::vector<float> m_leaf;
+  std::vector<float> m_leaf_min;
+  std::vector<float> m_lower;
+  std::vector<float> m_upper;
+
+  // Per tile majorants. LowerT::SIZE (resp. UpperT::SIZE) consecutive entries for each lower (resp. upper) node - the child entries are unused.
+  std::vector<float> m_lower_tiles;
+  std::vector<float> m_upper_tiles;
+  std::vector<float> m_root_tiles;
+
+  // Majorant for the regions not covered by any root tile
+  float m_background;
+};
+
+} // namespace vpt
+
+#endif // !VPT_TREE_MAJORANTS_HPP
@@ -2,6 +2,7 @@
 #define VPT_UTILS_HPP
 
 #include <type_traits>
+#include <chrono>
 #include <iostream>
 #include <Eigen/Dense>
 
@@ -13,6 +14,27 @@ constexpr static inline T ceildiv(T x, T y) {
   return x / y + (x % y != 0);
 }
 
+/** Integer division rounding towards negative infinity. */
+template <typename T>
+requires std::is_integral_v<T>
+constexpr static inline T floordiv(T x, T y) {
+  return x / y - ((x % y != 0) and ((x < 0) != (y < 0)));
+}
+
+/** Measures the wall clock time elapsed since it was started. */
+struct Stopwatch {
+  Stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+  void restart() { m_start = std::chrono::steady_clock::now(); }
+
+  float elapsed_ms() const {
+    return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point m_start;
+};
+
 template <typename T>
 static inline std::ostream& print_csv(std::ostream& os, const T& arg) {
   return os << arg;
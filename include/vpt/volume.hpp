@@ -3,6 +3,7 @@
 
 #include <vpt/nanovdb_utils.hpp>
 #include <optional>
+#include <variant>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-private-field"
@@ -17,25 +18,38 @@
 
 #include <vpt/configuration.hpp>
 #include <vpt/volume_grids.hpp>
+#include <vpt/majorant_grid.hpp>
+#include <vpt/tree_majorants.hpp>
+#include <vpt/transmittance_grid.hpp>
+#include <vpt/leaf_pager.hpp>
 #include <vpt/ray.hpp>
 
 namespace vpt {
 
+template <typename BuildT>
 struct RayMajorantIterator {
-  using GridT = VolumeGrids::GridT;
+  using GridT = typename GridTypes<BuildT>::GridT;
+  using AccessorT = typename GridTypes<BuildT>::AccessorT;
   using RayT = nanovdb::math::Ray<float>;
   using CoordT = nanovdb::math::Coord;
 
-  static constexpr auto LEAF_DIM = GridT::LeafNodeType::DIM;
+  static constexpr auto LEAF_DIM = GridTypes<BuildT>::LeafT::DIM;
 
   struct Segment {
     float t0; // in voxel units
     float t1; // in voxel units
     float d_maj;
+    float d_min; // A lower bound of the density in the segment, usable as a control density
   };
   
   std::optional<Segment> next();
-  RayMajorantIterator(const RayT& ray, const GridT& density, const GridT::AccessorType& density_accessor);
+
+  /**
+    @param tree_majorants The majorants of the density tree nodes, used when traversing the tree.
+    @param majorant_grid If not null, the ray is traversed with a 3D-DDA over the majorant grid.
+    Otherwise, it is traversed with HDDA over the density tree.
+  */
+  RayMajorantIterator(const RayT& ray, const GridT& density, const AccessorT& density_accessor, const TreeMajorants<BuildT>& tree_majorants, const MajorantGrid* majorant_grid);
 
   const RayT& ray() const { return m_ray; }
 
@@ -52,51 +66,104 @@ struct RayMajorantIterator {
   void record_steps(std::vector<DDAStep>* dst) { m_step_record_dst = dst; }
 
 private:
-  void record_step() {
+  void record_step(int dim, float t, const Eigen::Vector3i& voxel) {
     if (m_step_record_dst != nullptr) {
       m_step_record_dst->push_back({
-        .dim = m_dda.dim(),
+        .dim = dim,
         .majorant = m_majorant,
-        .t = m_dda.time(),
-        .voxel = nanovdb_to_eigen_i(m_dda.voxel()),
-        .hit = nanovdb_to_eigen_f(m_ray(m_dda.time()))
+        .t = t,
+        .voxel = voxel,
+        .hit = nanovdb_to_eigen_f(m_ray(t))
       });
     }
   }
 
+  void record_tree_step() { record_step(m_dda->dim(), m_dda->time(), nanovdb_to_eigen_i(m_dda->voxel())); }
+  void record_grid_step() {
+    record_step(m_majorant_grid->cell_size(), m_grid_dda->time(), m_majorant_grid->origin() + m_grid_dda->cell() * static_cast<int>(m_majorant_grid->cell_size()));
+  }
+
+  std::optional<Segment> next_tree();
+  std::optional<Segment> next_grid();
+
   void update_current_majorant();
 
   float m_scale;
   RayT m_ray;
   float m_majorant;
+  float m_minorant;
+
+  const AccessorT& m_acc;
+  const TreeMajorants<BuildT>& m_tree_majorants;
+  const MajorantGrid* m_majorant_grid;
+
+  // Only one of the two is used, depending on whether we're traversing the majorant grid or the tree.
+  std::optional<nanovdb::math::HDDA<RayT>> m_dda;
+  std::optional<MajorantGrid::DDA> m_grid_dda;
 
-  const GridT::AccessorType& m_acc;
-  nanovdb::math::HDDA<RayT> m_dda;
   std::vector<DDAStep>* m_step_record_dst;
 };
 
 struct Volume {
-  Volume(const VolumeGrids& grids, const VolumeParameters& params);
+  /**
+    @param num_threads The number of threads used to preprocess the volume.
+    @param majorant_cache_path Where the tree majorants are cached. Only used if enabled in the parameters.
+  */
+  Volume(const VolumeGrids& grids, const VolumeParameters& params, unsigned int num_threads = 1, const std::filesystem::path& majorant_cache_path = {});
 
   const Eigen::Vector3f& bounding_sphere_center() const { return m_bsphere_center; }
   float bounding_sphere_radius() const { return m_bsphere_radius; }
 
-  void log_dda_trace(const Ray& vpt_ray, const VolumeGrids::AccessorT& density_accessor) const;
-  void log_majorant_trace(const Ray& vpt_ray, const VolumeGrids::AccessorT& density_accessor) const;
+  void log_dda_trace(const Ray& vpt_ray) const;
+  void log_majorant_trace(const Ray& vpt_ray) const;
 
-  std::optional<RayMajorantIterator> intersect(const vpt::Ray& ray, const VolumeGrids::AccessorT& density_accessor) const;
+  /** @brief BuildT must be the build type of the density grid (see VolumeGrids::visit_density). */
+  template <typename BuildT>
+  std::optional<RayMajorantIterator<BuildT>> intersect(const vpt::Ray& ray, const typename GridTypes<BuildT>::AccessorT& density_accessor) const;
   Eigen::Vector3f world_to_density_index(const Eigen::Vector3f& world) const;
 
   // I really hate that these are here... but whatever - this class is already an almost useless wrapper
   const VolumeParameters& params() const { return m_params; }
 
+  /**
+    @brief Change the parameters the preprocessing doesn't depend on, i.e. all but majorant_grid_cell_size and cache_majorants, which are kept.
+    The volume must not be in use meanwhile. The cached shadows depend on the extinction, so precompute them again.
+  */
+  void set_params(const VolumeParameters& params);
+
   const VolumeGrids& grids() const { return m_grids; }
 
+  /** @return The coarse majorant grid, or nullptr if rays are traversed over the density tree. */
+  const MajorantGrid* majorant_grid() const { return m_majorant_grid ? &*m_majorant_grid : nullptr; }
+
+  /** @brief Precompute the transmittance towards the distant light, if the cached shadows are enabled. */
+  void precompute_shadows(const WorkerParameters& params, unsigned int num_threads);
+
+  /** @return The precomputed transmittance towards the distant light, or nullptr if shadow rays should be traced. */
+  const TransmittanceGrid* transmittance_grid() const { return m_transmittance_grid ? &*m_transmittance_grid : nullptr; }
+
+  /**
+    @brief Page the leaves of the density grid in and out on demand, keeping at most budget_bytes of them resident - along with those of the temperature grid, if it is mapped too.
+    Call it once the volume is preprocessed, as that reads all the leaves. The grids must be memory-mapped.
+    @return false if they are not.
+  */
+  bool page_leaves(size_t budget_bytes);
+
+  /** @return The pager of the leaves, or nullptr if they are all resident. */
+  const LeafPager* leaf_pager() const { return m_leaf_pager ? &*m_leaf_pager : nullptr; }
+
 private:
   Eigen::Vector3f m_bsphere_center;
   float m_bsphere_radius;
+  // One alternative for each of VPT_FOR_EACH_DENSITY_BUILD_TYPE, the one of the density grid is used
+  using TreeMajorantsV = std::variant<TreeMajorants<float>, TreeMajorants<nanovdb::Fp16>, TreeMajorants<nanovdb::Fp8>>;
+
   const VolumeGrids& m_grids;
   VolumeParameters m_params;
+  TreeMajorantsV m_tree_majorants;
+  std::optional<MajorantGrid> m_majorant_grid;
+  std::optional<TransmittanceGrid> m_transmittance_grid;
+  std::optional<LeafPager> m_leaf_pager;
 };
 
 } // namespace vpt
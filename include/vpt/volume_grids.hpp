@@ -1,36 +1,125 @@
 #ifndef VPT_VOLUMEGRIDS_HPP
 #define VPT_VOLUMEGRIDS_HPP
 
+#include <algorithm>
 #include <filesystem>
+#include <limits>
 #include <optional>
+#include <memory>
+#include <stdexcept>
+#include <variant>
 
 #include <nanovdb/GridHandle.h>
 
+#include <vpt/configuration.hpp>
+
+/**
+  Calls X(BuildT) for each build type the density grid is rendered with (see VolumeGrids::visit_density).
+  For the explicit instantiations of the templates over the density grid.
+*/
+#define VPT_FOR_EACH_DENSITY_BUILD_TYPE(X) \
+  X(float) \
+  X(nanovdb::Fp16) \
+  X(nanovdb::Fp8)
+
 namespace vpt {
 
+struct MappedFile;
+
+/** The types of a density grid with the specified build type: float, or one of the quantized ones (nanovdb::Fp16, nanovdb::Fp8). */
+template <typename BuildT>
+struct GridTypes {
+  using GridT = nanovdb::NanoGrid<BuildT>;
+  using AccessorT = typename GridT::AccessorType;
+
+  using LeafT = nanovdb::NanoLeaf<BuildT>;
+  using LowerT = nanovdb::NanoLower<BuildT>;
+  using UpperT = nanovdb::NanoUpper<BuildT>;
+  using RootT = nanovdb::NanoRoot<BuildT>;
+
+  /**
+    @return The maximum value in the leaf.
+    The stored maximum of a quantized leaf was computed before quantizing its values, so it may not bound the decoded ones.
+  */
+  static float leaf_max(const LeafT& leaf) {
+    if constexpr (std::is_same_v<BuildT, float>) {
+      return leaf.getMax();
+    } else {
+      float ans = -std::numeric_limits<float>::infinity();
+      for (uint32_t i = 0; i < LeafT::SIZE; ++i)
+        ans = std::max(ans, leaf.getValue(i));
+      return ans;
+    }
+  }
+};
+
+/** Thrown when the grids of a volume file can't be loaded, e.g. if the density grid is missing or of a type which can't be rendered. */
+struct VolumeLoadError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
 struct VolumeGrids {
   using GridHandleT = nanovdb::GridHandle<nanovdb::HostBuffer>;
-  using GridT = nanovdb::NanoGrid<float>;
-  using AccessorT = GridT::AccessorType;
 
+  // The temperature is only looked up at the collisions, so it is always decoded to float.
+  using TemperatureGridT = nanovdb::NanoGrid<float>;
+  using TemperatureAccessorT = TemperatureGridT::AccessorType;
+
+  /**
+    The density grids of any other float valued type are re-encoded when the grids are made: Fp4 as Fp8, and FpN as Fp16.
+    FpN leaves don't all have the same size, and the renderer indexes the leaves by their position.
+  */
   VolumeGrids(GridHandleT&& density);
   VolumeGrids(GridHandleT&& density, GridHandleT&& temperature);
 
-  inline GridT& density() const { return *m_density; }
-  inline GridT& temperature() const { return *m_temperature; }
+  /** @brief The grids point into the mapping, which is kept alive as long as they are. */
+  VolumeGrids(std::shared_ptr<const MappedFile> mapping, GridHandleT&& density, std::optional<GridHandleT>&& temperature);
+
+  /** @return The density grid. BuildT must be its build type (see density_type()). */
+  template <typename BuildT>
+  inline const typename GridTypes<BuildT>::GridT& density() const { return *std::get<const typename GridTypes<BuildT>::GridT*>(m_density); }
+
+  /** @return The result of f(density), with the density grid of its actual build type. */
+  template <typename F>
+  inline decltype(auto) visit_density(F&& f) const {
+    return std::visit([&](const auto* grid) -> decltype(auto) { return f(*grid); }, m_density);
+  }
+
+  nanovdb::GridType density_type() const;
+
+  inline const TemperatureGridT& temperature() const { return *m_temperature; }
   inline bool has_temperature() const { return m_temperature != nullptr; }
 
-  static VolumeGrids read_from_file(const std::filesystem::path& path);
+  /** @return Whether the density grid points into a file mapping, rather than into memory of its own. */
+  inline bool is_mapped() const { return m_density_mapped; }
+
+  /** @return Whether there is a temperature grid, and it points into the file mapping. */
+  inline bool is_temperature_mapped() const { return m_temperature_mapped; }
+
+  /** @return A copy of the grids, with the density re-encoded as the specified type - e.g. to compare the quantized encodings. */
+  VolumeGrids reencoded(nanovdb::GridType density_type) const;
+
+  /** @throws VolumeLoadError If the file has no density grid, or can't be read. */
+  static VolumeGrids read_from_file(const std::filesystem::path& path, const VolumeLoading& loading = { false, false, false, false, 0 });
   static VolumeGrids generate_donut();
 
 private:
+  /** Point the grids into their handles. */
+  void set_grids();
+
+  // One alternative for each of VPT_FOR_EACH_DENSITY_BUILD_TYPE
+  using DensityGridPtr = std::variant<const GridTypes<float>::GridT*, const GridTypes<nanovdb::Fp16>::GridT*, const GridTypes<nanovdb::Fp8>::GridT*>;
+
+  // Declared first, so that it outlives the handles
+  std::shared_ptr<const MappedFile> m_mapping;
+
   GridHandleT m_density_handle;
   std::optional<GridHandleT> m_temperature_handle;
 
-  GridT* m_density;
-  GridT* m_temperature;
-  
-  GridHandleT m_majorant_handle;
+  DensityGridPtr m_density;
+  const TemperatureGridT* m_temperature;
+  bool m_density_mapped;
+  bool m_temperature_mapped;
 };
 
 } // namespace vpt
@@ -1,14 +1,65 @@
 #ifndef VPT_WORKER_HPP
 #define VPT_WORKER_HPP
 
+#include <span>
+
 #include <vpt/volume.hpp>
 #include <vpt/camera.hpp>
 #include <vpt/tile_provider.hpp>
 #include <vpt/image.hpp>
+#include <vpt/film.hpp>
 #include <vpt/random.hpp>
 
 namespace vpt {
-void run(const WorkerParameters& params, const Volume& volume, const Camera& camera, TileProvider& tp, Image<float, 4>& m_film, RandomNumberGenerator rng);
+
+enum class ScatterEvent {
+  Null,
+  Absorption,
+  Scatter
+};
+
+/** A camera and the film it renders to. The tiles of each view of the tile provider go to the view with the same index. */
+struct View {
+  const Camera& camera;
+  Film& film;
+};
+
+/** @brief Render tiles from the tile provider until it runs out, with the engine selected in the parameters and the build type of the density grid. */
+void run(const WorkerParameters& params, const Volume& volume, std::span<const View> views, TileProvider& tp, TileProvider::worker_index_t worker_idx, RandomNumberGenerator rng);
+
+/** @brief Render the only view of the tile provider. */
+inline void run(const WorkerParameters& params, const Volume& volume, const Camera& camera, TileProvider& tp, TileProvider::worker_index_t worker_idx, Film& film, RandomNumberGenerator rng) {
+  View view { camera, film };
+  run(params, volume, std::span<const View>(&view, 1), tp, worker_idx, rng);
+}
+
+/** @brief Render with the wavefront engine. The paths of several tiles are advanced stage by stage, in batches, rather than one at a time. */
+template <typename BuildT>
+void run_wavefront(const WorkerParameters& params, const Volume& volume, std::span<const View> views, TileProvider& tp, TileProvider::worker_index_t worker_idx, RandomNumberGenerator rng);
+
+/** @return The block of pixels starting at pt which share a path in a preview level of the tile (see TileProvider::set_preview), clipped to the tile. */
+inline image_rect_t preview_block_rect(const image_rect_t& tile, const image_point_t& pt, image_index_t block) {
+  return { pt, (tile.start + tile.size - pt).cwiseMin(block) };
+}
+
+/**
+  @brief Called when a tile is rendered, before its token is released.
+  Flags the tile as changed for the viewer, and marks it as converged if adaptive sampling is enabled and its error is low enough.
+  The preview levels are never marked as converged, as their samples are not part of the film.
+*/
+void finish_tile(const AdaptiveSamplingParameters& params, Film& film, TileProvider::token& tok, const image_rect_t& rect);
+
+/** @return An unbiased estimate of the transmittance along the ray, with the estimator selected in the parameters. */
+template <typename BuildT>
+float estimate_transmittance(const ShadowParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Ray& r, const typename GridTypes<BuildT>::AccessorT& density_acc);
+
+/** @return The transmittance from pos towards the distant light (in direction wi), either traced or looked up in the precomputed grid. */
+template <typename BuildT>
+float shadow_transmittance(const ShadowParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Eigen::Vector3f& pos, const Eigen::Vector3f& wi, const typename GridTypes<BuildT>::AccessorT& density_acc);
+
+/** @return The direct lighting scattered towards -w at pos. */
+template <typename BuildT>
+Eigen::Vector3f sample_Ld(const WorkerParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Eigen::Vector3f& pos, const Eigen::Vector3f& w, const typename GridTypes<BuildT>::AccessorT& density_acc);
 
 } // namespace vpt
 
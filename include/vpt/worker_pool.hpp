@@ -0,0 +1,74 @@
+#ifndef VPT_WORKER_POOL_HPP
+#define VPT_WORKER_POOL_HPP
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <vpt/worker.hpp>
+
+namespace vpt {
+
+/**
+  Workers which outlive the renders, for the callers which render over and over with the same volume (e.g. the server, or the viewer when the scene is edited).
+  A render is a task for all of the workers. Starting a new one bumps the generation: each worker moves on to it once it is done with the one it is on.
+*/
+struct WorkerPool {
+  /** What to render. Everything it points to must stay alive while the workers are on it - owned by the state, if they may still be when it is replaced. */
+  struct Task {
+    const WorkerParameters* params;
+    const Volume* vol;
+    std::span<const View> views;
+    TileProvider* tp;
+    unsigned int seed;
+
+    // Held by each worker while it renders the task
+    std::shared_ptr<const void> state;
+  };
+
+  explicit WorkerPool(unsigned int num_workers);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  /**
+    @brief Start rendering the task, and return right away.
+    The workers still on the previous task only switch once they are done with it, so stop its tile provider for them to do so at the end of their tile.
+  */
+  void start(Task task);
+
+  /** @return Whether all the workers are done with the last task started, waiting at most for the timeout. */
+  bool wait_for(std::chrono::milliseconds timeout);
+
+  /** @brief Wait for all the workers to be done with the last task started. */
+  void wait() {
+    while (not wait_for(std::chrono::milliseconds(100)))
+      ;
+  }
+
+  unsigned int size() const { return static_cast<unsigned int>(m_threads.size()); }
+
+private:
+  void work(TileProvider::worker_index_t worker_idx);
+
+  std::mutex m_mtx;
+  std::condition_variable m_cv;
+
+  Task m_task {};
+  uint64_t m_generation = 0;
+
+  // The workers done with the task of the current generation
+  unsigned int m_done = 0;
+  bool m_stop = false;
+
+  // Last, so the workers start after the rest is initialized, and are joined before it is destroyed
+  std::vector<std::jthread> m_threads;
+};
+
+} // namespace vpt
+
+#endif // !VPT_WORKER_POOL_HPP
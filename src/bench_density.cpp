@@ -0,0 +1,178 @@
+#include <cmath>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-private-field"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include <nanovdb/math/SampleFromVoxels.h>
+#pragma GCC diagnostic pop
+
+#include <vpt/loaded_volume.hpp>
+#include <vpt/configuration.hpp>
+#include <vpt/majorant_transmittance_sampler.hpp>
+#include <vpt/random.hpp>
+#include <vpt/ray.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/logging.hpp>
+
+/*
+Runs delta tracking along random rays through the volume, until the first real collision, in two ways:
+- with the MajorantTransmittanceSampler, which draws the tentative collisions in batches and looks up their densities together,
+- one tentative collision at a time, with the NanoVDB trilinear sampler.
+and compares their throughput. They are single threaded, and the rays are the same for both.
+The collisions are drawn in a different order, so the walks differ - but the fraction of the rays escaping the volume must agree up to the noise.
+*/
+
+namespace {
+
+constexpr size_t NUM_RAYS = 1 << 18;
+
+struct Result {
+  double time_s;
+  double escaped; // Fraction of the rays which escaped the volume
+  double lookups; // Per ray, only counted one at a time
+};
+
+/** @return A ray from a point of the bounding sphere towards a point in it, both uniformly distributed. */
+vpt::Ray random_ray(const vpt::Volume& vol, vpt::RandomNumberGenerator& rng) {
+  auto point_in_ball = [&]() {
+    while (true) {
+      Eigen::Vector3f p(2.0f * rng.uniform<float>() - 1.0f, 2.0f * rng.uniform<float>() - 1.0f, 2.0f * rng.uniform<float>() - 1.0f);
+      if (p.squaredNorm() <= 1.0f and p.squaredNorm() > 1e-6f)
+        return p;
+    }
+  };
+
+  Eigen::Vector3f origin = vol.bounding_sphere_center() + vol.bounding_sphere_radius() * point_in_ball().normalized();
+  Eigen::Vector3f target = vol.bounding_sphere_center() + vol.bounding_sphere_radius() * point_in_ball();
+  return vpt::Ray(origin, (target - origin).normalized());
+}
+
+template <typename BuildT>
+Result track_batched(const vpt::Configuration& cfg, const vpt::Volume& vol) {
+  const float sigma_t = vol.params().sigma_a + vol.params().sigma_s;
+  auto density_acc = vol.grids().density<BuildT>().getAccessor();
+
+  vpt::RandomNumberGenerator rng(cfg.seed);
+  size_t escaped = 0;
+
+  vpt::Stopwatch sw;
+  for (size_t i = 0; i < NUM_RAYS; ++i) {
+    rng.begin_job(i);
+    vpt::Ray ray = random_ray(vol, rng);
+
+    auto intersection = vol.intersect<BuildT>(ray, density_acc);
+    if (not intersection) {
+      ++escaped;
+      continue;
+    }
+
+    vpt::MajorantTransmittanceSampler<BuildT> sampler(*intersection, rng, vol.grids().density<BuildT>(), density_acc, sigma_t, vol.leaf_pager());
+
+    bool collided = false;
+    while (auto props = sampler.next()) {
+      if (rng.uniform<float>() < sigma_t * props->density / props->sigma_maj) {
+        collided = true;
+        break;
+      }
+    }
+
+    if (not collided)
+      ++escaped;
+  }
+  double time_s = static_cast<double>(sw.elapsed_ms()) / 1000.0;
+
+  // The sampler doesn't tell how many densities it looked up
+  return { time_s, static_cast<double>(escaped) / NUM_RAYS, 0.0 };
+}
+
+template <typename BuildT>
+Result track_nanovdb(const vpt::Configuration& cfg, const vpt::Volume& vol) {
+  const float sigma_t = vol.params().sigma_a + vol.params().sigma_s;
+  auto density_acc = vol.grids().density<BuildT>().getAccessor();
+  nanovdb::math::SampleFromVoxels<decltype(density_acc), 1> density_sampler(density_acc);
+
+  vpt::RandomNumberGenerator rng(cfg.seed);
+  size_t escaped = 0;
+  size_t lookups = 0;
+
+  vpt::Stopwatch sw;
+  for (size_t i = 0; i < NUM_RAYS; ++i) {
+    rng.begin_job(i);
+    vpt::Ray ray = random_ray(vol, rng);
+
+    auto intersection = vol.intersect<BuildT>(ray, density_acc);
+    if (not intersection) {
+      ++escaped;
+      continue;
+    }
+
+    bool collided = false;
+    while (auto segment = intersection->next()) {
+      if (segment->d_maj <= 0.0f)
+        continue;
+
+      float sigma_maj = sigma_t * segment->d_maj;
+      float t = segment->t0;
+      while (true) {
+        t += vpt::sample_exponential(rng.uniform<float>(), sigma_maj) / intersection->idx_to_world_scale();
+        if (t >= segment->t1)
+          break;
+
+        float density = density_sampler(intersection->ray()(t));
+        ++lookups;
+
+        if (density > 0.0f and rng.uniform<float>() < sigma_t * density / sigma_maj) {
+          collided = true;
+          break;
+        }
+      }
+
+      if (collided)
+        break;
+    }
+
+    if (not collided)
+      ++escaped;
+  }
+  double time_s = static_cast<double>(sw.elapsed_ms()) / 1000.0;
+
+  return { time_s, static_cast<double>(escaped) / NUM_RAYS, static_cast<double>(lookups) / NUM_RAYS };
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    vptFATAL("Usage: " << argv[0] << " scene_path");
+    return 1;
+  }
+
+  std::filesystem::path config_path = argv[1];
+  vpt::Configuration cfg = vpt::read_configuration(config_path);
+  if (vpt::is_frame_pattern(cfg.volume_path))
+    vptFATAL("Benchmark a single frame of the sequence - set volume_path to its volume");
+
+  vpt::LoadedVolume volume(cfg, config_path.parent_path() / cfg.volume_path);
+
+  volume.grids.visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>&) {
+    // Warm up, so that both start with the leaves in memory
+    track_nanovdb<BuildT>(cfg, volume.vol);
+
+    Result one_at_a_time = track_nanovdb<BuildT>(cfg, volume.vol);
+    Result batched = track_batched<BuildT>(cfg, volume.vol);
+
+    vptINFO("SampleFromVoxels: " << NUM_RAYS / one_at_a_time.time_s / 1e6 << " Mrays/s, " << one_at_a_time.lookups << " lookups per ray, " << one_at_a_time.escaped * 100.0 << " % escaped");
+    vptINFO("Batched sampler: " << NUM_RAYS / batched.time_s / 1e6 << " Mrays/s, " << batched.escaped * 100.0 << " % escaped");
+    vptINFO("Speedup: " << one_at_a_time.time_s / batched.time_s);
+
+    // The standard deviation of the escaped fractions, as binomial proportions
+    double sd = std::sqrt(one_at_a_time.escaped * (1.0 - one_at_a_time.escaped) / NUM_RAYS * 2.0);
+    if (std::abs(batched.escaped - one_at_a_time.escaped) > 5.0 * sd + 1e-6)
+      vptWARN("The escaped fractions differ by more than 5 standard deviations - the batched sampler is biased");
+  });
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+#include <cmath>
+#include <optional>
+
+#include <vpt/volume.hpp>
+#include <vpt/configuration.hpp>
+#include <vpt/camera.hpp>
+#include <vpt/film.hpp>
+#include <vpt/tile_provider.hpp>
+#include <vpt/render_harness.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/logging.hpp>
+
+/*
+Renders a scene with its density grid encoded as float, Fp16 and Fp8, and compares the throughput and the images.
+The renders use the same seed, so the differences between the images are due to the encoding - plus the noise of the paths which took different turns because of it.
+The error is relative to the float render: the RMS difference of the pixel luminances over the mean luminance.
+*/
+
+namespace {
+
+struct Encoding {
+  const char* name;
+  nanovdb::GridType type;
+};
+
+struct Result {
+  double render_s;
+  double samples;
+  vpt::Film film;
+};
+
+Result render(const vpt::Configuration& cfg, const vpt::Volume& vol) {
+  vpt::Camera camera(cfg.camera_parameters, cfg.output_size);
+  vpt::TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+  vpt::Film film(cfg.output_size);
+
+  vpt::Stopwatch sw;
+  vpt::View view { camera, film };
+  vpt::render_with_threads(cfg, vol, std::span(&view, 1), provider, cfg.num_workers);
+  double render_s = static_cast<double>(sw.elapsed_ms()) / 1000.0;
+
+  return { render_s, vpt::total_samples(film), std::move(film) };
+}
+
+/** @return The RMS difference of the pixel luminances over the mean luminance of the reference. */
+double relative_rms_error(const vpt::Film& film, const vpt::Film& reference) {
+  double sum_sq = 0.0;
+  double sum_ref = 0.0;
+
+  const auto& a = film.radiance().data();
+  const auto& b = reference.radiance().data();
+  for (vpt::image_index_t y = 0; y < film.size().y(); ++y) {
+    for (vpt::image_index_t x = 0; x < film.size().x(); ++x) {
+      double Y = a(y, x).w() > 0.0f ? a(y, x).y() / a(y, x).w() : 0.0;
+      double Y_ref = b(y, x).w() > 0.0f ? b(y, x).y() / b(y, x).w() : 0.0;
+
+      sum_sq += (Y - Y_ref) * (Y - Y_ref);
+      sum_ref += Y_ref;
+    }
+  }
+
+  double n = static_cast<double>(film.size().prod());
+  return sum_ref > 0.0 ? std::sqrt(sum_sq / n) / (sum_ref / n) : 0.0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 or argc > 3) {
+    vptFATAL("Usage: " << argv[0] << " scene_path [image_prefix]");
+    return 1;
+  }
+
+  std::filesystem::path config_path = argv[1];
+  vpt::Configuration cfg = vpt::read_configuration(config_path);
+  if (vpt::is_frame_pattern(cfg.volume_path))
+    vptFATAL("Benchmark a single frame of the sequence - set volume_path to its volume");
+
+  std::optional<std::filesystem::path> image_prefix;
+  if (argc == 3)
+    image_prefix = argv[2];
+
+  // Relative to the scene, as for vpt
+  std::filesystem::path volume_path = config_path.parent_path() / cfg.volume_path;
+
+  vpt::VolumeGrids source = vpt::VolumeGrids::read_from_file(volume_path, cfg.volume_loading);
+  if (source.density_type() != nanovdb::GridType::Float)
+    vptWARN("The density grid of " << volume_path << " is already quantized - the errors are relative to its decoded values, not to the original ones");
+
+  const Encoding encodings[] = {
+    { "float", nanovdb::GridType::Float },
+    { "fp16", nanovdb::GridType::Fp16 },
+    { "fp8", nanovdb::GridType::Fp8 },
+  };
+
+  std::optional<vpt::Film> reference;
+
+  for (const Encoding& encoding : encodings) {
+    vpt::VolumeGrids grids = source.reencoded(encoding.type);
+    uint64_t grid_bytes = grids.visit_density([](const auto& density) { return density.gridSize(); });
+
+    // Not cached, so that the majorants are always those of the encoded grid
+    vpt::Stopwatch sw;
+    vpt::Volume vol(grids, cfg.volume_parameters, cfg.num_workers);
+    vol.precompute_shadows(cfg.worker_parameters, cfg.num_workers);
+    double preprocess_s = static_cast<double>(sw.elapsed_ms()) / 1000.0;
+
+    Result result = render(cfg, vol);
+
+    double error = reference ? relative_rms_error(result.film, *reference) : 0.0;
+    vptINFO(encoding.name << ": density grid " << (grid_bytes >> 20) << " MiB, preprocessed in " << preprocess_s << " s, rendered in " << result.render_s << " s ("
+      << result.samples / result.render_s / 1e6 << " Msamples/s), relative RMS error " << error);
+
+    if (image_prefix) {
+      std::filesystem::path path = *image_prefix;
+      path += std::string("_") + encoding.name + ".png";
+      if (not vpt::save_film_image(path, result.film, cfg.output_image, cfg.num_workers))
+        vptWARN("Failed to save the image to " << path);
+    }
+
+    if (not reference)
+      reference = std::move(result.film);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <vpt/loaded_volume.hpp>
+#include <vpt/configuration.hpp>
+#include <vpt/camera.hpp>
+#include <vpt/film.hpp>
+#include <vpt/tile_provider.hpp>
+#include <vpt/tile_order.hpp>
+#include <vpt/render_harness.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/logging.hpp>
+
+/*
+Renders a scene with 1, 2, ... N workers, and logs the throughput of each render, its speedup over a single worker, and its parallel efficiency (the speedup per worker).
+The volume is loaded once, and rendered once before the measured renders, so that they all start with its pages in memory.
+The image must be the same whatever the number of workers, since the samples of a tile don't depend on the scheduling - which is checked too.
+*/
+
+namespace {
+
+struct Result {
+  double render_s;
+  double samples;
+  vpt::Film film;
+};
+
+Result render(const vpt::Configuration& cfg, const vpt::Volume& vol, unsigned int num_workers) {
+  vpt::Camera camera(cfg.camera_parameters, cfg.output_size);
+  vpt::TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, num_workers);
+  vpt::Film film(cfg.output_size);
+
+  // Not measured, as it is done once before the render
+  vpt::View view { camera, film };
+  vpt::order_tiles(cfg, vol, std::span(&view, 1), provider);
+
+  vpt::Stopwatch sw;
+  vpt::render_with_threads(cfg, vol, std::span(&view, 1), provider, num_workers);
+  double render_s = static_cast<double>(sw.elapsed_ms()) / 1000.0;
+
+  return { render_s, vpt::total_samples(film), std::move(film) };
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 or argc > 3) {
+    vptFATAL("Usage: " << argv[0] << " scene_path [max_workers]");
+    return 1;
+  }
+
+  std::filesystem::path config_path = argv[1];
+  vpt::Configuration cfg = vpt::read_configuration(config_path);
+  if (vpt::is_frame_pattern(cfg.volume_path))
+    vptFATAL("Benchmark a single frame of the sequence - set volume_path to its volume");
+
+  unsigned int max_workers = argc == 3 ? static_cast<unsigned int>(std::stoul(argv[2])) : std::thread::hardware_concurrency();
+  if (max_workers == 0)
+    vptFATAL("max_workers must be at least 1");
+
+  // The volume is preprocessed with all the workers
+  cfg.num_workers = max_workers;
+  vpt::LoadedVolume volume(cfg, config_path.parent_path() / cfg.volume_path);
+
+  // Warm up
+  render(cfg, volume.vol, max_workers);
+
+  std::optional<Result> single;
+
+  for (unsigned int n = 1; n <= max_workers; ++n) {
+    Result result = render(cfg, volume.vol, n);
+
+    double speedup = single ? single->render_s / result.render_s : 1.0;
+    vptINFO(n << " workers: rendered in " << result.render_s << " s (" << result.samples / result.render_s / 1e6 << " Msamples/s), speedup " << speedup << ", efficiency " << speedup / n);
+
+    if (single and not vpt::same_film(result.film, single->film))
+      vptWARN(n << " workers: the image differs from the one of a single worker");
+
+    if (not single)
+      single = std::move(result);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <sstream>
+
+#include <vpt/loaded_volume.hpp>
+#include <vpt/configuration.hpp>
+#include <vpt/camera.hpp>
+#include <vpt/film.hpp>
+#include <vpt/tile_provider.hpp>
+#include <vpt/tile_order.hpp>
+#include <vpt/render_harness.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/logging.hpp>
+
+/*
+Renders a scene with each tile order, and compares the throughput and the last level cache misses of the workers.
+The volume is loaded once, and rendered once before the measured renders, so that they all start with its pages in memory.
+The images must be the same whatever the order, since the samples of a tile don't depend on the scheduling - which is checked too.
+*/
+
+namespace {
+
+/** Counts an event of the calling thread and of the threads it starts while counting, with perf_event_open. */
+struct PerfCounter {
+  const char* name;
+
+  PerfCounter() {
+    // The last level cache misses on loads, or the generic cache misses on the CPUs which don't have them (which are usually those of the last level too)
+    perf_event_attr attr {};
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    name = "LLC load misses";
+    m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+
+    if (m_fd < 0) {
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      name = "cache misses";
+      m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+  }
+
+  ~PerfCounter() {
+    if (m_fd >= 0)
+      close(m_fd);
+  }
+
+  PerfCounter(const PerfCounter&) = delete;
+  PerfCounter& operator=(const PerfCounter&) = delete;
+
+  bool valid() const { return m_fd >= 0; }
+
+  /** @brief Start counting from zero. The threads started from now on are counted too. */
+  void start() {
+    ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  /** @return The count since start(), including the threads which exited meanwhile. */
+  std::optional<uint64_t> stop() {
+    ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    uint64_t count;
+    if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+      return std::nullopt;
+    return count;
+  }
+
+private:
+  int m_fd;
+};
+
+struct Order {
+  const char* name;
+  vpt::Configuration::TileOrder order;
+};
+
+struct Result {
+  double render_s;
+  double samples;
+  std::optional<uint64_t> misses;
+  vpt::Film film;
+};
+
+Result render(const vpt::Configuration& cfg, const vpt::Volume& vol, PerfCounter& counter) {
+  vpt::Camera camera(cfg.camera_parameters, cfg.output_size);
+  vpt::TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+  vpt::Film film(cfg.output_size);
+
+  // Not measured, as it is done once before the render
+  vpt::View view { camera, film };
+  vpt::order_tiles(cfg, vol, std::span(&view, 1), provider);
+
+  if (counter.valid())
+    counter.start();
+
+  vpt::Stopwatch sw;
+  vpt::render_with_threads(cfg, vol, std::span(&view, 1), provider, cfg.num_workers);
+  double render_s = static_cast<double>(sw.elapsed_ms()) / 1000.0;
+
+  // The workers have exited, so their counts are in
+  std::optional<uint64_t> misses = counter.valid() ? counter.stop() : std::nullopt;
+
+  return { render_s, vpt::total_samples(film), misses, std::move(film) };
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    vptFATAL("Usage: " << argv[0] << " scene_path");
+    return 1;
+  }
+
+  std::filesystem::path config_path = argv[1];
+  vpt::Configuration cfg = vpt::read_configuration(config_path);
+  if (vpt::is_frame_pattern(cfg.volume_path))
+    vptFATAL("Benchmark a single frame of the sequence - set volume_path to its volume");
+
+  // Relative to the scene, as for vpt
+  vpt::LoadedVolume volume(cfg, config_path.parent_path() / cfg.volume_path);
+
+  PerfCounter counter;
+  if (not counter.valid())
+    vptWARN("Can't count the cache misses (" << std::strerror(errno) << ") - see /proc/sys/kernel/perf_event_paranoid. Only the throughput is measured.");
+
+  const Order orders[] = {
+    { "raster", vpt::Configuration::TileOrder::Raster },
+    { "hilbert", vpt::Configuration::TileOrder::Hilbert },
+    { "spiral", vpt::Configuration::TileOrder::Spiral },
+    { "cost", vpt::Configuration::TileOrder::Cost },
+  };
+
+  // Warm up
+  render(cfg, volume.vol, counter);
+
+  std::optional<vpt::Film> reference;
+
+  for (const Order& order : orders) {
+    cfg.tile_order = order.order;
+    Result result = render(cfg, volume.vol, counter);
+
+    std::ostringstream misses;
+    if (result.misses)
+      misses << ", " << static_cast<double>(*result.misses) / 1e6 << " M " << counter.name << " (" << static_cast<double>(*result.misses) / result.samples << " per sample)";
+
+    vptINFO(order.name << ": rendered in " << result.render_s << " s (" << result.samples / result.render_s / 1e6 << " Msamples/s)" << misses.str());
+
+    if (reference and not vpt::same_film(result.film, *reference))
+      vptWARN(order.name << ": the image differs from the raster one");
+
+    if (not reference)
+      reference = std::move(result.film);
+  }
+
+  return EXIT_SUCCESS;
+}
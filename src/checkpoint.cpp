@@ -0,0 +1,149 @@
+#include <fstream>
+#include <cstring>
+
+#include <vpt/checkpoint.hpp>
+#include <vpt/temp_file.hpp>
+#include <vpt/logging.hpp>
+
+namespace vpt {
+
+/*
+Checkpoint file layout: a CheckpointHeader, followed by the last completed wave of each tile (uint32), whether each tile converged (uint8), and the raw film.
+Everything is stored in the native (little endian) representation.
+*/
+namespace {
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t seed;
+  uint64_t config_hash;
+  uint32_t width;
+  uint32_t height;
+  uint64_t num_tiles;
+};
+
+constexpr char CHECKPOINT_MAGIC[8] = { 'V', 'P', 'T', 'C', 'K', 'P', 'T', '\0' };
+
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+// The last completed wave, and whether it converged
+constexpr uint64_t TILE_STATE_BYTES = sizeof(uint32_t) + sizeof(uint8_t);
+
+} // namespace
+
+bool Checkpoint::save(const std::filesystem::path& path, const Film& film) const {
+  CheckpointHeader header {
+    .magic = {},
+    .version = CHECKPOINT_VERSION,
+    .seed = seed,
+    .config_hash = config_hash,
+    .width = static_cast<uint32_t>(film.size().x()),
+    .height = static_cast<uint32_t>(film.size().y()),
+    .num_tiles = tiles.size(),
+  };
+  std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+
+  std::vector<uint32_t> waves(tiles.size());
+  std::vector<uint8_t> converged(tiles.size());
+  for (size_t t = 0; t < tiles.size(); ++t) {
+    waves[t] = tiles[t].wave;
+    converged[t] = tiles[t].converged;
+  }
+
+  // A file of our own, so that two renders checkpointing to the same path (e.g. the same scene twice) don't write into each other's
+  std::optional<std::filesystem::path> tmp = create_temp_file(path);
+  if (not tmp) {
+    vptWARN("Failed to create a temporary file for the checkpoint " << path << ": " << std::strerror(errno));
+    return false;
+  }
+  const std::filesystem::path& tmp_path = *tmp;
+
+  {
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+
+    bool ok = os and os.write(reinterpret_cast<const char*>(&header), sizeof(header)) and
+      os.write(reinterpret_cast<const char*>(waves.data()), static_cast<std::streamsize>(waves.size() * sizeof(uint32_t))) and
+      os.write(reinterpret_cast<const char*>(converged.data()), static_cast<std::streamsize>(converged.size())) and
+      film.write(os) and os.flush();
+
+    if (not ok) {
+      vptWARN("Failed to write the checkpoint " << tmp_path);
+      std::error_code ec;
+      std::filesystem::remove(tmp_path, ec);
+      return false;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    vptWARN("Failed to write the checkpoint " << path << ": " << ec.message());
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+
+  return true;
+}
+
+std::optional<Checkpoint> Checkpoint::load(const std::filesystem::path& path, Film& film) {
+  std::ifstream is(path, std::ios::binary);
+  if (not is) {
+    vptWARN("Failed to open the checkpoint " << path);
+    return std::nullopt;
+  }
+
+  CheckpointHeader header;
+  if (not is.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    vptWARN("Checkpoint " << path << " is truncated.");
+    return std::nullopt;
+  }
+
+  if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 or header.version != CHECKPOINT_VERSION) {
+    vptWARN("Checkpoint " << path << " has an unknown format or version.");
+    return std::nullopt;
+  }
+
+  if (header.width != film.size().x() or header.height != film.size().y()) {
+    vptWARN("Checkpoint " << path << " is " << header.width << 'x' << header.height << ", but the film is " << film.size().x() << 'x' << film.size().y());
+    return std::nullopt;
+  }
+
+  // Before allocating the tiles: a corrupt count would make them huge
+  std::error_code ec;
+  uint64_t file_size = std::filesystem::file_size(path, ec);
+  uint64_t film_size = film.write_size();
+  bool consistent = not ec and file_size >= sizeof(header) + film_size and
+    header.num_tiles <= (file_size - sizeof(header)) / TILE_STATE_BYTES and
+    header.num_tiles * TILE_STATE_BYTES == file_size - sizeof(header) - film_size;
+
+  if (not consistent) {
+    vptWARN("Checkpoint " << path << " has " << header.num_tiles << " tiles, which doesn't match its size of " << file_size << " bytes.");
+    return std::nullopt;
+  }
+
+  std::vector<uint32_t> waves(header.num_tiles);
+  std::vector<uint8_t> converged(header.num_tiles);
+
+  bool ok = is.read(reinterpret_cast<char*>(waves.data()), static_cast<std::streamsize>(waves.size() * sizeof(uint32_t))) and
+    is.read(reinterpret_cast<char*>(converged.data()), static_cast<std::streamsize>(converged.size())) and
+    film.read(is);
+
+  if (not ok) {
+    vptWARN("Checkpoint " << path << " is truncated.");
+    return std::nullopt;
+  }
+
+  Checkpoint ans {
+    .seed = header.seed,
+    .config_hash = header.config_hash,
+    .tiles = std::vector<TileProvider::tile_state>(header.num_tiles),
+  };
+
+  for (size_t t = 0; t < ans.tiles.size(); ++t)
+    ans.tiles[t] = { waves[t], converged[t] != 0 };
+
+  return ans;
+}
+
+} // namespace vpt
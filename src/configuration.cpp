@@ -1,10 +1,76 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
 #include <glaze/glaze.hpp>
 
 #include <vpt/configuration.hpp>
 #include <vpt/logging.hpp>
+#include <vpt/hash.hpp>
+
+template <>
+struct glz::meta<vpt::WorkerParameters::Engine> {
+  using enum vpt::WorkerParameters::Engine;
+  static constexpr auto value = glz::enumerate(Megakernel, Wavefront);
+};
+
+template <>
+struct glz::meta<vpt::ShadowParameters::Mode> {
+  using enum vpt::ShadowParameters::Mode;
+  static constexpr auto value = glz::enumerate(Exact, Cached);
+};
+
+template <>
+struct glz::meta<vpt::ShadowParameters::Estimator> {
+  using enum vpt::ShadowParameters::Estimator;
+  static constexpr auto value = glz::enumerate(RatioTracking, ResidualRatioTracking);
+};
+
+template <>
+struct glz::meta<vpt::OutputImage::ColorSpace> {
+  using enum vpt::OutputImage::ColorSpace;
+  static constexpr auto value = glz::enumerate(LinearSRGB, XYZ);
+};
+
+template <>
+struct glz::meta<vpt::Configuration::TileOrder> {
+  using enum vpt::Configuration::TileOrder;
+  static constexpr auto value = glz::enumerate(Raster, Hilbert, Spiral, Cost);
+};
 
 namespace vpt {
 
+/** @brief Check the parts of the configuration the schema can't, and normalize it. @return Why it is invalid, or an empty string. */
+static std::string validate(Configuration& cfg) {
+  std::ostringstream err;
+
+  if (cfg.output_image.png_bit_depth != 8 and cfg.output_image.png_bit_depth != 16) {
+    err << "Unsupported PNG bit depth " << cfg.output_image.png_bit_depth << " - expected 8 or 16";
+    return err.str();
+  }
+
+  // The tiles are counted by dividing the image by their size
+  if ((cfg.output_size.array() <= 0).any() or (cfg.tile_size.array() <= 0).any()) {
+    err << "The output size (" << cfg.output_size.x() << 'x' << cfg.output_size.y() << ") and the tile size (" << cfg.tile_size.x() << 'x' << cfg.tile_size.y() << ") must be positive";
+    return err.str();
+  }
+
+  // The expected throughput only serves to plan the waves within the time limit
+  if (cfg.budget.time_limit < 0 or cfg.budget.samples_per_second < 0 or (cfg.budget.samples_per_second > 0 and cfg.budget.time_limit == 0)) {
+    err << "Invalid budget: time_limit " << cfg.budget.time_limit << ", samples_per_second " << cfg.budget.samples_per_second << " - samples_per_second needs a time_limit, and neither can be negative";
+    return err.str();
+  }
+
+  std::ranges::sort(cfg.sequence.camera_keys, {}, &CameraKey::frame);
+
+  if (is_frame_pattern(cfg.volume_path) and cfg.sequence.first_frame > cfg.sequence.last_frame) {
+    err << "The sequence is empty: first_frame " << cfg.sequence.first_frame << " is after last_frame " << cfg.sequence.last_frame;
+    return err.str();
+  }
+
+  return {};
+}
+
 Configuration read_configuration(const std::filesystem::path& path) {
   std::string buf;
 
@@ -18,7 +84,128 @@ Configuration read_configuration(const std::filesystem::path& path) {
     vptFATAL("Failed to read configuration file \"" << path << "\": " << glz::format_error(err, buf));
   }
 
+  if (std::string invalid = validate(ans); not invalid.empty()) {
+    vptFATAL(invalid);
+  }
+
   return ans;
 }
 
+bool parse_render_job(const std::string& json, RenderJob& job, std::string& error) {
+  glz::error_ctx err = glz::read<glz::opts {
+    .error_on_missing_keys = true
+  }>(job, json);
+
+  if (err) {
+    error = glz::format_error(err, json);
+    return false;
+  }
+
+  error = validate(job.scene);
+  return error.empty();
+}
+
+bool is_frame_pattern(const std::filesystem::path& path) {
+  return path.filename().string().find('#') != std::string::npos;
+}
+
+std::filesystem::path frame_path(const std::filesystem::path& pattern, int frame) {
+  std::string filename = pattern.filename().string();
+
+  size_t begin = filename.find('#');
+  if (begin == std::string::npos)
+    return pattern;
+
+  size_t end = filename.find_first_not_of('#', begin);
+  if (end == std::string::npos)
+    end = filename.size();
+
+  std::ostringstream number;
+  number << std::setw(static_cast<int>(end - begin)) << std::setfill('0') << frame;
+
+  filename.replace(begin, end - begin, number.str());
+  return pattern.parent_path() / filename;
+}
+
+CameraParameters camera_at_frame(const Configuration& cfg, int frame) {
+  const std::vector<CameraKey>& keys = cfg.sequence.camera_keys;
+
+  if (keys.empty())
+    return cfg.camera_parameters;
+
+  auto next = std::ranges::upper_bound(keys, frame, {}, &CameraKey::frame);
+  if (next == keys.begin())
+    return keys.front().camera;
+  if (next == keys.end())
+    return keys.back().camera;
+
+  const CameraParameters& a = std::prev(next)->camera;
+  const CameraParameters& b = next->camera;
+  float t = static_cast<float>(frame - std::prev(next)->frame) / static_cast<float>(next->frame - std::prev(next)->frame);
+
+  return {
+    .position = a.position + t * (b.position - a.position),
+    .look = a.look + t * (b.look - a.look),
+    .up = (a.up + t * (b.up - a.up)).normalized(),
+    .vfov_deg = a.vfov_deg + t * (b.vfov_deg - a.vfov_deg),
+    .imaging_ratio = a.imaging_ratio + t * (b.imaging_ratio - a.imaging_ratio),
+  };
+}
+
+template <typename T>
+static uint64_t json_hash(const T& value) {
+  std::string buf;
+  if (glz::write_json(value, buf)) {
+    vptFATAL("Failed to serialize the configuration");
+  }
+
+  buf.resize(ceildiv<size_t>(buf.size(), 8) * 8, '\0');
+  return detail::MurmurHash64A_padded(buf.data(), static_cast<int>(buf.size()), 0);
+}
+
+uint64_t render_hash(const Configuration& cfg) {
+  // These only decide how many samples are taken, and how fast.
+  Configuration c = cfg;
+  c.num_waves = 0;
+  c.num_workers = 0;
+  c.headless = false;
+  c.preview_levels = 0;
+  c.tile_order = {};
+  c.budget = {};
+  c.checkpoint_period = 0;
+  c.output_image = {};
+  c.volume_loading = {};
+
+  return json_hash(c);
+}
+
+namespace {
+
+// What a loaded and preprocessed volume depends on, besides the path
+struct VolumeKey {
+  VolumeLoading volume_loading;
+  VolumeParameters volume_parameters;
+  ShadowParameters shadows;
+  Eigen::Vector3f light_direction;
+};
+
+} // namespace
+
+uint64_t volume_hash(const Configuration& cfg) {
+  VolumeKey key {
+    .volume_loading = cfg.volume_loading,
+    .volume_parameters = cfg.volume_parameters,
+    .shadows = cfg.worker_parameters.shadows,
+    .light_direction = cfg.worker_parameters.distant_light.inv_direction,
+  };
+
+  // The shadows are only precomputed in the cached mode
+  if (key.shadows.mode != ShadowParameters::Mode::Cached) {
+    key.shadows = { ShadowParameters::Mode::Exact, ShadowParameters::Estimator::RatioTracking, 0.0f };
+    key.light_direction = Eigen::Vector3f::Zero();
+  }
+
+  return json_hash(key);
+}
+
 } // namespace vpt
\ No newline at end of file
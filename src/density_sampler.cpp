@@ -0,0 +1,237 @@
+#include <cassert>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <vpt/density_sampler.hpp>
+
+namespace vpt {
+
+template <typename BuildT>
+DensitySampler<BuildT>::DensitySampler(const AccessorT& acc, const LeafPager* pager)
+  : m_acc(acc),
+    m_pager(pager),
+    m_fallback(acc)
+{}
+
+template <typename BuildT>
+DensitySampler<BuildT>::~DensitySampler() {
+  if (m_pager and m_cache.num_touches() + m_num_fallback_touches > 0)
+    m_pager->record_touches(m_cache.num_touches() + m_num_fallback_touches);
+}
+
+// The leaves have the same dimension whatever their build type
+using LeafT = GridTypes<float>::LeafT;
+static constexpr int LEAF_MASK = LeafT::DIM - 1;
+
+template <typename BuildT>
+bool LeafStencilCache<BuildT>::pin(const CoordT& ijk, const AccessorT& acc, const LeafPager* pager) {
+  CoordT origin = ijk & ~LEAF_MASK;
+  if (origin == m_origin)
+    return m_leaf != nullptr;
+
+  m_origin = origin;
+  m_leaf = acc.probeLeaf(origin);
+
+  if (m_leaf) {
+    if (pager) {
+      pager->touch(m_leaf);
+      ++m_num_touches;
+    }
+
+    for (int a = 0; a < 3; ++a) {
+      CoordT neighbour_origin = origin;
+      neighbour_origin[a] += LeafT::DIM;
+
+      m_neighbours[a] = acc.probeLeaf(neighbour_origin);
+
+      if (m_neighbours[a] and pager) {
+        pager->touch(m_neighbours[a]);
+        ++m_num_touches;
+      }
+    }
+  }
+
+  return m_leaf != nullptr;
+}
+
+template <typename BuildT>
+bool LeafStencilCache<BuildT>::fetch(const CoordT& ijk, float (&v)[8]) const {
+  assert((ijk & ~LEAF_MASK) == m_origin and m_leaf != nullptr);
+
+  // The leaf values are stored with x as the slowest varying axis, and z as the fastest.
+  constexpr uint32_t STRIDE[3] = { LeafT::DIM * LeafT::DIM, LeafT::DIM, 1 };
+
+  const uint32_t offset = LeafT::CoordToOffset(ijk);
+
+  // Along which axis (if any) does the stencil leave the leaf?
+  int crossing = -1;
+  for (int a = 0; a < 3; ++a) {
+    if ((ijk[a] & LEAF_MASK) != LEAF_MASK)
+      continue;
+
+    // Edges and corners would need more neighbours
+    if (crossing != -1 or m_neighbours[a] == nullptr)
+      return false;
+
+    crossing = a;
+  }
+
+  for (uint32_t c = 0; c < 8; ++c) {
+    const uint32_t d[3] = { (c >> 2) & 1, (c >> 1) & 1, c & 1 };
+
+    if (crossing != -1 and d[crossing]) {
+      // Wrap around to the first slab of the neighbour
+      v[c] = m_neighbours[crossing]->getValue(offset + d[0] * STRIDE[0] + d[1] * STRIDE[1] + d[2] * STRIDE[2] - LeafT::DIM * STRIDE[crossing]);
+    } else {
+      v[c] = m_leaf->getValue(offset + d[0] * STRIDE[0] + d[1] * STRIDE[1] + d[2] * STRIDE[2]);
+    }
+  }
+
+  return true;
+}
+
+static inline float lerp(float a, float b, float w) { return a + w * (b - a); }
+
+static inline float trilinear(const float (&v)[8], const nanovdb::Vec3f& uvw) {
+  // Same order as the NanoVDB trilinear sampler
+  return lerp(
+    lerp(lerp(v[0], v[1], uvw[2]), lerp(v[2], v[3], uvw[2]), uvw[1]),
+    lerp(lerp(v[4], v[5], uvw[2]), lerp(v[6], v[7], uvw[2]), uvw[1]),
+    uvw[0]
+  );
+}
+
+#if defined(__x86_64__)
+
+/*
+The AVX2 kernel is compiled for AVX2 whatever the flags of the build, and only called if the CPU has it: so a single binary runs everywhere,
+and the rest of the code is not compiled for AVX2 - which the linker could otherwise pick for the inline functions shared with other files.
+*/
+#define VPT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+
+/** @return Whether the CPU runs the AVX2 kernel. */
+static bool has_avx2() {
+  static const bool ans = __builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma");
+  return ans;
+}
+
+VPT_TARGET_AVX2 static inline __m256 lerp(__m256 a, __m256 b, __m256 w) { return _mm256_add_ps(a, _mm256_mul_ps(w, _mm256_sub_ps(b, a))); }
+
+/** @return The voxel at offset from each of the base offsets. */
+VPT_TARGET_AVX2 static inline __m256 gather_corner(const float* values, __m256i base, int offset) {
+  return _mm256_i32gather_ps(values, _mm256_add_epi32(base, _mm256_set1_epi32(offset)), sizeof(float));
+}
+
+/**
+  @brief Sample 8 points whose stencils all lie in the same leaf.
+  The 8 points are processed in the lanes of the vectors: one gather fetches the same stencil corner for all of them.
+*/
+VPT_TARGET_AVX2 static void sample_8_in_leaf(const float* values, const nanovdb::Vec3f* points, float* out) {
+  alignas(32) int32_t offsets[8];
+  alignas(32) float u[8], w[8], t[8];
+
+  for (int i = 0; i < 8; ++i) {
+    nanovdb::math::Coord ijk = points[i].floor();
+    offsets[i] = static_cast<int32_t>(LeafT::CoordToOffset(ijk));
+    u[i] = points[i][0] - static_cast<float>(ijk[0]);
+    w[i] = points[i][1] - static_cast<float>(ijk[1]);
+    t[i] = points[i][2] - static_cast<float>(ijk[2]);
+  }
+
+  const __m256i base = _mm256_load_si256(reinterpret_cast<const __m256i*>(offsets));
+
+  const __m256 vu = _mm256_load_ps(u);
+  const __m256 vw = _mm256_load_ps(w);
+  const __m256 vt = _mm256_load_ps(t);
+
+  __m256 ans = lerp(
+    lerp(lerp(gather_corner(values, base, 0),  gather_corner(values, base, 1),  vt), lerp(gather_corner(values, base, 8),  gather_corner(values, base, 9),  vt), vw),
+    lerp(lerp(gather_corner(values, base, 64), gather_corner(values, base, 65), vt), lerp(gather_corner(values, base, 72), gather_corner(values, base, 73), vt), vw),
+    vu
+  );
+
+  _mm256_storeu_ps(out, ans);
+}
+
+#endif
+
+template <typename BuildT>
+float DensitySampler<BuildT>::operator()(const nanovdb::Vec3f& point) const {
+  nanovdb::math::Coord ijk = point.floor();
+
+  float v[8];
+  if (m_cache.pin(ijk, m_acc, m_pager) and m_cache.fetch(ijk, v)) {
+    nanovdb::Vec3f uvw(point[0] - static_cast<float>(ijk[0]), point[1] - static_cast<float>(ijk[1]), point[2] - static_cast<float>(ijk[2]));
+    return trilinear(v, uvw);
+  }
+
+  // The stencil needs the leaves around an edge or a corner, which are not pinned
+  if (m_pager)
+    m_num_fallback_touches += m_pager->touch_stencil(m_acc, ijk);
+
+  return m_fallback(point);
+}
+
+/** @return Whether the stencil with lower corner ijk lies entirely in the leaf with the specified origin. */
+[[maybe_unused]] static inline bool stencil_in_leaf(const nanovdb::math::Coord& ijk, const nanovdb::math::Coord& origin) {
+  return (ijk & ~LEAF_MASK) == origin and
+    (ijk[0] & LEAF_MASK) != LEAF_MASK and (ijk[1] & LEAF_MASK) != LEAF_MASK and (ijk[2] & LEAF_MASK) != LEAF_MASK;
+}
+
+template <typename BuildT>
+void DensitySampler<BuildT>::operator()(std::span<const nanovdb::Vec3f> points, std::span<float> out) const {
+  assert(points.size() == out.size());
+
+  size_t i = 0;
+  while (i < points.size()) {
+#if defined(__x86_64__)
+    // Consecutive points along a ray usually fall in the same leaf - take the fast path when the next 8 of them do.
+    // The gathers read raw floats, so the quantized leaves take the scalar path.
+    if constexpr (std::is_same_v<BuildT, float>) {
+      if (i + 8 <= points.size() and has_avx2() and m_cache.pin(points[i].floor(), m_acc, m_pager)) {
+        bool same_leaf = true;
+        for (size_t j = i; same_leaf and j < i + 8; ++j)
+          same_leaf = stencil_in_leaf(points[j].floor(), m_cache.origin());
+
+        if (same_leaf) {
+          sample_8_in_leaf(m_cache.leaf()->data()->mValues, &points[i], &out[i]);
+          i += 8;
+          continue;
+        }
+      }
+    }
+#endif
+
+    out[i] = (*this)(points[i]);
+    ++i;
+  }
+}
+
+TemperatureSampler::TemperatureSampler(const VolumeGrids& grids, const LeafPager* pager)
+  : m_acc(grids.temperature().getAccessor()),
+    // The pager only has the leaves of a mapped temperature grid
+    m_pager(grids.is_temperature_mapped() ? pager : nullptr),
+    m_sampler(m_acc)
+{}
+
+TemperatureSampler::~TemperatureSampler() {
+  if (m_pager and m_num_touches > 0)
+    m_pager->record_touches(m_num_touches);
+}
+
+float TemperatureSampler::operator()(const nanovdb::Vec3f& point) const {
+  if (m_pager)
+    m_num_touches += m_pager->touch_stencil(m_acc, point.floor());
+
+  return m_sampler(point);
+}
+
+#define VPT_INSTANTIATE(BuildT) \
+  template struct LeafStencilCache<BuildT>; \
+  template struct DensitySampler<BuildT>;
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
+} // namespace vpt
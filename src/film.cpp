@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cassert>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <vpt/film.hpp>
+#include <vpt/color.hpp>
+#include <vpt/logging.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/parallel.hpp>
+
+namespace vpt {
+
+Film::Film(image_size_t size)
+  : m_radiance(size),
+    m_Y2(size),
+    m_num_blocks(
+      ceildiv(size.x(), DIRTY_BLOCK_SIZE),
+      ceildiv(size.y(), DIRTY_BLOCK_SIZE)
+    ),
+    m_dirty(m_num_blocks.prod())
+{
+  m_radiance.data().fill(decltype(m_radiance)::value_t::Zero());
+  m_Y2.data().fill(decltype(m_Y2)::value_t::Zero());
+}
+
+void Film::enable_preview() {
+  m_preview.emplace(size());
+  m_preview->data().fill(Eigen::Vector4f::Zero());
+}
+
+float Film::relative_error(const image_rect_t& rect) const {
+  auto radiance = m_radiance.data().block(rect.start.y(), rect.start.x(), rect.size.y(), rect.size.x());
+  auto Y2 = m_Y2.data().block(rect.start.y(), rect.start.x(), rect.size.y(), rect.size.x());
+
+  double sum_mean = 0.0;
+  double sum_variance = 0.0;
+
+  for (Eigen::Index i = 0; i < radiance.rows(); ++i) {
+    for (Eigen::Index j = 0; j < radiance.cols(); ++j) {
+      double n = radiance(i, j).w();
+
+      // We can't tell anything with less than two samples
+      if (n < 2.0)
+        return std::numeric_limits<float>::infinity();
+
+      double mean = radiance(i, j).y() / n;
+      double sample_variance = std::max(0.0, (Y2(i, j).x() / n - mean * mean) * n / (n - 1.0));
+
+      sum_mean += mean;
+      sum_variance += sample_variance / n;
+    }
+  }
+
+  const double num_pixels = static_cast<double>(radiance.size());
+
+  // Avoid blowing up on black tiles
+  constexpr double EPS = 1e-4;
+  return static_cast<float>(std::sqrt(sum_variance / num_pixels) / (sum_mean / num_pixels + EPS));
+}
+
+template <typename T, size_t N>
+static inline std::streamsize byte_size(const Image<T, N>& img) {
+  return static_cast<std::streamsize>(img.data().size() * sizeof(typename Image<T, N>::value_t));
+}
+
+bool Film::write(std::ostream& os) const {
+  return os.write(reinterpret_cast<const char*>(m_radiance.data().data()), byte_size(m_radiance)) and
+    os.write(reinterpret_cast<const char*>(m_Y2.data().data()), byte_size(m_Y2));
+}
+
+bool Film::read(std::istream& is) {
+  mark_all_dirty();
+
+  return is.read(reinterpret_cast<char*>(m_radiance.data().data()), byte_size(m_radiance)) and
+    is.read(reinterpret_cast<char*>(m_Y2.data().data()), byte_size(m_Y2));
+}
+
+size_t Film::write_size() const {
+  return static_cast<size_t>(byte_size(m_radiance) + byte_size(m_Y2));
+}
+
+Film& Film::operator+=(const Film& other) {
+  assert(size() == other.size());
+
+  m_radiance.data() += other.m_radiance.data();
+  m_Y2.data() += other.m_Y2.data();
+
+  mark_all_dirty();
+  return *this;
+}
+
+void Film::mark_dirty(const image_rect_t& rect) {
+  image_point_t b0 = rect.start / DIRTY_BLOCK_SIZE;
+  image_point_t b1 = (rect.start + rect.size - image_point_t::Ones()) / DIRTY_BLOCK_SIZE;
+
+  for (image_index_t by = b0.y(); by <= b1.y(); ++by)
+    for (image_index_t bx = b0.x(); bx <= b1.x(); ++bx)
+      m_dirty[by * m_num_blocks.x() + bx].store(true, std::memory_order_release);
+}
+
+void Film::mark_all_dirty() {
+  for (std::atomic<bool>& d : m_dirty)
+    d.store(true, std::memory_order_release);
+}
+
+std::vector<image_rect_t> Film::take_dirty() {
+  std::vector<image_rect_t> ans;
+
+  for (image_index_t by = 0; by < m_num_blocks.y(); ++by) {
+    for (image_index_t bx = 0; bx < m_num_blocks.x(); ++bx) {
+      if (not m_dirty[by * m_num_blocks.x() + bx].exchange(false, std::memory_order_acquire))
+        continue;
+
+      image_point_t start = image_point_t { bx, by } * DIRTY_BLOCK_SIZE;
+      image_size_t sz = (size() - start).cwiseMin(image_size_t::Constant(DIRTY_BLOCK_SIZE));
+
+      // Extend the previous rect, if this block is right next to it
+      if (not ans.empty() and ans.back().start.y() == start.y() and ans.back().start.x() + ans.back().size.x() == start.x())
+        ans.back().size.x() += sz.x();
+      else
+        ans.push_back({ start, sz });
+    }
+  }
+
+  return ans;
+}
+
+/** @brief Call fn(pixel, xyz) for each pixel of the film, where xyz is the mean of its samples - in parallel, in stripes of rows. */
+template <typename Fn>
+static void for_each_pixel_mean(const Film& film, unsigned int num_threads, Fn&& fn) {
+  constexpr size_t ROWS_PER_STRIPE = 16;
+
+  parallel_for(static_cast<size_t>(film.size().y()), num_threads, []() { return 0; }, [&](int, size_t y) {
+    for (image_index_t x = 0; x < film.size().x(); ++x) {
+      Eigen::Vector4f xyzw = film.radiance().data()(static_cast<image_index_t>(y), x);
+      fn(image_point_t { x, static_cast<image_index_t>(y) }, Eigen::Vector3f(xyzw.topRows<3>() / xyzw.w()));
+    }
+  }, ROWS_PER_STRIPE);
+}
+
+/** @brief Tone map the film to sRGB, with samples of the specified integer type. */
+template <typename T>
+static void film_to_srgb(const Film& film, Image<T, 3>& image, unsigned int num_threads) {
+  constexpr float max_value = static_cast<float>(std::numeric_limits<T>::max());
+
+  for_each_pixel_mean(film, num_threads, [&](const image_point_t& pt, const Eigen::Vector3f& xyz) {
+    Eigen::Vector3f linsrgb = xyz_to_linsrgb(xyz);
+    Eigen::Vector3f srgb = linsrgb_to_srgb(linsrgb);
+
+    image.data()(pt.y(), pt.x()) = (srgb.cwiseMax(0.0f).cwiseMin(1.0f) * max_value).cast<T>();
+  });
+}
+
+void film_to_image(const Film& film, Image<unsigned char, 3>& image, unsigned int num_threads) {
+  film_to_srgb(film, image, num_threads);
+}
+
+bool save_film_image(const std::filesystem::path& path, const Film& film, const OutputImage& params, unsigned int num_threads) {
+  if (path.extension() == ".pfm" or path.extension() == ".exr") {
+    Image<float, 3> image(film.size());
+
+    for_each_pixel_mean(film, num_threads, [&](const image_point_t& pt, const Eigen::Vector3f& xyz) {
+      // Keep the pixels without samples black, rather than NaN
+      Eigen::Vector3f value = params.float_color_space == OutputImage::ColorSpace::XYZ ? xyz : xyz_to_linsrgb(xyz);
+      image.data()(pt.y(), pt.x()) = value.array().isFinite().select(value, 0.0f);
+    });
+
+    return image.save(path);
+  }
+
+  if (path.extension() != ".png")
+    vptWARN("Unknown image format \"" << path.extension() << "\" - saving a PNG anyway");
+
+  if (params.png_bit_depth == 16) {
+    Image<uint16_t, 3> image(film.size());
+    film_to_srgb(film, image, num_threads);
+    return image.save(path);
+  }
+
+  Image<unsigned char, 3> image(film.size());
+  film_to_srgb(film, image, num_threads);
+  return image.save(path);
+}
+
+PreviewToneMapper::PreviewToneMapper()
+  : m_lut(LUT_SIZE)
+{
+  for (int i = 0; i < LUT_SIZE; ++i) {
+    float srgb = linsrgb_to_srgb(Eigen::Vector3f::Constant(static_cast<float>(i) / (LUT_SIZE - 1))).x();
+    m_lut[i] = static_cast<unsigned char>(std::clamp(srgb, 0.0f, 1.0f) * 255.0f);
+  }
+}
+
+void PreviewToneMapper::operator()(const Film& film, Image<unsigned char, 3>& image, std::span<const image_rect_t> rects, unsigned int num_threads) const {
+  // A dirty rect is at most one block of rows high, so the rows of all of them are shared out, rather than those of each rect
+  constexpr size_t ROWS_PER_BAND = 8;
+
+  std::vector<size_t> first_row(rects.size() + 1, 0);
+  for (size_t r = 0; r < rects.size(); ++r)
+    first_row[r + 1] = first_row[r] + static_cast<size_t>(rects[r].size.y());
+
+  parallel_for(first_row.back(), num_threads, []() { return 0; }, [&](int, size_t row) {
+    size_t r = static_cast<size_t>(std::ranges::upper_bound(first_row, row) - first_row.begin()) - 1;
+    const image_rect_t& rect = rects[r];
+    tone_map_row(film, image, rect.start.y() + static_cast<image_index_t>(row - first_row[r]), rect.start.x(), rect.size.x());
+  }, ROWS_PER_BAND);
+}
+
+void PreviewToneMapper::tone_map_row(const Film& film, Image<unsigned char, 3>& image, image_index_t y, image_index_t x, image_index_t width) const {
+  const Eigen::Matrix3f m = xyz_to_linsrgb_matrix();
+  const float lut_scale = static_cast<float>(LUT_SIZE - 1);
+
+  const Eigen::Vector4f* src = film.radiance().data().data() + y * film.size().x() + x;
+  Eigen::Vector3<unsigned char>* dst = image.data().data() + y * image.size().x() + x;
+
+  // The pixels without samples of their own show the preview, if any
+  const Eigen::Vector4f* preview_src = film.preview() ? film.preview()->data().data() + y * film.size().x() + x : src;
+
+  image_index_t j = 0;
+
+#if defined(__SSE2__)
+  // Four pixels at a time, one per lane: the selection of the preview, the normalization, the matrix and the LUT indices are computed for all of them at once.
+  // Only the reads of the LUT are scalar - a gather of bytes would cost as much.
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(lut_scale);
+  const __m128 half = _mm_set1_ps(0.5f);
+
+  __m128 mv[3][3];
+  for (int r = 0; r < 3; ++r)
+    for (int c = 0; c < 3; ++c)
+      mv[r][c] = _mm_set1_ps(m(r, c));
+
+  auto select = [](__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); };
+
+  for (; j + 4 <= width; j += 4) {
+    // Transposed to X, Y, Z and W of the four pixels
+    __m128 s0 = _mm_loadu_ps(src[j].data()), s1 = _mm_loadu_ps(src[j + 1].data()), s2 = _mm_loadu_ps(src[j + 2].data()), s3 = _mm_loadu_ps(src[j + 3].data());
+    __m128 p0 = _mm_loadu_ps(preview_src[j].data()), p1 = _mm_loadu_ps(preview_src[j + 1].data()), p2 = _mm_loadu_ps(preview_src[j + 2].data()), p3 = _mm_loadu_ps(preview_src[j + 3].data());
+    _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+    _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+
+    __m128 own = _mm_cmpgt_ps(s3, zero);
+    __m128 xyzw[4] = { select(own, s0, p0), select(own, s1, p1), select(own, s2, p2), select(own, s3, p3) };
+
+    // Pixels without samples yet are black
+    __m128 inv_w = _mm_and_ps(_mm_cmpgt_ps(xyzw[3], zero), _mm_div_ps(one, xyzw[3]));
+
+    alignas(16) int32_t idx[3][4];
+    for (int r = 0; r < 3; ++r) {
+      __m128 linsrgb = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(mv[r][0], xyzw[0]), _mm_mul_ps(mv[r][1], xyzw[1])), _mm_mul_ps(mv[r][2], xyzw[2])),
+        inv_w
+      );
+
+      // max first, as it returns its second operand for NaNs
+      __m128 clamped = _mm_min_ps(_mm_max_ps(linsrgb, zero), one);
+      _mm_store_si128(reinterpret_cast<__m128i*>(idx[r]), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(clamped, scale), half)));
+    }
+
+    for (int k = 0; k < 4; ++k)
+      dst[j + k] = { m_lut[idx[0][k]], m_lut[idx[1][k]], m_lut[idx[2][k]] };
+  }
+#endif
+
+  for (; j < width; ++j) {
+    const Eigen::Vector4f& xyzw = src[j].w() > 0.0f ? src[j] : preview_src[j];
+
+    // Pixels without samples yet are black
+    float inv_w = xyzw.w() > 0.0f ? 1.0f / xyzw.w() : 0.0f;
+
+    Eigen::Vector3f linsrgb = m * (xyzw.head<3>() * inv_w);
+    Eigen::Vector3i idx = (linsrgb.cwiseMax(0.0f).cwiseMin(1.0f) * lut_scale + Eigen::Vector3f::Constant(0.5f)).cast<int>();
+
+    dst[j] = { m_lut[idx.x()], m_lut[idx.y()], m_lut[idx.z()] };
+  }
+}
+
+/*
+Film file layout: a FilmHeader, followed by the raw film.
+Everything is stored in the native (little endian) representation.
+*/
+namespace {
+
+struct FilmHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t seed;
+  uint64_t config_hash;
+  uint32_t wave_begin;
+  uint32_t wave_end;
+};
+
+constexpr char FILM_MAGIC[8] = { 'V', 'P', 'T', 'F', 'I', 'L', 'M', '\0' };
+
+constexpr uint32_t FILM_VERSION = 1;
+
+} // namespace
+
+bool write_film(std::ostream& os, const FilmInfo& info, const Film& film) {
+  FilmHeader header {
+    .magic = {},
+    .version = FILM_VERSION,
+    .width = static_cast<uint32_t>(film.size().x()),
+    .height = static_cast<uint32_t>(film.size().y()),
+    .seed = info.seed,
+    .config_hash = info.config_hash,
+    .wave_begin = info.wave_begin,
+    .wave_end = info.wave_end,
+  };
+  std::memcpy(header.magic, FILM_MAGIC, sizeof(FILM_MAGIC));
+
+  return os.write(reinterpret_cast<const char*>(&header), sizeof(header)) and film.write(os) and os.flush();
+}
+
+bool save_film(const std::filesystem::path& path, const FilmInfo& info, const Film& film) {
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  if (not (os and write_film(os, info, film))) {
+    vptWARN("Failed to write the film " << path);
+    return false;
+  }
+
+  return true;
+}
+
+std::optional<Film> load_film(const std::filesystem::path& path, FilmInfo& info) {
+  std::ifstream is(path, std::ios::binary);
+  if (not is) {
+    vptWARN("Failed to open the film " << path);
+    return std::nullopt;
+  }
+
+  FilmHeader header;
+  if (not is.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    vptWARN("Film " << path << " is truncated.");
+    return std::nullopt;
+  }
+
+  if (std::memcmp(header.magic, FILM_MAGIC, sizeof(FILM_MAGIC)) != 0 or header.version != FILM_VERSION) {
+    vptWARN("Film " << path << " has an unknown format or version.");
+    return std::nullopt;
+  }
+
+  Film ans(image_size_t { header.width, header.height });
+  if (not ans.read(is)) {
+    vptWARN("Film " << path << " is truncated.");
+    return std::nullopt;
+  }
+
+  info = {
+    .seed = header.seed,
+    .config_hash = header.config_hash,
+    .wave_begin = header.wave_begin,
+    .wave_end = header.wave_end,
+  };
+  return ans;
+}
+
+bool FilmMerger::add(const std::filesystem::path& path, const FilmInfo& info, Film&& film) {
+  if (not m_film) {
+    m_film = std::move(film);
+  } else {
+    const Part& first = m_parts.front();
+    if (film.size() != m_film->size() or info.seed != first.info.seed or info.config_hash != first.info.config_hash) {
+      vptWARN(path << " belongs to a different render than " << first.path);
+      return false;
+    }
+
+    *m_film += film;
+  }
+
+  m_parts.push_back({ path, info });
+  return true;
+}
+
+std::optional<FilmMerger::Result> FilmMerger::finish() {
+  if (not m_film)
+    return std::nullopt;
+
+  std::ranges::sort(m_parts, {}, [](const Part& part) { return part.info.wave_begin; });
+
+  bool contiguous = true;
+  for (size_t i = 1; i < m_parts.size(); ++i) {
+    if (m_parts[i].info.wave_begin < m_parts[i - 1].info.wave_end) {
+      vptWARN("The waves of " << m_parts[i].path << " overlap with the ones of " << m_parts[i - 1].path);
+      return std::nullopt;
+    }
+
+    if (m_parts[i].info.wave_begin > m_parts[i - 1].info.wave_end) {
+      vptWARN("Waves [" << m_parts[i - 1].info.wave_end << ", " << m_parts[i].info.wave_begin << ") are missing");
+      contiguous = false;
+    }
+  }
+
+  FilmInfo info = m_parts.front().info;
+  info.wave_end = m_parts.back().info.wave_end;
+
+  Result ans { std::move(*m_film), info, contiguous };
+  m_film.reset();
+  m_parts.clear();
+  return ans;
+}
+
+} // namespace vpt
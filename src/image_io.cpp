@@ -1,4 +1,7 @@
 #include <fstream>
+#include <vector>
+#include <bit>
+#include <cstring>
 
 #include <spng.h>
 
@@ -57,5 +60,142 @@ bool save_image(const std::filesystem::path& path, const char* data, int width,
   return true;
 }
 
+/*
+Portable float map: a text header, then the rows from bottom to top.
+The negative scale means little endian.
+*/
+static bool save_pfm(const std::filesystem::path& path, const float* data, int width, int height) {
+  static_assert(std::endian::native == std::endian::little);
+
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  os << "PF\n" << width << ' ' << height << "\n-1.0\n";
+
+  const std::streamsize row_size = static_cast<std::streamsize>(width) * 3 * sizeof(float);
+  for (int y = height - 1; y >= 0 and os; --y)
+    os.write(reinterpret_cast<const char*>(data + static_cast<size_t>(y) * width * 3), row_size);
+
+  if (not os.flush()) {
+    vptWARN("Failed to write PFM file \"" << path << "\"");
+    return false;
+  }
+
+  return true;
+}
+
+/*
+Minimal OpenEXR writer: single part, scanlines, no compression, 32 bit float B, G, R channels (they must be sorted by name).
+See "The OpenEXR File Layout" for the details.
+*/
+namespace {
+
+struct ExrWriter {
+  std::ostream& os;
+
+  template <typename T>
+  void write(const T& value) {
+    static_assert(std::endian::native == std::endian::little);
+    os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void write_str(const char* str) {
+    os.write(str, static_cast<std::streamsize>(std::strlen(str) + 1));
+  }
+
+  void attribute(const char* name, const char* type, int32_t size) {
+    write_str(name);
+    write_str(type);
+    write(size);
+  }
+};
+
+} // namespace
+
+static bool save_exr(const std::filesystem::path& path, const float* data, int width, int height) {
+  constexpr const char* CHANNELS[] = { "B", "G", "R" };
+  constexpr int32_t PIXEL_TYPE_FLOAT = 2;
+
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  ExrWriter w { os };
+
+  w.write<int32_t>(20000630); // Magic
+  w.write<int32_t>(2);        // Version 2, single part scanline file
+
+  w.attribute("channels", "chlist", 3 * (2 + 16) + 1);
+  for (const char* name : CHANNELS) {
+    w.write_str(name);
+    w.write<int32_t>(PIXEL_TYPE_FLOAT);
+    w.write<uint8_t>(0); // pLinear
+    w.write<uint8_t>(0); // Reserved
+    w.write<uint8_t>(0);
+    w.write<uint8_t>(0);
+    w.write<int32_t>(1); // x sampling
+    w.write<int32_t>(1); // y sampling
+  }
+  w.write<uint8_t>(0);
+
+  w.attribute("compression", "compression", 1);
+  w.write<uint8_t>(0); // NO_COMPRESSION
+
+  for (const char* window : { "dataWindow", "displayWindow" }) {
+    w.attribute(window, "box2i", 16);
+    w.write<int32_t>(0);
+    w.write<int32_t>(0);
+    w.write<int32_t>(width - 1);
+    w.write<int32_t>(height - 1);
+  }
+
+  w.attribute("lineOrder", "lineOrder", 1);
+  w.write<uint8_t>(0); // INCREASING_Y
+
+  w.attribute("pixelAspectRatio", "float", 4);
+  w.write<float>(1.0f);
+
+  w.attribute("screenWindowCenter", "v2f", 8);
+  w.write<float>(0.0f);
+  w.write<float>(0.0f);
+
+  w.attribute("screenWindowWidth", "float", 4);
+  w.write<float>(1.0f);
+
+  w.write<uint8_t>(0); // End of the header
+
+  // Offset table - one chunk per scanline, each with its y and size before the pixels
+  const int32_t line_size = width * 3 * static_cast<int32_t>(sizeof(float));
+  const uint64_t first_chunk = static_cast<uint64_t>(os.tellp()) + static_cast<uint64_t>(height) * sizeof(uint64_t);
+  for (int y = 0; y < height; ++y)
+    w.write<uint64_t>(first_chunk + static_cast<uint64_t>(y) * (8 + line_size));
+
+  std::vector<float> line(static_cast<size_t>(width) * 3);
+  for (int y = 0; y < height and os; ++y) {
+    w.write<int32_t>(y);
+    w.write<int32_t>(line_size);
+
+    // Interleaved RGB to planar BGR
+    const float* row = data + static_cast<size_t>(y) * width * 3;
+    for (int c = 0; c < 3; ++c)
+      for (int x = 0; x < width; ++x)
+        line[static_cast<size_t>(c) * width + x] = row[x * 3 + (2 - c)];
+
+    os.write(reinterpret_cast<const char*>(line.data()), line_size);
+  }
+
+  if (not os.flush()) {
+    vptWARN("Failed to write OpenEXR file \"" << path << "\"");
+    return false;
+  }
+
+  return true;
+}
+
+bool save_float_image(const std::filesystem::path& path, const float* data, int width, int height) {
+  if (path.extension() == ".pfm")
+    return save_pfm(path, data, width, height);
+  if (path.extension() == ".exr")
+    return save_exr(path, data, width, height);
+
+  vptWARN("Unknown float image format \"" << path.extension() << "\" - expected .pfm or .exr");
+  return false;
+}
+
 } // namespace detail
 } // namespace vpt
\ No newline at end of file
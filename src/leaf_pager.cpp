@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vpt/leaf_pager.hpp>
+#include <vpt/logging.hpp>
+#include <vpt/utils.hpp>
+
+namespace vpt {
+
+// How many absent blocks are checked for mapped pages at each fault
+static constexpr size_t ADOPT_CHECKS_PER_FAULT = 4;
+
+static const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+LeafPager::LeafPager(std::vector<range_t> leaves, size_t budget_bytes)
+  : m_leaves(std::move(leaves))
+{
+  std::ranges::sort(m_leaves);
+
+  m_first_block = m_leaves.front().first >> BLOCK_SHIFT;
+  m_num_blocks = ceildiv(m_leaves.back().second, BLOCK_SIZE) - m_first_block;
+
+  // Less than two blocks would evict the block being faulted in
+  m_budget_blocks = std::max<size_t>(2, budget_bytes / BLOCK_SIZE);
+
+  m_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (m_pagemap_fd < 0)
+    vptWARN("Can't read /proc/self/pagemap (" << std::strerror(errno) << ") - only the leaves which are touched are accounted for");
+
+  // The kernel would otherwise read ahead around each fault, into blocks which were not touched
+  for (const auto& [begin, end] : m_leaves) {
+    uintptr_t first_page = begin / page_size * page_size;
+    if (madvise(reinterpret_cast<void*>(first_page), end - first_page, MADV_RANDOM) != 0)
+      vptWARN("Failed to disable the read ahead of the leaves: " << std::strerror(errno));
+  }
+
+  m_blocks = std::make_unique<std::atomic<uint8_t>[]>(m_num_blocks);
+  for (size_t i = 0; i < m_num_blocks; ++i) {
+    m_blocks[i].store(ABSENT, std::memory_order_relaxed);
+    evict(i);
+  }
+}
+
+LeafPager::~LeafPager() {
+  if (m_pagemap_fd >= 0)
+    close(m_pagemap_fd);
+}
+
+template <typename F>
+void LeafPager::for_each_leaf_pages(size_t block, bool only_leaves, F&& f) const {
+  uintptr_t block_begin = (m_first_block + block) << BLOCK_SHIFT;
+  uintptr_t block_end = (m_first_block + block + 1) << BLOCK_SHIFT;
+
+  for (const auto& [leaves_begin, leaves_end] : m_leaves) {
+    uintptr_t begin, end;
+    if (only_leaves) {
+      begin = std::max(block_begin, ceildiv(leaves_begin, page_size) * page_size);
+      end = std::min(block_end, leaves_end / page_size * page_size);
+    } else {
+      begin = std::max(block_begin, leaves_begin / page_size * page_size);
+      end = std::min(block_end, ceildiv(leaves_end, page_size) * page_size);
+    }
+
+    if (begin < end)
+      f(begin, end);
+  }
+}
+
+void LeafPager::evict(size_t block) const {
+  // Don't drop the pages shared with the rest of the trees - they should stay resident.
+  for_each_leaf_pages(block, true, [](uintptr_t begin, uintptr_t end) {
+    if (madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED) != 0)
+      vptWARN("Failed to evict a block of leaves: " << std::strerror(errno));
+  });
+}
+
+size_t LeafPager::mapped_pages(size_t block) const {
+  if (m_pagemap_fd < 0)
+    return 0;
+
+  // One entry per page, whose bit 63 is set if the page is present
+  constexpr uint64_t PRESENT = uint64_t(1) << 63;
+  uint64_t entries[BLOCK_SIZE / 4096];
+
+  size_t ans = 0;
+  for_each_leaf_pages(block, true, [&](uintptr_t begin, uintptr_t end) {
+    size_t num_pages = std::min((end - begin) / page_size, std::size(entries));
+    ssize_t read = pread(m_pagemap_fd, entries, num_pages * sizeof(uint64_t), static_cast<off_t>(begin / page_size * sizeof(uint64_t)));
+
+    for (ssize_t i = 0; i < read / static_cast<ssize_t>(sizeof(uint64_t)); ++i)
+      ans += (entries[i] & PRESENT) != 0;
+  });
+
+  return ans;
+}
+
+void LeafPager::adopt_if_mapped(size_t block) const {
+  if (m_blocks[block].load(std::memory_order_relaxed) != ABSENT or mapped_pages(block) == 0)
+    return;
+
+  // Not touched, so the first to go. A touch racing with this one faults, and finds it resident.
+  uint8_t state = ABSENT;
+  if (m_blocks[block].compare_exchange_strong(state, UNREFERENCED, std::memory_order_relaxed)) {
+    ++m_resident_blocks;
+    m_adopted.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void LeafPager::sweep(size_t spared) const {
+  // Give each resident block a second chance: clear its reference bit the first time around, evict it the second time.
+  while (m_resident_blocks > m_budget_blocks) {
+    size_t victim = m_clock_hand;
+    m_clock_hand = (m_clock_hand + 1) % m_num_blocks;
+
+    if (victim == spared)
+      continue;
+
+    uint8_t state = REFERENCED;
+    if (m_blocks[victim].compare_exchange_strong(state, UNREFERENCED, std::memory_order_relaxed))
+      continue;
+
+    if (state == UNREFERENCED and m_blocks[victim].compare_exchange_strong(state, ABSENT, std::memory_order_relaxed)) {
+      evict(victim);
+      --m_resident_blocks;
+      m_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+void LeafPager::fault(size_t block) const {
+  std::lock_guard lck(m_mtx);
+
+  // Someone else faulted it in meanwhile
+  if (m_blocks[block].exchange(REFERENCED, std::memory_order_relaxed) != ABSENT)
+    return;
+
+  m_misses.fetch_add(1, std::memory_order_relaxed);
+  ++m_resident_blocks;
+
+  // Read the whole block ahead, rather than page by page as the leaves are read
+  for_each_leaf_pages(block, false, [](uintptr_t begin, uintptr_t end) {
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+  });
+
+  for (size_t i = 0; i < ADOPT_CHECKS_PER_FAULT; ++i) {
+    adopt_if_mapped(m_adopt_hand);
+    m_adopt_hand = (m_adopt_hand + 1) % m_num_blocks;
+  }
+
+  sweep(block);
+}
+
+LeafPager::Stats LeafPager::stats() const {
+  std::lock_guard lck(m_mtx);
+
+  size_t mapped = 0;
+  for (size_t i = 0; i < m_num_blocks; ++i)
+    mapped += mapped_pages(i);
+
+  return {
+    .touches = m_touches.load(std::memory_order_relaxed),
+    .misses = m_misses.load(std::memory_order_relaxed),
+    .evictions = m_evictions.load(std::memory_order_relaxed),
+    .adopted = m_adopted.load(std::memory_order_relaxed),
+    .resident_bytes = m_resident_blocks * BLOCK_SIZE,
+    .mapped_bytes = mapped * page_size,
+    .budget_bytes = m_budget_blocks * BLOCK_SIZE,
+  };
+}
+
+} // namespace vpt
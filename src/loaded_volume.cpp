@@ -0,0 +1,35 @@
+#include <vpt/loaded_volume.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/logging.hpp>
+
+namespace vpt {
+
+static VolumeGrids load_grids(const Configuration& cfg, const std::filesystem::path& path) {
+  Stopwatch sw;
+  // VolumeGrids grids = VolumeGrids::generate_donut();
+  VolumeGrids ans = VolumeGrids::read_from_file(path, cfg.volume_loading);
+  vptINFO("Loaded " << path << " in " << sw.elapsed_ms() << " ms");
+  return ans;
+}
+
+static std::filesystem::path majorant_cache_path(const std::filesystem::path& path) {
+  std::filesystem::path ans = path;
+  ans += ".vptmaj";
+  return ans;
+}
+
+LoadedVolume::LoadedVolume(const Configuration& cfg, const std::filesystem::path& path)
+  : grids(load_grids(cfg, path)),
+    vol(grids, cfg.volume_parameters, cfg.num_workers, majorant_cache_path(path))
+{
+  vol.precompute_shadows(cfg.worker_parameters, cfg.num_workers);
+
+  if (cfg.volume_loading.leaf_cache_mib > 0) {
+    if (vol.page_leaves(size_t(cfg.volume_loading.leaf_cache_mib) << 20))
+      vptINFO("Paging the leaves, with at most " << cfg.volume_loading.leaf_cache_mib << " MiB of them resident");
+    else
+      vptWARN("The leaves can only be paged when the volume is mapped in place (see volume_loading) - keeping them all resident.");
+  }
+}
+
+} // namespace vpt
@@ -1,93 +1,241 @@
+#include <csignal>
+#include <charconv>
+#include <cmath>
+#include <numbers>
+#include <condition_variable>
+#include <future>
+
 #include <vpt/volume.hpp>
+#include <vpt/loaded_volume.hpp>
 #include <vpt/configuration.hpp>
 #include <vpt/image.hpp>
 #include <vpt/worker.hpp>
+#include <vpt/worker_pool.hpp>
+#include <vpt/tile_order.hpp>
+#include <vpt/checkpoint.hpp>
+#include <vpt/server.hpp>
 
 #include <vpt/logging.hpp>
 
+#ifdef VPT_VIEWER
 #include <raylib.h>
+#endif
 #include <vpt/color.hpp>
 #include <vpt/spectral.hpp>
 
-void film_to_image(const vpt::Image<float, 4>& film, vpt::Image<unsigned char, 3>& image) {
-  for (Eigen::Index i = 0; i < image.data().rows(); ++i) {
-    for (Eigen::Index j = 0; j < image.data().cols(); ++j) {
-      Eigen::Vector4f xyzw = film.data()(i,j);
-      Eigen::Vector3f xyz = xyzw.topRows<3>() / xyzw.w();
+// Exit status of a render which was interrupted, but whose (partial) output was saved anyway - the same as a shell would report for SIGINT.
+static constexpr int EXIT_INTERRUPTED = 128 + SIGINT;
 
-      Eigen::Vector3f linsrgb = vpt::xyz_to_linsrgb(xyz);
-      Eigen::Vector3f srgb = vpt::linsrgb_to_srgb(linsrgb);
+static std::atomic<unsigned int> g_interrupt_count(0);
 
-      image.data()(i,j) = (srgb.cwiseMax(0.0f).cwiseMin(1.0f) * 255.0f).cast<unsigned char>();
-    } 
-  }
+static void on_interrupt(int) {
+  g_interrupt_count.fetch_add(1);
 }
 
-int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    vptFATAL("Usage: " << argv[0] << " config_path output_path");
-    return 1;
+/** @brief Lets the main thread wait for the workers to be done. */
+struct Completion {
+  std::mutex mtx;
+  std::condition_variable cv;
+  unsigned int count = 0;
+  std::chrono::milliseconds max_elapsed { 0 };
+
+  void worker_done(std::chrono::milliseconds elapsed) {
+    {
+      std::lock_guard lock(mtx);
+      ++count;
+      max_elapsed = std::max(elapsed, max_elapsed);
+    }
+    cv.notify_all();
   }
 
-  vpt::init_blackbody_radiation_xyz();
-
-  std::filesystem::path config_path = std::filesystem::canonical(argv[1]);
-  std::filesystem::path output_path(argv[2]);
+  /** @return Whether all the workers are done, waiting at most for the specified timeout. */
+  bool wait_for(unsigned int num_workers, std::chrono::milliseconds timeout) {
+    std::unique_lock lock(mtx);
+    return cv.wait_for(lock, timeout, [&]() { return count == num_workers; });
+  }
+};
 
-  vpt::Configuration cfg = vpt::read_configuration(config_path);
+/** @brief Stop at the next wave on the first interrupt, and right away on the second one. */
+static void handle_interrupts(vpt::TileProvider& provider) {
+  static unsigned int handled = 0;
 
-  // vpt::VolumeGrids grids = vpt::VolumeGrids::generate_donut();
-  vpt::VolumeGrids grids = vpt::VolumeGrids::read_from_file(config_path.parent_path() / cfg.volume_path);
-  vpt::Volume vol(grids, cfg.volume_parameters);
+  unsigned int count = g_interrupt_count.load();
+  if (count == handled)
+    return;
 
-  if (grids.has_temperature())
-    std::cout << "TempMin: " << grids.temperature().tree().root().minimum() << ", TempMax: " << grids.temperature().tree().root().maximum() << std::endl;
+  if (handled == 0) {
+    vptINFO("Interrupted - waiting for all workers to reach the next wave before saving the image (interrupt again to stop now)...");
+    provider.stop_at_next_wave();
+  }
+  if (count > 1) {
+    vptINFO("Interrupted again - stopping now. The image will not have the same number of samples in every tile.");
+    provider.stop_now();
+  }
 
-  vpt::TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size);
+  handled = count;
+}
 
-  std::vector<std::jthread> threads;
+/** @brief Wait for the render to complete, logging the progress every now and then. */
+static void wait_headless(const vpt::Configuration& cfg, vpt::TileProvider& provider, Completion& completion) {
+  constexpr std::chrono::seconds log_period(10);
 
-  vpt::Image<float, 4> film(cfg.output_size);
-  film.data().fill(decltype(film)::value_t::Zero());
+  auto last_log = std::chrono::steady_clock::now();
+  while (not completion.wait_for(cfg.num_workers, std::chrono::milliseconds(100))) {
+    handle_interrupts(provider);
 
-  vpt::Image<unsigned char, 3> img(cfg.output_size);
-  img.data().fill(decltype(img)::value_t::Zero());
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_log >= log_period) {
+      auto eta = std::chrono::duration_cast<std::chrono::seconds>(provider.eta());
+      vptINFO("Progress: " << provider.progress() << "% - ETA: " << eta.count() << " s");
+      last_log = now;
+    }
+  }
+}
 
-  vpt::Camera camera(cfg.camera_parameters, cfg.output_size);
+/** A render of the volume. The viewer replaces it as a whole when the scene is edited, while the workers may still be on it. */
+struct RenderSession {
+  vpt::WorkerParameters params;
+  vpt::Camera camera;
+  vpt::Film film;
+  vpt::TileProvider provider;
+  vpt::View view { camera, film };
+
+  RenderSession(const vpt::Configuration& cfg, const vpt::Volume& vol, const vpt::CameraParameters& camera, const vpt::WorkerParameters& params, unsigned int waves)
+    : params(params),
+      camera(camera, cfg.output_size),
+      film(cfg.output_size),
+      provider(cfg.output_size, waves, cfg.tile_size, cfg.num_workers)
+  {
+    vpt::order_tiles(cfg, vol, std::span(&view, 1), provider);
+  }
 
-  std::mutex completion_mtx;
-  unsigned int completion_count = 0;
-  std::chrono::milliseconds completion_max_elapsed(0);
+  /** @brief Show a coarse image first, in the preview levels of the configuration. Must be called before the workers start. */
+  void enable_preview(const vpt::Configuration& cfg) {
+    // The preview blocks would hide the single pixel being debugged
+    if (cfg.preview_levels == 0 or params.single_pixel.enabled)
+      return;
 
-  provider.reset_eta();
-  for (unsigned int i = 0; i < cfg.num_workers; ++i) {
-    threads.emplace_back([&]() {
-      auto start = std::chrono::high_resolution_clock::now();
+    film.enable_preview();
+    provider.set_preview(cfg.preview_levels);
+  }
 
-      vpt::RandomNumberGenerator rng(cfg.seed);
-      vpt::run(cfg.worker_parameters, vol, camera, provider, film, rng);
+  /** @return The task rendering this session, which keeps it alive while the workers are on it. */
+  static vpt::WorkerPool::Task task(const vpt::Configuration& cfg, const vpt::Volume& vol, const std::shared_ptr<RenderSession>& session) {
+    return { &session->params, &vol, std::span(&session->view, 1), &session->provider, cfg.seed, session };
+  }
+};
+
+#ifdef VPT_VIEWER
+/** The parameters which can be edited in the viewer. */
+struct SceneEdits {
+  vpt::CameraParameters camera;
+  vpt::WorkerParameters params;
+  vpt::VolumeParameters volume;
+
+  /** @brief Apply the input of this frame. @return Whether anything changed, and whether it was the volume or the direction of the light (which the cached shadows depend on). */
+  bool update(bool& volume_changed, bool& light_direction_changed) {
+    bool changed = false;
+    volume_changed = false;
+    light_direction_changed = false;
+
+    // Drag to orbit the camera around the point it looks at, scroll to get closer or farther
+    Eigen::Vector3f offset = camera.position - camera.look;
+    Eigen::Vector3f up = camera.up.normalized();
+
+    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+      Vector2 delta = GetMouseDelta();
+      if (delta.x != 0.0f or delta.y != 0.0f) {
+        offset = Eigen::AngleAxisf(-0.005f * delta.x, up) * offset;
+
+        // Not over the poles, where the orbit would flip
+        Eigen::Vector3f right = offset.cross(up).normalized();
+        Eigen::Vector3f pitched = Eigen::AngleAxisf(0.005f * delta.y, right) * offset;
+        if (std::abs(pitched.normalized().dot(up)) < 0.99f)
+          offset = pitched;
+
+        changed = true;
+      }
+    }
 
-      auto end = std::chrono::high_resolution_clock::now();
+    if (float wheel = GetMouseWheelMove(); wheel != 0.0f) {
+      offset *= std::pow(0.9f, wheel);
+      changed = true;
+    }
 
-      auto elapsed = std::chrono::duration_cast<decltype(completion_max_elapsed)>(end - start);
+    camera.position = camera.look + offset;
 
-      {
-        std::lock_guard lock(completion_mtx);
-        ++completion_count;
-        completion_max_elapsed = std::max(elapsed, completion_max_elapsed);
+    // A key scales a parameter up, or down with shift
+    const bool down = IsKeyDown(KEY_LEFT_SHIFT) or IsKeyDown(KEY_RIGHT_SHIFT);
+    auto scale = [&](KeyboardKey key, float& value, bool& flag) {
+      if (IsKeyPressed(key)) {
+        value *= down ? 0.8f : 1.25f;
+        flag = changed = true;
       }
+    };
 
-      vptINFO(std::this_thread::get_id() << " IS DONE!");
+    scale(KEY_S, volume.sigma_s, volume_changed);
+    scale(KEY_A, volume.sigma_a, volume_changed);
+    scale(KEY_E, volume.le_scale, volume_changed);
 
-      if (completion_count == cfg.num_workers) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(300)); // poor man's synchronization :)
-        vptINFO("Rendering complete in " << completion_max_elapsed.count() << " ms");
-      }
-    });
+    bool light_changed = false;
+    scale(KEY_L, params.distant_light.multiplier, light_changed);
+    scale(KEY_I, params.infinite_light.multiplier, light_changed);
+
+    if (IsKeyPressed(KEY_G)) {
+      volume.henyey_greenstein_g = std::clamp(volume.henyey_greenstein_g + (down ? -0.05f : 0.05f), -0.95f, 0.95f);
+      volume_changed = changed = true;
+    }
+
+    // The arrows turn the distant light, by 5 degrees
+    constexpr float step = 5.0f * std::numbers::pi_v<float> / 180.0f;
+    Eigen::Vector3f light = params.distant_light.inv_direction;
+    Eigen::Vector3f light_right = light.cross(Eigen::Vector3f::UnitY());
+
+    if (IsKeyPressed(KEY_LEFT) or IsKeyPressed(KEY_RIGHT))
+      light = Eigen::AngleAxisf(IsKeyPressed(KEY_LEFT) ? step : -step, Eigen::Vector3f::UnitY()) * light;
+    if ((IsKeyPressed(KEY_UP) or IsKeyPressed(KEY_DOWN)) and light_right.squaredNorm() > 0.0f)
+      light = Eigen::AngleAxisf(IsKeyPressed(KEY_UP) ? step : -step, light_right.normalized()) * light;
+
+    if (light != params.distant_light.inv_direction) {
+      params.distant_light.inv_direction = light;
+      light_direction_changed = changed = true;
+    }
+
+    return changed;
   }
 
+  void draw_help() const {
+    std::ostringstream oss;
+    oss << "sigma_s " << volume.sigma_s << " [S]  sigma_a " << volume.sigma_a << " [A]  g " << volume.henyey_greenstein_g << " [G]  Le " << volume.le_scale << " [E]  "
+      << "light " << params.distant_light.multiplier << " [L, arrows]  sky " << params.infinite_light.multiplier << " [I]\n"
+      << "Shift lowers, R resets. Drag to orbit, scroll to zoom.";
+    DrawText(oss.str().c_str(), 20, GetScreenHeight() - 50, 16, WHITE);
+  }
+};
+
+/**
+  @brief Show the film as it is rendered, until the window is closed or the process is interrupted.
+  The camera, the lights and the volume parameters can be edited (unless editable is false): the edits start a new session, while the volume stays loaded.
+  A burst of edits (e.g. a drag) is coalesced into one session, or one every SESSION_INTERVAL while it lasts, as each session orders its tiles anew.
+  The workers finish the tile they are on into the film of the previous session, which their task keeps alive - so its samples never mix with the new one.
+  @return The session on screen when the viewer was closed, after the workers reached its next wave (or stopped, if interrupted again).
+*/
+static std::shared_ptr<RenderSession> run_viewer(const vpt::Configuration& cfg, vpt::Volume& vol, std::shared_ptr<RenderSession> session, vpt::Image<unsigned char, 3>& img, bool editable) {
+  vpt::WorkerPool pool(cfg.num_workers);
+  session->enable_preview(cfg);
+  session->provider.reset_eta();
+  pool.start(RenderSession::task(cfg, vol, session));
+
+  const SceneEdits initial { session->camera.params(), session->params, vol.params() };
+  SceneEdits edits = initial;
+
+  // The edits which no session renders yet
+  constexpr auto SESSION_INTERVAL = std::chrono::milliseconds(250);
+  bool pending = false, pending_volume = false, pending_light_direction = false;
+  auto session_start = std::chrono::steady_clock::now();
+
   InitWindow(cfg.output_size.x(), cfg.output_size.y(), ("vpt - " + cfg.volume_path.filename().string()).c_str());
-  SetTargetFPS(5);
+  SetTargetFPS(editable ? 30 : 5);
 
   Image image;
   image.data = img.data().data();
@@ -98,14 +246,66 @@ int main(int argc, char* argv[]) {
 
   Texture2D texture = LoadTextureFromImage(image);
 
-  while (!WindowShouldClose())
-  { 
+  vpt::PreviewToneMapper tone_map;
+  std::vector<unsigned char> staging;
+
+  while (!WindowShouldClose() and g_interrupt_count == 0)
+  {
+    bool volume_changed = false, light_direction_changed = false;
+    bool changed = editable and edits.update(volume_changed, light_direction_changed);
+    if (editable and IsKeyPressed(KEY_R)) {
+      volume_changed = light_direction_changed = changed = true;
+      edits = initial;
+    }
+
+    pending |= changed;
+    pending_volume |= volume_changed;
+    pending_light_direction |= light_direction_changed;
+
+    // Once the input settles, or the last session is old enough
+    auto now = std::chrono::steady_clock::now();
+    if (pending and (not changed or now - session_start >= SESSION_INTERVAL)) {
+      session->provider.stop_now();
+
+      // The workers share the volume, so they must be done with it before it changes
+      bool shadows_changed = edits.params.shadows.mode == vpt::ShadowParameters::Mode::Cached and (pending_volume or pending_light_direction);
+      if (pending_volume or shadows_changed) {
+        pool.wait();
+        vol.set_params(edits.volume);
+        vol.precompute_shadows(edits.params, cfg.num_workers);
+      }
+
+      // The previous image stays on screen until the tiles of the new one replace it
+      session = std::make_shared<RenderSession>(cfg, vol, edits.camera, edits.params, cfg.num_waves);
+      session->enable_preview(cfg);
+      session->provider.reset_eta();
+      pool.start(RenderSession::task(cfg, vol, session));
+
+      session_start = now;
+      pending = pending_volume = pending_light_direction = false;
+    }
+
+    vpt::Film& film = session->film;
+    vpt::TileProvider& provider = session->provider;
+
     BeginDrawing();
         ClearBackground(PURPLE);
-        
-        film_to_image(film, img);
 
-        UpdateTexture(texture, img.data().data());
+        // Only the parts of the film which changed since the last frame
+        std::vector<vpt::image_rect_t> dirty = film.take_dirty();
+        tone_map(film, img, dirty, cfg.num_workers);
+
+        for (const vpt::image_rect_t& rect : dirty) {
+          // The texture wants the pixels of the rect to be contiguous
+          staging.resize(static_cast<size_t>(rect.size.prod()) * 3);
+          for (vpt::image_index_t y = 0; y < rect.size.y(); ++y) {
+            const unsigned char* row = img.data()(rect.start.y() + y, rect.start.x()).data();
+            std::copy_n(row, rect.size.x() * 3, staging.data() + y * rect.size.x() * 3);
+          }
+
+          Rectangle rec { static_cast<float>(rect.start.x()), static_cast<float>(rect.start.y()), static_cast<float>(rect.size.x()), static_cast<float>(rect.size.y()) };
+          UpdateTextureRec(texture, rec, staging.data());
+        }
 
         DrawTexture(texture, 0, 0, WHITE);
 
@@ -120,7 +320,7 @@ int main(int argc, char* argv[]) {
 
         auto pixel = img.data()(20, 20);
         float luminance = (0.299 * pixel.x() + 0.587 * pixel.y() + 0.114 * pixel.z())/255;
-        
+
         Color color;
         if (luminance > 0.5f)
           color = BLACK;
@@ -128,19 +328,466 @@ int main(int argc, char* argv[]) {
           color = WHITE;
 
         DrawText(oss.str().c_str(), 20, 20, 24, color);
+
+        if (editable)
+          edits.draw_help();
     EndDrawing();
   }
 
   UnloadTexture(texture);
+  CloseWindow();
 
-  vptINFO("Waiting for all workers to reach the next wave before saving the image...");
-  provider.stop_at_next_wave();
-  for (auto& thr : threads) {
-    thr.join();
+  if (g_interrupt_count == 0) {
+    vptINFO("Waiting for all workers to reach the next wave before saving the image...");
+    session->provider.stop_at_next_wave();
   }
-  
-  film_to_image(film, img);
-  img.save(output_path.c_str());
 
-  return 0;
-}
\ No newline at end of file
+  // Still honour the interrupts while waiting.
+  while (not pool.wait_for(std::chrono::milliseconds(100)))
+    handle_interrupts(session->provider);
+
+  return session;
+}
+#endif
+
+/** @brief Start the workers on the jobs of the provider. Each of them reports to the completion when it's done. */
+static std::vector<std::jthread> start_workers(const vpt::Configuration& cfg, const vpt::Volume& vol, std::span<const vpt::View> views, vpt::TileProvider& provider, Completion& completion) {
+  std::vector<std::jthread> threads;
+
+  provider.reset_eta();
+  for (unsigned int i = 0; i < cfg.num_workers; ++i) {
+    threads.emplace_back([&, i]() {
+      auto start = std::chrono::high_resolution_clock::now();
+
+      vpt::RandomNumberGenerator rng(cfg.seed);
+      vpt::run(cfg.worker_parameters, vol, views, provider, i, rng);
+
+      auto end = std::chrono::high_resolution_clock::now();
+
+      vptINFO(std::this_thread::get_id() << " IS DONE!");
+      completion.worker_done(std::chrono::duration_cast<std::chrono::milliseconds>(end - start));
+    });
+  }
+
+  return threads;
+}
+
+static void log_leaf_cache_stats(const vpt::Volume& vol) {
+  if (const vpt::LeafPager* pager = vol.leaf_pager()) {
+    vpt::LeafPager::Stats stats = pager->stats();
+    double hit_rate = stats.touches > 0 ? 100.0 * static_cast<double>(stats.touches - std::min(stats.misses, stats.touches)) / static_cast<double>(stats.touches) : 100.0;
+    vptINFO("Leaf cache: " << hit_rate << "% hits over " << stats.touches << " leaf touches, " << stats.misses << " misses, " << stats.evictions << " evictions, " << stats.adopted << " untouched blocks adopted, "
+      << (stats.resident_bytes >> 20) << " of " << (stats.budget_bytes >> 20) << " MiB resident (" << (stats.mapped_bytes >> 20) << " MiB mapped)");
+  }
+}
+
+static void set_time_budget(const vpt::Configuration& cfg, vpt::TileProvider& provider) {
+  if (cfg.budget.time_limit > 0) {
+    vptINFO("Rendering at most " << cfg.num_waves << " waves within " << cfg.budget.time_limit << " s");
+    provider.set_time_budget(std::chrono::duration<float>(cfg.budget.time_limit), cfg.budget.samples_per_second);
+  }
+}
+
+/**
+  @brief Render the frames of a sequence one after the other.
+  While a frame renders, the volume of the next one is loaded and preprocessed, and the image of the previous one is saved, in the background.
+  So the workers only wait for the slowest of the two between frames - if they're not done yet.
+*/
+static int run_sequence(const vpt::Configuration& cfg, const std::filesystem::path& volume_pattern, const std::filesystem::path& output_pattern) {
+  const vpt::SequenceParameters& seq = cfg.sequence;
+
+  auto load = [&](int frame) { return std::make_unique<vpt::LoadedVolume>(cfg, vpt::frame_path(volume_pattern, frame)); };
+
+  std::future<std::unique_ptr<vpt::LoadedVolume>> next_volume = std::async(std::launch::async, load, seq.first_frame);
+  std::future<bool> pending_save;
+  bool saved_all = true;
+
+  // From now on, an interrupt still saves the frame being rendered - then stops.
+  std::signal(SIGINT, on_interrupt);
+  std::signal(SIGTERM, on_interrupt);
+
+  int frame = seq.first_frame;
+  for (; frame <= seq.last_frame and g_interrupt_count == 0; ++frame) {
+    vpt::Stopwatch sw;
+    std::unique_ptr<vpt::LoadedVolume> volume = next_volume.get();
+    if (sw.elapsed_ms() > 0)
+      vptINFO("Waited " << sw.elapsed_ms() << " ms for the volume of frame " << frame);
+
+    if (frame < seq.last_frame)
+      next_volume = std::async(std::launch::async, load, frame + 1);
+
+    vpt::Camera camera(vpt::camera_at_frame(cfg, frame), cfg.output_size);
+    vpt::TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+    set_time_budget(cfg, provider);
+
+    auto film = std::make_unique<vpt::Film>(cfg.output_size);
+
+    vpt::View view { camera, *film };
+    vpt::order_tiles(cfg, volume->vol, std::span(&view, 1), provider);
+
+    Completion completion;
+    std::vector<std::jthread> threads = start_workers(cfg, volume->vol, std::span(&view, 1), provider, completion);
+    wait_headless(cfg, provider, completion);
+    threads.clear();
+
+    vptINFO("Rendered frame " << frame << " in " << completion.max_elapsed.count() << " ms");
+    provider.log_stats();
+    log_leaf_cache_stats(volume->vol);
+
+    // At most one image is saved at a time, which bounds the films in memory to two.
+    if (pending_save.valid())
+      saved_all &= pending_save.get();
+
+    pending_save = std::async(std::launch::async, [&cfg, path = vpt::frame_path(output_pattern, frame), film = std::move(film)]() {
+      vpt::Stopwatch sw;
+      if (not vpt::save_film_image(path, *film, cfg.output_image, cfg.num_workers)) {
+        vptWARN("Failed to save the image to " << path);
+        return false;
+      }
+
+      vptINFO("Saved the image to " << path << " in " << sw.elapsed_ms() << " ms");
+      return true;
+    });
+  }
+
+  if (pending_save.valid())
+    saved_all &= pending_save.get();
+
+  if (not saved_all)
+    return EXIT_FAILURE;
+
+  if (g_interrupt_count > 0) {
+    vptINFO("Interrupted - the frames after " << frame - 1 << " were not rendered");
+    return EXIT_INTERRUPTED;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+  @brief Render all the views of the configuration with the same volume and workers.
+  Their tiles are interleaved, so the workers stay busy until the last view is done, and each view is saved once they all are.
+*/
+static int run_views(const vpt::Configuration& cfg, const std::filesystem::path& volume_path, const std::filesystem::path& output_dir) {
+  vpt::LoadedVolume volume(cfg, volume_path);
+
+  std::vector<vpt::Camera> cameras;
+  std::vector<vpt::Film> films;
+  cameras.reserve(cfg.views.size());
+  films.reserve(cfg.views.size());
+  for (const vpt::ViewParameters& view : cfg.views) {
+    cameras.emplace_back(view.camera, cfg.output_size);
+    films.emplace_back(cfg.output_size);
+  }
+
+  std::vector<vpt::View> views;
+  for (size_t i = 0; i < cfg.views.size(); ++i)
+    views.push_back({ cameras[i], films[i] });
+
+  vpt::TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers, views.size());
+  vpt::order_tiles(cfg, volume.vol, views, provider);
+  set_time_budget(cfg, provider);
+
+  // From now on, an interrupt still saves what was rendered so far.
+  std::signal(SIGINT, on_interrupt);
+  std::signal(SIGTERM, on_interrupt);
+
+  Completion completion;
+  std::vector<std::jthread> threads = start_workers(cfg, volume.vol, views, provider, completion);
+  wait_headless(cfg, provider, completion);
+  threads.clear();
+
+  vptINFO("Rendered " << views.size() << " views in " << completion.max_elapsed.count() << " ms");
+  provider.log_stats();
+  log_leaf_cache_stats(volume.vol);
+
+  bool saved_all = true;
+  for (size_t i = 0; i < cfg.views.size(); ++i) {
+    std::filesystem::path path = output_dir / cfg.views[i].output_path;
+
+    vpt::Stopwatch sw;
+    if (not vpt::save_film_image(path, films[i], cfg.output_image, cfg.num_workers)) {
+      vptWARN("Failed to save the image to " << path);
+      saved_all = false;
+      continue;
+    }
+
+    vptINFO("Saved the image to " << path << " in " << sw.elapsed_ms() << " ms");
+  }
+
+  if (not saved_all)
+    return EXIT_FAILURE;
+
+  return g_interrupt_count > 0 ? EXIT_INTERRUPTED : EXIT_SUCCESS;
+}
+
+/** The waves in [begin, end), counting from 0. */
+struct WaveRange {
+  unsigned int begin;
+  unsigned int end;
+};
+
+/** @return The wave range in the form "begin:end", or std::nullopt if it is malformed. */
+static std::optional<WaveRange> parse_wave_range(std::string_view str) {
+  size_t sep = str.find(':');
+  if (sep == std::string_view::npos)
+    return std::nullopt;
+
+  WaveRange ans;
+  std::string_view begin = str.substr(0, sep);
+  std::string_view end = str.substr(sep + 1);
+  if (std::from_chars(begin.data(), begin.data() + begin.size(), ans.begin).ec != std::errc() or
+      std::from_chars(end.data(), end.data() + end.size(), ans.end).ec != std::errc() or
+      ans.begin >= ans.end)
+    return std::nullopt;
+
+  return ans;
+}
+
+static int run_main(int argc, char* argv[]) {
+  bool headless_arg = false;
+  bool resume = false;
+  std::optional<WaveRange> wave_range;
+  std::vector<std::string_view> args;
+
+  bool serve = false;
+  vpt::ServerParameters server_params { {}, std::max(1u, std::thread::hardware_concurrency()), 4 };
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg(argv[i]);
+    if (arg == "--headless") {
+      headless_arg = true;
+    } else if (arg == "--resume") {
+      resume = true;
+    } else if (arg == "--waves" and i + 1 < argc) {
+      wave_range = parse_wave_range(argv[++i]);
+      if (not wave_range)
+        vptFATAL("Invalid wave range \"" << argv[i] << "\" - expected begin:end, with begin < end");
+    } else if (arg == "--serve") {
+      serve = true;
+    } else if ((arg == "--workers" or arg == "--cache-volumes") and i + 1 < argc) {
+      std::string_view value(argv[++i]);
+      unsigned int n;
+      if (std::from_chars(value.data(), value.data() + value.size(), n).ec != std::errc() or n == 0)
+        vptFATAL("Invalid " << arg << " \"" << value << "\" - expected a positive number");
+
+      if (arg == "--workers")
+        server_params.num_workers = n;
+      else
+        server_params.max_cached_volumes = n;
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  if (serve) {
+    if (args.size() > 1 or headless_arg or resume or wave_range)
+      vptFATAL("Usage: " << argv[0] << " --serve [--workers N] [--cache-volumes N] [socket_path]\n"
+        "Renders the jobs submitted on the Unix domain socket, or on stdin if there is none, with N workers (default: all the cores) and keeping up to N volumes loaded (default: 4).");
+
+    if (not args.empty())
+      server_params.socket_path = args[0];
+
+    vpt::init_blackbody_radiation_xyz();
+    return vpt::serve(server_params);
+  }
+
+  if (args.size() != 2) {
+    vptFATAL("Usage: " << argv[0] << " [--headless] [--resume] [--waves begin:end] config_path output_path\n"
+      "With --waves, only the waves in [begin, end) are rendered, and the output is a raw film to be merged with vpt_merge.\n"
+      "If the volume path of the configuration has a run of '#' (e.g. fire_####.nvdb), the frames of the sequence are rendered, and the output path must have one too.\n"
+      "If the configuration has views, they are all rendered, and their output paths are relative to output_path.\n"
+      "Or: " << argv[0] << " --serve [--workers N] [--cache-volumes N] [socket_path], to render the jobs submitted on the Unix domain socket (or stdin) - see the README.");
+    return 1;
+  }
+
+  vpt::init_blackbody_radiation_xyz();
+
+  std::filesystem::path config_path = std::filesystem::canonical(args[0]);
+  std::filesystem::path output_path(args[1]);
+
+  std::filesystem::path checkpoint_path = output_path;
+  checkpoint_path += ".vptckpt";
+
+  vpt::Stopwatch startup_sw;
+
+  vpt::Configuration cfg = vpt::read_configuration(config_path);
+  const uint64_t config_hash = vpt::render_hash(cfg);
+
+  if (wave_range) {
+    if (resume)
+      vptFATAL("--waves can't be combined with --resume");
+
+    // The other waves are rendered somewhere else, so we can't tell whether a tile converged - nor make a checkpoint we can resume from.
+    if (cfg.worker_parameters.adaptive_sampling.enabled) {
+      vptWARN("Adaptive sampling is not supported when rendering a wave range - disabling it.");
+      cfg.worker_parameters.adaptive_sampling.enabled = false;
+    }
+    if (cfg.checkpoint_period > 0) {
+      vptWARN("Checkpoints are not supported when rendering a wave range - disabling them.");
+      cfg.checkpoint_period = 0;
+    }
+  }
+
+  bool headless = headless_arg or cfg.headless;
+#ifndef VPT_VIEWER
+  if (not headless)
+    vptINFO("This build has no viewer - rendering headless.");
+  headless = true;
+#endif
+
+  std::filesystem::path volume_path = config_path.parent_path() / cfg.volume_path;
+
+  if (not cfg.views.empty()) {
+    if (wave_range or resume)
+      vptFATAL("--waves and --resume can't be used to render several views");
+    if (vpt::is_frame_pattern(volume_path))
+      vptFATAL("Views can't be rendered for a sequence - use its camera_keys instead");
+
+    if (cfg.checkpoint_period > 0)
+      vptWARN("Checkpoints are not supported when rendering several views - disabling them.");
+    if (not headless)
+      vptINFO("The viewer is not supported when rendering several views - rendering headless.");
+
+    vptINFO("Rendering " << cfg.views.size() << " views of " << volume_path);
+    return run_views(cfg, volume_path, output_path);
+  }
+
+  if (vpt::is_frame_pattern(volume_path)) {
+    if (wave_range or resume)
+      vptFATAL("--waves and --resume can't be used to render a sequence");
+    if (not vpt::is_frame_pattern(output_path))
+      vptFATAL("The output path must have a run of '#' for the frame number when rendering a sequence");
+
+    if (cfg.checkpoint_period > 0)
+      vptWARN("Checkpoints are not supported when rendering a sequence - disabling them.");
+    if (not headless)
+      vptINFO("The viewer is not supported when rendering a sequence - rendering headless.");
+
+    vptINFO("Rendering frames [" << cfg.sequence.first_frame << ", " << cfg.sequence.last_frame << "] of " << volume_path);
+    return run_sequence(cfg, volume_path, output_path);
+  }
+
+  auto volume = std::make_unique<vpt::LoadedVolume>(cfg, volume_path);
+  const vpt::VolumeGrids& grids = volume->grids;
+  vpt::Volume& vol = volume->vol;
+
+  vptINFO("Startup took " << startup_sw.elapsed_ms() << " ms");
+
+  if (grids.has_temperature())
+    std::cout << "TempMin: " << grids.temperature().tree().root().minimum() << ", TempMax: " << grids.temperature().tree().root().maximum() << std::endl;
+
+  // Replaced if the scene is edited in the viewer
+  auto session = std::make_shared<RenderSession>(cfg, vol, cfg.camera_parameters, cfg.worker_parameters, wave_range ? wave_range->end : cfg.num_waves);
+  const std::shared_ptr<const RenderSession> initial_session = session;
+
+  if (wave_range) {
+    // As if the waves before the range were done, so the job indices (and the samples) are the same as in a full render.
+    std::vector<vpt::TileProvider::tile_state> tiles = session->provider.tile_states();
+    std::ranges::fill(tiles, vpt::TileProvider::tile_state { wave_range->begin, false });
+    session->provider.restore(tiles);
+
+    vptINFO("Rendering waves [" << wave_range->begin << ", " << wave_range->end << ")");
+  }
+
+  set_time_budget(cfg, session->provider);
+
+  vpt::Image<unsigned char, 3> img(cfg.output_size);
+  img.data().fill(decltype(img)::value_t::Zero());
+
+  if (resume) {
+    std::optional<vpt::Checkpoint> ckpt = vpt::Checkpoint::load(checkpoint_path, session->film);
+    if (not ckpt)
+      vptFATAL("Failed to resume from " << checkpoint_path);
+    if (ckpt->seed != cfg.seed or ckpt->config_hash != config_hash)
+      vptFATAL("Checkpoint " << checkpoint_path << " belongs to a render with a different configuration");
+
+    session->provider.restore(ckpt->tiles);
+    vptINFO("Resuming from " << checkpoint_path << " at " << session->provider.progress() << "%");
+  }
+
+  // Only the render of the configuration is checkpointed, not the edited ones
+  auto save_checkpoint = [&, &film = session->film](std::span<const vpt::TileProvider::tile_state> tiles) {
+    vpt::Stopwatch sw;
+    vpt::Checkpoint ckpt { cfg.seed, config_hash, { tiles.begin(), tiles.end() } };
+    if (ckpt.save(checkpoint_path, film))
+      vptINFO("Saved checkpoint to " << checkpoint_path << " in " << sw.elapsed_ms() << " ms");
+  };
+
+  if (cfg.checkpoint_period > 0)
+    session->provider.set_checkpoint(cfg.checkpoint_period, save_checkpoint);
+
+  // From now on, an interrupt still saves what was rendered so far.
+  std::signal(SIGINT, on_interrupt);
+  std::signal(SIGTERM, on_interrupt);
+
+  std::chrono::milliseconds elapsed { 0 };
+  if (headless) {
+    Completion completion;
+    std::vector<std::jthread> threads = start_workers(cfg, vol, std::span(&session->view, 1), session->provider, completion);
+    wait_headless(cfg, session->provider, completion);
+    threads.clear();
+
+    elapsed = completion.max_elapsed;
+  } else {
+#ifdef VPT_VIEWER
+    // A partial film must be of the configuration, to be merged with the others
+    vpt::Stopwatch sw;
+    session = run_viewer(cfg, vol, session, img, not wave_range);
+    elapsed = std::chrono::milliseconds(static_cast<int64_t>(sw.elapsed_ms()));
+#endif
+  }
+
+  const bool edited = session != initial_session;
+  vpt::Film& film = session->film;
+  vpt::TileProvider& provider = session->provider;
+
+  vptINFO("Rendering complete in " << elapsed.count() << " ms");
+  provider.log_stats();
+
+  log_leaf_cache_stats(vol);
+
+  // So that an interrupted render can be resumed, or a complete one continued with more waves.
+  if (cfg.checkpoint_period > 0) {
+    if (edited)
+      vptWARN("The scene was edited - not saving a checkpoint, as the image no longer matches the configuration.");
+    else
+      save_checkpoint(provider.tile_states());
+  }
+
+  if (wave_range) {
+    // Normally all the tiles stop at the same wave, even when interrupted - but not if stopped right away.
+    // Then the film has no single wave range: merged with a render of the missing waves, the tiles ahead would count some twice.
+    std::vector<vpt::TileProvider::tile_state> tiles = provider.tile_states();
+    auto [min_tile, max_tile] = std::ranges::minmax_element(tiles, {}, &vpt::TileProvider::tile_state::wave);
+    if (min_tile->wave != max_tile->wave) {
+      vptWARN("The tiles were rendered up to different waves (from " << min_tile->wave << " to " << max_tile->wave << ") - not saving the film. Render the range again.");
+      return EXIT_FAILURE;
+    }
+
+    vpt::FilmInfo info { cfg.seed, config_hash, wave_range->begin, min_tile->wave };
+    if (not vpt::save_film(output_path, info, film))
+      return EXIT_FAILURE;
+
+    vptINFO("Saved the film of waves [" << info.wave_begin << ", " << info.wave_end << ") to " << output_path);
+    return g_interrupt_count > 0 ? EXIT_INTERRUPTED : EXIT_SUCCESS;
+  }
+
+  vpt::Stopwatch sw;
+  if (not vpt::save_film_image(output_path, film, cfg.output_image, cfg.num_workers)) {
+    vptWARN("Failed to save the image to " << output_path);
+    return EXIT_FAILURE;
+  }
+
+  vptINFO("Saved the image to " << output_path << " in " << sw.elapsed_ms() << " ms");
+  return g_interrupt_count > 0 ? EXIT_INTERRUPTED : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+  // Loading errors are exceptions, so the server can survive them - here they end the render
+  try {
+    return run_main(argc, argv);
+  } catch (const vpt::VolumeLoadError& e) {
+    vptFATAL(e.what());
+  }
+}
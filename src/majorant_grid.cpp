@@ -0,0 +1,183 @@
+#include <vpt/majorant_grid.hpp>
+#include <vpt/nanovdb_utils.hpp>
+#include <vpt/utils.hpp>
+
+namespace vpt {
+
+/** Call f(origin, dim, value) for every tile (i.e. non-child entry) of an internal node. */
+template <typename NodeT, typename F>
+static inline void for_each_tile(const NodeT& node, F&& f) {
+  for (uint32_t n = 0; n < NodeT::SIZE; ++n) {
+    if (node.childMask().isOn(n))
+      continue;
+
+    f(node.offsetToGlobalCoord(n), NodeT::ChildNodeType::DIM, node.data()->getValue(n));
+  }
+}
+
+template <typename BuildT>
+MajorantGrid::MajorantGrid(const nanovdb::NanoGrid<BuildT>& density, unsigned int cell_size)
+  : m_cell_size(cell_size)
+{
+  assert(cell_size > 0);
+
+  const auto& bbox = density.indexBBox();
+  m_origin = nanovdb_to_eigen_i(bbox.min());
+
+  // The ray is clipped against the continuous extent of the bbox, which ends one voxel past its max coordinate.
+  Eigen::Vector3i extent = nanovdb_to_eigen_i(bbox.max()) - m_origin + Eigen::Vector3i::Constant(2);
+  m_resolution = extent.unaryExpr([&](int x) { return ceildiv<int>(x, static_cast<int>(cell_size)); });
+
+  // Whatever is not covered by a node holds the background value.
+  const auto& tree = density.tree();
+  const float background = tree.root().background();
+  m_majorants.assign(static_cast<size_t>(m_resolution.prod()), background);
+  m_minorants.assign(m_majorants.size(), std::numeric_limits<float>::infinity());
+
+  // How many of the voxels read by each cell are covered by a node
+  std::vector<uint64_t> coverage(m_majorants.size(), 0);
+
+  using LeafT = typename GridTypes<BuildT>::LeafT;
+  using LowerT = typename GridTypes<BuildT>::LowerT;
+  using UpperT = typename GridTypes<BuildT>::UpperT;
+
+  auto splat_tile = [&](const nanovdb::math::Coord& origin, uint32_t dim, float value) {
+    splat({ origin, origin.offsetBy(static_cast<int>(dim) - 1) }, value, value, coverage);
+  };
+
+  // Leaves - the raw maximum is enough, as splat already accounts for the interpolator reading the neighbouring voxels.
+  const LeafT* leaf_begin = tree.getFirstLeaf();
+  for (const LeafT& leaf : std::ranges::subrange(leaf_begin, leaf_begin + tree.template nodeCount<LeafT>())) {
+    // The stored minimum only accounts for the active voxels, but the interpolator reads the inactive ones too.
+    float leaf_min = std::numeric_limits<float>::infinity();
+    for (uint32_t i = 0; i < LeafT::SIZE; ++i)
+      leaf_min = std::min(leaf_min, leaf.getValue(i));
+
+    splat({ leaf.origin(), leaf.origin().offsetBy(LeafT::DIM - 1) }, GridTypes<BuildT>::leaf_max(leaf), leaf_min, coverage);
+  }
+
+  // Tiles in the internal nodes
+  const LowerT* lower_begin = tree.getFirstLower();
+  for (const LowerT& lower : std::ranges::subrange(lower_begin, lower_begin + tree.template nodeCount<LowerT>())) {
+    for_each_tile(lower, splat_tile);
+  }
+
+  const UpperT* upper_begin = tree.getFirstUpper();
+  for (const UpperT& upper : std::ranges::subrange(upper_begin, upper_begin + tree.template nodeCount<UpperT>())) {
+    for_each_tile(upper, splat_tile);
+  }
+
+  // Tiles in the root
+  const auto& root = tree.root();
+  for (uint32_t i = 0; i < root.tileCount(); ++i) {
+    const auto* tile = root.data()->tile(i);
+    if (tile->isChild())
+      continue;
+
+    splat_tile(tile->origin(), UpperT::DIM, tile->value);
+  }
+
+  // The cells which read any voxel not covered by a node also read the background value.
+  const uint64_t S1 = cell_size + 1;
+  for (size_t i = 0; i < m_minorants.size(); ++i) {
+    if (coverage[i] < S1 * S1 * S1)
+      m_minorants[i] = std::min(m_minorants[i], background);
+
+    m_minorants[i] = std::max(0.0f, m_minorants[i]);
+  }
+}
+
+void MajorantGrid::splat(const nanovdb::math::BBox<nanovdb::math::Coord>& voxels, float max_value, float min_value, std::vector<uint64_t>& coverage) {
+  /*
+  The trilinear interpolator reads voxels floor(p) and floor(p) + 1 for a sample at p.
+  Hence, cell c (covering the points [origin + c * S, origin + (c+1) * S)) reads the voxels in [origin + c * S, origin + (c+1) * S].
+  */
+  const int S = static_cast<int>(m_cell_size);
+
+  Eigen::Vector3i lo = nanovdb_to_eigen_i(voxels.min()) - m_origin;
+  Eigen::Vector3i hi = nanovdb_to_eigen_i(voxels.max()) - m_origin;
+
+  Eigen::Vector3i c0 = lo.unaryExpr([&](int x) { return floordiv(x - 1, S); }).cwiseMax(0);
+  Eigen::Vector3i c1 = hi.unaryExpr([&](int x) { return floordiv(x, S); }).cwiseMin(m_resolution - Eigen::Vector3i::Ones());
+
+  // The number of voxels read by cell c along an axis which are in [lo, hi]
+  auto overlap = [&](int c, int v0, int v1) {
+    return static_cast<uint64_t>(std::max(0, std::min(v1, (c + 1) * S) - std::max(v0, c * S) + 1));
+  };
+
+  for (int z = c0.z(); z <= c1.z(); ++z) {
+    for (int y = c0.y(); y <= c1.y(); ++y) {
+      for (int x = c0.x(); x <= c1.x(); ++x) {
+        size_t i = linear_index({ x, y, z });
+        m_majorants[i] = std::max(m_majorants[i], max_value);
+        m_minorants[i] = std::min(m_minorants[i], min_value);
+        coverage[i] += overlap(x, lo.x(), hi.x()) * overlap(y, lo.y(), hi.y()) * overlap(z, lo.z(), hi.z());
+      }
+    }
+  }
+}
+
+Eigen::Vector3i MajorantGrid::cell_of(const Eigen::Vector3f& idx) const {
+  Eigen::Vector3f local = (idx - m_origin.cast<float>()) / static_cast<float>(m_cell_size);
+  return local.array().floor().cast<int>().matrix().cwiseMax(0).cwiseMin(m_resolution - Eigen::Vector3i::Ones());
+}
+
+MajorantGrid::DDA::DDA(const MajorantGrid& grid, const RayT& ray)
+  : m_grid(grid),
+    m_t(ray.t0()),
+    m_t_end(ray.t1()),
+    m_done(ray.t0() >= ray.t1())
+{
+  Eigen::Vector3f eye = nanovdb_to_eigen_f(ray.eye());
+  Eigen::Vector3f dir = nanovdb_to_eigen_f(ray.dir());
+
+  m_cell = grid.cell_of(eye + dir * m_t);
+
+  const float size = static_cast<float>(grid.cell_size());
+
+  for (int a = 0; a < 3; ++a) {
+    if (dir[a] > 0.0f) {
+      float boundary = static_cast<float>(grid.origin()[a]) + static_cast<float>(m_cell[a] + 1) * size;
+      m_step[a] = 1;
+      m_t_next[a] = (boundary - eye[a]) / dir[a];
+      m_t_delta[a] = size / dir[a];
+    } else if (dir[a] < 0.0f) {
+      float boundary = static_cast<float>(grid.origin()[a]) + static_cast<float>(m_cell[a]) * size;
+      m_step[a] = -1;
+      m_t_next[a] = (boundary - eye[a]) / dir[a];
+      m_t_delta[a] = -size / dir[a];
+    } else {
+      m_step[a] = 0;
+      m_t_next[a] = std::numeric_limits<float>::infinity();
+      m_t_delta[a] = std::numeric_limits<float>::infinity();
+    }
+  }
+}
+
+bool MajorantGrid::DDA::step() {
+  Eigen::Index axis;
+  float t = m_t_next.minCoeff(&axis);
+
+  if (t >= m_t_end) {
+    m_t = m_t_end;
+    m_done = true;
+    return false;
+  }
+
+  m_t = t;
+  m_cell[axis] += m_step[axis];
+  m_t_next[axis] += m_t_delta[axis];
+
+  if (not m_grid.contains(m_cell)) {
+    m_done = true;
+    return false;
+  }
+
+  return true;
+}
+
+#define VPT_INSTANTIATE(BuildT) template MajorantGrid::MajorantGrid(const nanovdb::NanoGrid<BuildT>&, unsigned int);
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
+} // namespace vpt
@@ -1,83 +1,113 @@
+#include <algorithm>
+
 #include <vpt/nanovdb_utils.hpp>
 
 #include <vpt/majorant_transmittance_sampler.hpp>
 
 namespace vpt {
 
-MajorantTransmittanceSampler::MajorantTransmittanceSampler(
-      RayMajorantIterator& it,
+template <typename BuildT>
+MajorantTransmittanceSampler<BuildT>::MajorantTransmittanceSampler(
+      RayMajorantIterator<BuildT>& it,
       RandomNumberGenerator& rng,
-      const VolumeGrids::GridT& density_grid,
-      const VolumeGrids::AccessorT& density_accessor,
-      float sigma_t)
-  : m_T_maj(1.0f),
-    m_sigma_t(sigma_t),
+      const GridT& density_grid,
+      const AccessorT& density_accessor,
+      float sigma_t,
+      const LeafPager* leaf_pager)
+  : m_sigma_t(sigma_t),
     m_rng(rng),
     m_iterator(it),
     m_density_grid(density_grid),
-    m_density_sampler(density_accessor)
+    m_density_sampler(density_accessor, leaf_pager),
+    m_batch_sigma_maj(0.0f),
+    m_batch_capacity(1),
+    m_batch_size(0),
+    m_batch_idx(0)
 {}
 
-std::optional<MediumProperties> MajorantTransmittanceSampler::next() {
-  while (true) {
-    // Unless we're already sampling from a segment, we have to get a new one
-    if (not m_segment) {
-      m_segment = m_iterator.next();
-
-      // No more segments left - quit
-      if (not m_segment)
-        return std::nullopt;
-
-      // If we're stepping through empty space, just skip to the next segment
-      if (m_segment->d_maj <= 0) {
-        m_segment.reset();
-        continue;
-      }
-    }
+template <typename BuildT>
+void MajorantTransmittanceSampler<BuildT>::fill_batch() {
+  assert(m_segment);
 
-    assert(m_segment);
+  // Compute sigma_maj for the current segment
+  float sigma_maj = m_segment->d_maj * m_sigma_t;
 
-    // Compute sigma_maj for the current segment
-    float sigma_maj = m_segment->d_maj * m_sigma_t;
+  m_batch_sigma_maj = sigma_maj;
+  m_batch_size = 0;
+  m_batch_idx = 0;
 
+  while (m_batch_size < m_batch_capacity) {
     // Sample the next point
     float dt_m = sample_exponential(m_rng.uniform<float>(), sigma_maj);
     float t = m_segment->t0 + dt_m / m_iterator.idx_to_world_scale();
 
-    // If the point lies within this segment
-    if (t < m_segment->t1) {
-      m_segment->t0 = t; // store start t of the next iteration
+    if (t >= m_segment->t1) {
+      // We're past the end of the current segment: forget it, so that we grab a new one once this batch is consumed
+      m_segment.reset();
+      break;
+    }
 
-      m_T_maj *= std::exp(-dt_m * sigma_maj);
+    m_segment->t0 = t; // store start t of the next iteration
 
-      // Retrieve the current sample point in density grid index space
-      nanovdb::Vec3f point_density_grid = m_iterator.ray()(t);
+    // Retrieve the sample point in density grid index space
+    m_batch_points[m_batch_size] = m_iterator.ray()(t);
+    ++m_batch_size;
+  }
 
-      // Compute world position
-      nanovdb::Vec3f point_world = m_density_grid.indexToWorldF(point_density_grid);
-    
-      float density = m_density_sampler(point_density_grid);
+  m_batch_capacity = std::min(2 * m_batch_capacity, BATCH_SIZE);
+
+  m_density_sampler(
+    std::span<const nanovdb::Vec3f>(m_batch_points.data(), m_batch_size),
+    std::span<float>(m_batch_density.data(), m_batch_size)
+  );
+}
+
+template <typename BuildT>
+std::optional<MediumProperties> MajorantTransmittanceSampler<BuildT>::next() {
+  while (true) {
+    // Consume the tentative collisions of the current batch first
+    if (m_batch_idx < m_batch_size) {
+      size_t i = m_batch_idx++;
+
+      float density = m_batch_density[i];
       if (density <= 0.0f)
         continue;
 
+      // Compute world position
+      nanovdb::Vec3f point_world = m_density_grid.indexToWorldF(m_batch_points[i]);
+
       return MediumProperties {
         .point = nanovdb_to_eigen_f(point_world),
-        .sigma_maj = sigma_maj,
+        .sigma_maj = m_batch_sigma_maj,
         .density = density
       };
-    } else {
-      // We're past the end of the current segment.
+    }
 
-      // Update T_maj to account for the remaining space til the end of this segment
-      float dt_m = (m_segment->t1 - m_segment->t0) * m_iterator.idx_to_world_scale();
-      m_T_maj *= std::exp(-dt_m * sigma_maj);
+    // Unless we're already sampling from a segment, we have to get a new one
+    if (not m_segment) {
+      m_segment = m_iterator.next();
 
-      // Forget the segment so that we grab a new one at the next iteration
-      m_segment.reset();
+      // No more segments left - quit
+      if (not m_segment)
+        return std::nullopt;
+
+      // If we're stepping through empty space, just skip to the next segment
+      if (m_segment->d_maj <= 0) {
+        m_segment.reset();
+        continue;
+      }
+
+      m_batch_capacity = 1;
     }
+
+    fill_batch();
   }
 
   std::unreachable();
 }
 
-} // namespace vpt
\ No newline at end of file
+#define VPT_INSTANTIATE(BuildT) template struct MajorantTransmittanceSampler<BuildT>;
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
+} // namespace vpt
@@ -0,0 +1,64 @@
+#include <string_view>
+#include <thread>
+
+#include <vpt/film.hpp>
+#include <vpt/logging.hpp>
+
+/*
+Merges the films rendered by `vpt --waves begin:end` for different wave ranges of the same render.
+The output is saved as a film if its extension is .vptfilm - e.g. to merge in stages - or as an image otherwise (see OutputImage).
+*/
+int main(int argc, char* argv[]) {
+  vpt::OutputImage output_image { 8, vpt::OutputImage::ColorSpace::LinearSRGB };
+
+  int argi = 1;
+  for (; argi < argc and argv[argi][0] == '-'; ++argi) {
+    std::string_view arg(argv[argi]);
+
+    if (arg == "--png16")
+      output_image.png_bit_depth = 16;
+    else if (arg == "--xyz")
+      output_image.float_color_space = vpt::OutputImage::ColorSpace::XYZ;
+    else
+      vptFATAL("Unknown option " << arg);
+  }
+
+  if (argc - argi < 2) {
+    vptFATAL("Usage: " << argv[0] << " [--png16] [--xyz] output_path film_path...");
+    return 1;
+  }
+
+  std::filesystem::path output_path(argv[argi]);
+
+  vpt::FilmMerger merger;
+
+  for (int i = argi + 1; i < argc; ++i) {
+    std::filesystem::path path(argv[i]);
+
+    vpt::FilmInfo info;
+    std::optional<vpt::Film> film = vpt::load_film(path, info);
+    if (not film or not merger.add(path, info, std::move(*film)))
+      return EXIT_FAILURE;
+  }
+
+  std::optional<vpt::FilmMerger::Result> merged = merger.finish();
+  if (not merged)
+    return EXIT_FAILURE;
+
+  vptINFO("Merged " << argc - argi - 1 << " films with waves [" << merged->info.wave_begin << ", " << merged->info.wave_end << ")");
+
+  if (output_path.extension() == ".vptfilm") {
+    // A film only has one wave range, so later merges can check for overlaps
+    if (not merged->contiguous)
+      vptFATAL("Can't save a film with missing waves - merge the missing ones too, or save an image");
+
+    return vpt::save_film(output_path, merged->info, merged->film) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (not vpt::save_film_image(output_path, merged->film, output_image, std::thread::hardware_concurrency())) {
+    vptWARN("Failed to save the image to " << output_path);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <vpt/parallel.hpp>
+
+namespace vpt::detail {
+
+namespace {
+
+/**
+  Threads which outlive the calls to parallel_for, so that each call doesn't pay for starting and joining its threads.
+  A call queues one task per helper it asks for. The tasks no helper took by the time the calling thread is done are withdrawn, so a call never waits for busy helpers.
+*/
+struct HelperPool {
+  ~HelperPool() {
+    {
+      std::lock_guard lock(m_mtx);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+  }
+
+  void run(unsigned int num_helpers, const std::function<void()>& work) {
+    Call call { &work };
+
+    {
+      std::lock_guard lock(m_mtx);
+
+      while (m_threads.size() < num_helpers)
+        m_threads.emplace_back([this]() { help(); });
+
+      m_tasks.insert(m_tasks.end(), num_helpers, &call);
+    }
+    m_cv.notify_all();
+
+    work();
+
+    std::unique_lock lock(m_mtx);
+    std::erase(m_tasks, &call);
+    m_done_cv.wait(lock, [&]() { return call.running == 0; });
+  }
+
+private:
+  struct Call {
+    const std::function<void()>* work;
+    unsigned int running = 0; // The helpers in work
+  };
+
+  void help() {
+    std::unique_lock lock(m_mtx);
+
+    for (;;) {
+      m_cv.wait(lock, [this]() { return m_stop or not m_tasks.empty(); });
+      if (m_stop)
+        return;
+
+      Call* call = m_tasks.front();
+      m_tasks.pop_front();
+      ++call->running;
+
+      lock.unlock();
+      (*call->work)();
+      lock.lock();
+
+      if (--call->running == 0)
+        m_done_cv.notify_all();
+    }
+  }
+
+  std::mutex m_mtx;
+  std::condition_variable m_cv;      // For the helpers, when tasks are queued
+  std::condition_variable m_done_cv; // For the callers, when their helpers are done
+  std::deque<Call*> m_tasks;
+  bool m_stop = false;
+
+  // Last, so that the helpers are joined before the rest is destroyed
+  std::vector<std::jthread> m_threads;
+};
+
+} // namespace
+
+void run_with_helpers(unsigned int num_helpers, const std::function<void()>& work) {
+  static HelperPool pool;
+  pool.run(num_helpers, work);
+}
+
+} // namespace vpt::detail
@@ -28,13 +28,15 @@ Vector3 eigen_to_raylib_i(const Eigen::Vector3i& v) {
     return eigen_to_raylib_f(v.cast<float>());
 }
 
+template <typename BuildT>
 struct Result {
-    std::vector<vpt::RayMajorantIterator::DDAStep> dda_steps;
-    std::vector<vpt::RayMajorantIterator::Segment> segments;
+    std::vector<typename vpt::RayMajorantIterator<BuildT>::DDAStep> dda_steps;
+    std::vector<typename vpt::RayMajorantIterator<BuildT>::Segment> segments;
 };
 
-Result simulate(vpt::RayMajorantIterator& iter) {
-    Result ans;
+template <typename BuildT>
+Result<BuildT> simulate(vpt::RayMajorantIterator<BuildT>& iter) {
+    Result<BuildT> ans;
 
     iter.record_steps(&ans.dda_steps);
 
@@ -45,7 +47,8 @@ Result simulate(vpt::RayMajorantIterator& iter) {
     return ans;
 }
 
-void draw(const Result& result, const vpt::VolumeGrids::AccessorT& density, const nanovdb::math::Ray<float>& ray);
+template <typename BuildT>
+void draw(const Result<BuildT>& result, const typename vpt::GridTypes<BuildT>::AccessorT& density, const nanovdb::math::Ray<float>& ray);
 
 
 int main() {
@@ -58,16 +61,19 @@ int main() {
 
     vpt::Ray vpt_ray = camera.generate_ray(cfg.worker_parameters.single_pixel.coord, Eigen::Vector2f::Zero());
 
-    auto density_acc = vol.grids().density().getAccessor();
+    vol.grids().visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>& density) {
+        auto density_acc = density.getAccessor();
 
-    auto intr = vol.intersect(vpt_ray, density_acc);
+        auto intr = vol.intersect<BuildT>(vpt_ray, density_acc);
 
-    auto result = simulate(*intr);
+        auto result = simulate(*intr);
 
-    draw(result, density_acc, intr->ray());
+        draw(result, density_acc, intr->ray());
+    });
 }
 
-void draw(const Result& result, const vpt::VolumeGrids::AccessorT& density, const nanovdb::math::Ray<float>& ray) {
+template <typename BuildT>
+void draw(const Result<BuildT>& result, const typename vpt::GridTypes<BuildT>::AccessorT& density, const nanovdb::math::Ray<float>& ray) {
     const int screenWidth = 1920;
     const int screenHeight = 1080;
 
@@ -116,7 +122,7 @@ void draw(const Result& result, const vpt::VolumeGrids::AccessorT& density, cons
             BeginMode3D(camera);
                 for (auto step : result.dda_steps) {
                     DrawSphere(eigen_to_raylib_f(step.hit), 0.1f, LIGHTGRAY);
-                    DrawCubeWires(eigen_to_raylib_f(step.voxel.cast<float>() + Eigen::Vector3f::Constant(0.5f * step.dim)), step.dim, step.dim, step.dim, LIGHTGRAY);
+                    DrawCubeWires(eigen_to_raylib_f(step.voxel.template cast<float>() + Eigen::Vector3f::Constant(0.5f * step.dim)), step.dim, step.dim, step.dim, LIGHTGRAY);
                 }
 
                 for (auto seg : result.segments) {
@@ -140,7 +146,7 @@ void draw(const Result& result, const vpt::VolumeGrids::AccessorT& density, cons
             for (auto it = result.dda_steps.cbegin(); it != result.dda_steps.cend(); ++it) {
                 const auto& step = *it;
 
-                Eigen::Vector3f center = step.voxel.cast<float>() + Eigen::Vector3f::Constant(0.5f * step.dim);
+                Eigen::Vector3f center = step.voxel.template cast<float>() + Eigen::Vector3f::Constant(0.5f * step.dim);
                 
                 size_t i = std::distance(result.dda_steps.cbegin(), it);
 
@@ -0,0 +1,29 @@
+#include <sstream>
+#include <thread>
+
+#include <vpt/render_harness.hpp>
+#include <vpt/random.hpp>
+
+namespace vpt {
+
+void render_with_threads(const Configuration& cfg, const Volume& vol, std::span<const View> views, TileProvider& provider, unsigned int num_workers) {
+  std::vector<std::jthread> threads;
+  for (unsigned int i = 0; i < num_workers; ++i)
+    threads.emplace_back([&, i]() { run(cfg.worker_parameters, vol, views, provider, i, RandomNumberGenerator(cfg.seed)); });
+}
+
+double total_samples(const Film& film) {
+  double ans = 0.0;
+  const auto& radiance = film.radiance().data();
+  for (image_index_t y = 0; y < film.size().y(); ++y)
+    for (image_index_t x = 0; x < film.size().x(); ++x)
+      ans += radiance(y, x).w();
+  return ans;
+}
+
+bool same_film(const Film& a, const Film& b) {
+  std::ostringstream os_a, os_b;
+  return a.write(os_a) and b.write(os_b) and os_a.str() == os_b.str();
+}
+
+} // namespace vpt
@@ -0,0 +1,448 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <glaze/glaze.hpp>
+
+#include <vpt/server.hpp>
+#include <vpt/loaded_volume.hpp>
+#include <vpt/worker_pool.hpp>
+#include <vpt/tile_order.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/logging.hpp>
+
+namespace vpt {
+
+namespace {
+
+std::atomic<bool> g_stop(false);
+
+void on_stop(int) {
+  g_stop = true;
+}
+
+/** The reply to a job. Times are in ms. */
+struct JobReply {
+  std::string id;
+  bool ok;
+  std::string error;
+  bool cache_hit;
+  float queue_ms;  // Waiting for the jobs received before it
+  float load_ms;   // Loading and preprocessing the volume, if it was not cached
+  float render_ms;
+  float save_ms;
+  float total_ms;  // From when the job was received to the reply
+  uint64_t film_bytes; // The size of the raw film following the reply, if the job has no output path
+};
+
+/** @brief Write all the bytes, unless the file descriptor fails. @return false if it does. */
+bool write_all(int fd, std::string_view data) {
+  while (not data.empty()) {
+    ssize_t n = ::write(fd, data.data(), data.size());
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    data.remove_prefix(static_cast<size_t>(n));
+  }
+
+  return true;
+}
+
+/** @brief Read the lines from the file descriptor until it's closed or the server stops, and call fn with each of them (except the blank ones). */
+void read_lines(int fd, const std::function<void(std::string&&)>& fn) {
+  auto is_blank = [](const std::string& line) { return line.find_first_not_of(" \t\r") == std::string::npos; };
+
+  std::string buf;
+  char chunk[4096];
+
+  while (not g_stop) {
+    // Wake up every now and then to notice when the server stops
+    pollfd pfd { fd, POLLIN, 0 };
+    int ready = ::poll(&pfd, 1, 100);
+    if (ready < 0 and errno != EINTR)
+      break;
+    if (ready <= 0)
+      continue;
+
+    ssize_t n = ::read(fd, chunk, sizeof(chunk));
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    buf.append(chunk, static_cast<size_t>(n));
+
+    size_t end;
+    while ((end = buf.find('\n')) != std::string::npos) {
+      std::string line = buf.substr(0, end);
+      buf.erase(0, end + 1);
+
+      if (not is_blank(line))
+        fn(std::move(line));
+    }
+  }
+
+  // The last line may not be terminated
+  if (not g_stop and not is_blank(buf))
+    fn(std::move(buf));
+}
+
+/** Where the replies to the jobs of a client go. The pending jobs share it, so it outlives the reader of the client. */
+struct Connection {
+  int fd;
+  bool owned; // Whether to close the file descriptor when done, i.e. it's not stdout
+
+  std::mutex mtx;
+
+  Connection(int fd, bool owned) : fd(fd), owned(owned) {}
+
+  ~Connection() {
+    if (owned)
+      ::close(fd);
+  }
+
+  void reply(const JobReply& r, const std::string& film) {
+    std::string buf;
+    if (glz::write_json(r, buf)) {
+      vptWARN("Failed to serialize the reply to job " << r.id);
+      return;
+    }
+    buf += '\n';
+
+    std::lock_guard lock(mtx);
+    if (not write_all(fd, buf) or not write_all(fd, film))
+      vptWARN("Failed to send the reply to job " << r.id << " - the client is gone");
+  }
+};
+
+struct PendingJob {
+  RenderJob job;
+  std::shared_ptr<Connection> connection;
+  Stopwatch received;
+};
+
+/** The jobs waiting to be rendered, in the order they were received. */
+struct JobQueue {
+  void push(PendingJob&& job) {
+    {
+      std::lock_guard lock(m_mtx);
+      m_jobs.push_back(std::move(job));
+    }
+    m_cv.notify_one();
+  }
+
+  /** @return The next job, or std::nullopt if there is none within the timeout. */
+  std::optional<PendingJob> pop(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(m_mtx);
+    if (not m_cv.wait_for(lock, timeout, [&]() { return not m_jobs.empty(); }))
+      return std::nullopt;
+
+    PendingJob ans = std::move(m_jobs.front());
+    m_jobs.pop_front();
+    return ans;
+  }
+
+  /** @brief No more jobs will be pushed. */
+  void close() {
+    std::lock_guard lock(m_mtx);
+    m_closed = true;
+  }
+
+  /** @return Whether the queue is closed, and all the jobs were popped. */
+  bool done() {
+    std::lock_guard lock(m_mtx);
+    return m_closed and m_jobs.empty();
+  }
+
+private:
+  std::mutex m_mtx;
+  std::condition_variable m_cv;
+  std::deque<PendingJob> m_jobs;
+  bool m_closed = false;
+};
+
+/** The loaded volumes, by path and volume_hash(). Only used by the thread which renders the jobs. */
+struct VolumeCache {
+  explicit VolumeCache(size_t capacity) : m_capacity(std::max<size_t>(1, capacity)) {}
+
+  /** @return The volume for the configuration, loaded now if it was not cached (hit says which). @throws If it can't be loaded - then nothing is cached. */
+  std::shared_ptr<const LoadedVolume> get(const Configuration& cfg, const std::filesystem::path& path, bool& hit) {
+    std::ostringstream key;
+    key << path.string() << '#' << std::hex << volume_hash(cfg);
+
+    auto it = std::ranges::find(m_entries, key.str(), &Entry::key);
+    hit = it != m_entries.end();
+
+    if (hit) {
+      ++m_hits;
+      m_entries.splice(m_entries.begin(), m_entries, it);
+      return m_entries.front().volume;
+    }
+
+    ++m_misses;
+
+    // Drop the least recently used ones first, so that they are not in memory along with the new one
+    while (m_entries.size() >= m_capacity) {
+      vptINFO("Dropping " << m_entries.back().key << " from the volume cache");
+      m_entries.pop_back();
+    }
+
+    m_entries.push_front({ key.str(), std::make_shared<const LoadedVolume>(cfg, path) });
+    return m_entries.front().volume;
+  }
+
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+  size_t size() const { return m_entries.size(); }
+
+private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const LoadedVolume> volume;
+  };
+
+  size_t m_capacity;
+  std::list<Entry> m_entries; // The most recently used first
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+};
+
+/**
+  @brief Render a job, and save its result.
+  @param film_bytes Set to the raw film, if the job has no output path.
+*/
+JobReply execute(const PendingJob& pending, const ServerParameters& params, VolumeCache& cache, WorkerPool& pool, std::string& film_bytes) {
+  const RenderJob& job = pending.job;
+
+  JobReply reply {};
+  reply.id = job.id;
+  reply.queue_ms = pending.received.elapsed_ms();
+
+  auto fail = [&](std::string error) {
+    reply.ok = false;
+    reply.error = std::move(error);
+    return reply;
+  };
+
+  Configuration cfg = job.scene;
+  cfg.num_workers = params.num_workers;
+
+  if (is_frame_pattern(cfg.volume_path))
+    return fail("Sequences can't be rendered by the server");
+  if (not cfg.views.empty())
+    return fail("Several views can't be rendered by the server - submit a job for each of them");
+  if (std::error_code ec; not std::filesystem::is_regular_file(cfg.volume_path, ec))
+    return fail("No such volume: " + cfg.volume_path.string());
+
+  Stopwatch sw;
+  // A bad volume only fails its own job
+  std::shared_ptr<const LoadedVolume> volume;
+  try {
+    volume = cache.get(cfg, std::filesystem::weakly_canonical(cfg.volume_path), reply.cache_hit);
+  } catch (const std::exception& e) {
+    return fail("Failed to load " + cfg.volume_path.string() + ": " + e.what());
+  }
+  reply.load_ms = reply.cache_hit ? 0.0f : sw.elapsed_ms();
+
+  Camera camera(cfg.camera_parameters, cfg.output_size);
+  Film film(cfg.output_size);
+  TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+  if (cfg.budget.time_limit > 0)
+    provider.set_time_budget(std::chrono::duration<float>(cfg.budget.time_limit), cfg.budget.samples_per_second);
+
+  View view { camera, film };
+  order_tiles(cfg, volume->vol, std::span(&view, 1), provider);
+
+  sw.restart();
+  provider.reset_eta();
+  pool.start({ &cfg.worker_parameters, &volume->vol, std::span(&view, 1), &provider, cfg.seed, nullptr });
+
+  // If the server stops meanwhile, the render is stopped right away
+  while (not pool.wait_for(std::chrono::milliseconds(100))) {
+    if (g_stop)
+      provider.stop_now();
+  }
+  reply.render_ms = sw.elapsed_ms();
+
+  if (g_stop)
+    return fail("The server was stopped while rendering");
+
+  sw.restart();
+  if (job.output_path.empty() or job.output_path.extension() == ".vptfilm") {
+    std::vector<TileProvider::tile_state> tiles = provider.tile_states();
+    auto min_tile = std::ranges::min_element(tiles, {}, &TileProvider::tile_state::wave);
+    FilmInfo info { cfg.seed, render_hash(cfg), 0, min_tile->wave };
+
+    if (job.output_path.empty()) {
+      std::ostringstream os;
+      write_film(os, info, film);
+      film_bytes = std::move(os).str();
+      reply.film_bytes = film_bytes.size();
+    } else if (not save_film(job.output_path, info, film)) {
+      return fail("Failed to save the film to " + job.output_path.string());
+    }
+  } else if (not save_film_image(job.output_path, film, cfg.output_image, cfg.num_workers)) {
+    return fail("Failed to save the image to " + job.output_path.string());
+  }
+  reply.save_ms = sw.elapsed_ms();
+
+  reply.ok = true;
+  return reply;
+}
+
+/** @brief Parse a job and queue it, or reply right away if it is malformed. */
+void submit(JobQueue& queue, std::string&& line, const std::shared_ptr<Connection>& connection) {
+  PendingJob pending { {}, connection, Stopwatch() };
+
+  std::string error;
+  if (not parse_render_job(line, pending.job, error)) {
+    vptWARN("Rejected a malformed job: " << error);
+    connection->reply(JobReply { .id = pending.job.id, .ok = false, .error = error }, {});
+    return;
+  }
+
+  queue.push(std::move(pending));
+}
+
+/** @brief Accept the clients on the socket and read their jobs, until the server stops. */
+void accept_clients(int listen_fd, JobQueue& queue) {
+  struct Client {
+    std::shared_ptr<std::atomic<bool>> done;
+    std::jthread reader;
+  };
+  std::vector<Client> clients;
+
+  while (not g_stop) {
+    pollfd pfd { listen_fd, POLLIN, 0 };
+    if (::poll(&pfd, 1, 100) <= 0)
+      continue;
+
+    int fd = ::accept(listen_fd, nullptr, nullptr);
+    if (fd < 0)
+      continue;
+
+    // The readers of the clients which left are joined right away
+    std::erase_if(clients, [](const Client& c) { return c.done->load(); });
+
+    auto connection = std::make_shared<Connection>(fd, true);
+    auto done = std::make_shared<std::atomic<bool>>(false);
+    clients.push_back({ done, std::jthread([&queue, connection, done]() {
+      read_lines(connection->fd, [&](std::string&& line) { submit(queue, std::move(line), connection); });
+      *done = true;
+    }) });
+  }
+}
+
+/** @return A Unix domain socket listening on the path. */
+int listen_on(const std::filesystem::path& path) {
+  sockaddr_un addr {};
+  addr.sun_family = AF_UNIX;
+
+  std::string str = path.string();
+  if (str.size() >= sizeof(addr.sun_path))
+    vptFATAL("The socket path " << path << " is too long");
+  std::memcpy(addr.sun_path, str.c_str(), str.size() + 1);
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    vptFATAL("Failed to create the socket: " << std::strerror(errno));
+
+  // A previous server may have left it behind
+  ::unlink(str.c_str());
+
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 or ::listen(fd, 16) != 0)
+    vptFATAL("Failed to listen on " << path << ": " << std::strerror(errno));
+
+  return fd;
+}
+
+} // namespace
+
+int serve(const ServerParameters& params) {
+  std::signal(SIGINT, on_stop);
+  std::signal(SIGTERM, on_stop);
+
+  // A client which leaves early must not take the server down
+  std::signal(SIGPIPE, SIG_IGN);
+
+  JobQueue queue;
+  VolumeCache cache(params.max_cached_volumes);
+  WorkerPool pool(params.num_workers);
+
+  int listen_fd = -1;
+  std::jthread input;
+  if (params.socket_path.empty()) {
+    vptINFO("Serving the jobs from stdin with " << params.num_workers << " workers");
+    input = std::jthread([&]() {
+      auto connection = std::make_shared<Connection>(STDOUT_FILENO, false);
+      read_lines(STDIN_FILENO, [&](std::string&& line) { submit(queue, std::move(line), connection); });
+      queue.close();
+    });
+  } else {
+    listen_fd = listen_on(params.socket_path);
+    vptINFO("Serving the jobs from " << params.socket_path << " with " << params.num_workers << " workers");
+    input = std::jthread([&]() { accept_clients(listen_fd, queue); });
+  }
+
+  size_t succeeded = 0, failed = 0;
+  float total_ms = 0.0f;
+
+  while (not g_stop and not queue.done()) {
+    std::optional<PendingJob> pending = queue.pop(std::chrono::milliseconds(100));
+    if (not pending)
+      continue;
+
+    std::string film_bytes;
+    JobReply reply = execute(*pending, params, cache, pool, film_bytes);
+    reply.total_ms = pending->received.elapsed_ms();
+
+    if (reply.ok) {
+      ++succeeded;
+      vptINFO("Job " << reply.id << " done in " << reply.total_ms << " ms (queued " << reply.queue_ms << ", loading " << reply.load_ms << ", rendering " << reply.render_ms
+        << ", saving " << reply.save_ms << ") - volume cache: " << cache.hits() << " hits, " << cache.misses() << " misses, " << cache.size() << " volumes");
+    } else {
+      ++failed;
+      vptWARN("Job " << reply.id << " failed: " << reply.error);
+    }
+    total_ms += reply.total_ms;
+
+    pending->connection->reply(reply, film_bytes);
+  }
+
+  // Stop reading, so that no more jobs come in
+  g_stop = true;
+  input = {};
+
+  // The clients waiting for the jobs which were not rendered get a reply too
+  while (std::optional<PendingJob> pending = queue.pop(std::chrono::milliseconds(0)))
+    pending->connection->reply(JobReply { .id = pending->job.id, .ok = false, .error = "The server was stopped" }, {});
+
+  if (listen_fd >= 0) {
+    ::close(listen_fd);
+    ::unlink(params.socket_path.c_str());
+  }
+
+  size_t jobs = succeeded + failed;
+  vptINFO("Served " << jobs << " jobs (" << failed << " failed), " << (jobs > 0 ? total_ms / static_cast<float>(jobs) : 0.0f) << " ms on average - volume cache: "
+    << cache.hits() << " hits, " << cache.misses() << " misses");
+
+  return EXIT_SUCCESS;
+}
+
+} // namespace vpt
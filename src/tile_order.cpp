@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numeric>
+
+#include <vpt/tile_order.hpp>
+#include <vpt/logging.hpp>
+#include <vpt/utils.hpp>
+
+namespace vpt {
+
+using tile_index_t = TileProvider::tile_index_t;
+
+/** @return The distance along the Hilbert curve over a side x side square (side being a power of two) of the point (x, y). */
+static uint64_t hilbert_distance(uint32_t side, uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+
+  for (uint32_t s = side / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+
+    // Rotate the quadrant, so that the curve within it starts and ends where it should
+    if (ry == 0) {
+      if (rx == 1) {
+        x = side - 1 - x;
+        y = side - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+
+  return d;
+}
+
+/** @return The tiles of the grid, sorted by the key of their coordinates. */
+template <typename F>
+static std::vector<tile_index_t> sorted_tiles(const TileProvider::tile_size_t& num_tiles, F&& key) {
+  std::vector<tile_index_t> order(num_tiles.prod());
+  std::iota(order.begin(), order.end(), 0);
+
+  std::ranges::stable_sort(order, {}, [&](tile_index_t t) { return key(t % num_tiles.x(), t / num_tiles.x()); });
+  return order;
+}
+
+std::vector<tile_index_t> hilbert_tile_order(const TileProvider::tile_size_t& num_tiles) {
+  uint32_t side = std::bit_ceil(std::max(num_tiles.x(), num_tiles.y()));
+  return sorted_tiles(num_tiles, [&](uint32_t x, uint32_t y) { return hilbert_distance(side, x, y); });
+}
+
+std::vector<tile_index_t> spiral_tile_order(const TileProvider::tile_size_t& num_tiles) {
+  Eigen::Vector2f center = (num_tiles.cast<float>() - Eigen::Vector2f::Ones()) / 2.0f;
+
+  return sorted_tiles(num_tiles, [&](uint32_t x, uint32_t y) {
+    Eigen::Vector2f d = Eigen::Vector2f(static_cast<float>(x), static_cast<float>(y)) - center;
+
+    // The ring first, then the angle around the centre within it
+    float ring = std::ceil(d.cwiseAbs().maxCoeff() - 0.5f);
+    return std::pair(ring, std::atan2(d.y(), d.x()));
+  });
+}
+
+template <typename BuildT>
+static float majorant_optical_depth(const Volume& vol, const Ray& ray, const typename GridTypes<BuildT>::AccessorT& density_acc) {
+  auto iter = vol.intersect<BuildT>(ray, density_acc);
+  if (not iter)
+    return 0.0f;
+
+  float tau = 0.0f;
+  while (auto segment = iter->next())
+    tau += segment->d_maj * (segment->t1 - segment->t0) * iter->idx_to_world_scale();
+
+  return tau * (vol.params().sigma_a + vol.params().sigma_s);
+}
+
+std::vector<float> estimate_tile_costs(const Volume& vol, std::span<const View> views, const TileProvider& tp) {
+  std::vector<float> costs(tp.num_tiles().prod(), 0.0f);
+
+  vol.grids().visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>& density) {
+    auto density_acc = density.getAccessor();
+
+    for (const View& view : views) {
+      for (tile_index_t t = 0; t < costs.size(); ++t) {
+        image_rect_t rect = tp.compute_tile_rect(t);
+        Ray ray = view.camera.generate_ray(rect.start + rect.size / 2, Eigen::Vector2f::Zero());
+        costs[t] += majorant_optical_depth<BuildT>(vol, ray, density_acc);
+      }
+    }
+  });
+
+  return costs;
+}
+
+void order_tiles(const Configuration& cfg, const Volume& vol, std::span<const View> views, TileProvider& tp) {
+  switch (cfg.tile_order) {
+    case Configuration::TileOrder::Raster:
+      return;
+    case Configuration::TileOrder::Hilbert:
+      tp.set_order(hilbert_tile_order(tp.num_tiles()));
+      return;
+    case Configuration::TileOrder::Spiral:
+      tp.set_order(spiral_tile_order(tp.num_tiles()));
+      return;
+    case Configuration::TileOrder::Cost: {
+      Stopwatch sw;
+      std::vector<float> costs = estimate_tile_costs(vol, views, tp);
+
+      // The most expensive first, so they don't end up holding the last wave back either
+      std::vector<tile_index_t> order(costs.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::ranges::stable_sort(order, std::ranges::greater {}, [&](tile_index_t t) { return costs[t]; });
+
+      tp.set_order(order);
+      vptINFO("Estimated the cost of the tiles in " << sw.elapsed_ms() << " ms");
+      return;
+    }
+  }
+
+  std::unreachable();
+}
+
+} // namespace vpt
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <limits>
 #include <mutex>
+#include <utility>
 
 #include <vpt/tile_provider.hpp>
 #include <vpt/logging.hpp>
@@ -11,8 +14,12 @@ static inline T ceildiv(T x, T y) {
   return x / y + (x % y != 0);
 }
 
-TileProvider::TileProvider(const image_size_t& img_size, wave_index_t waves, const image_size_t& tile_size)
+TileProvider::TileProvider(const image_size_t& img_size, wave_index_t waves, const image_size_t& tile_size, worker_index_t num_workers, size_t num_views)
   : m_wave_start_monitor(waves),
+    m_time_limit(0),
+    m_expected_jobs_per_second(0),
+    m_job_ns(0),
+    m_num_held(0),
     m_force_stop(false),
     m_img_size(img_size),
     m_tile_size(tile_size),
@@ -20,82 +27,443 @@ TileProvider::TileProvider(const image_size_t& img_size, wave_index_t waves, con
       ceildiv(img_size.x(), tile_size.x()),
       ceildiv(img_size.y(), tile_size.y())
     ),
-    m_job_idx(0),
-    m_tile_wave(m_num_tiles.x() * m_num_tiles.y())
-{}
-
-TileProvider::token TileProvider::next() {
-  size_t job_idx = m_job_idx.fetch_add(1, std::memory_order_relaxed);
-
-  wave_index_t wave_idx = 1 + (job_idx / m_tile_wave.size());
-  tile_index_t tile_idx = job_idx % m_tile_wave.size();
-
-  if (m_force_stop or not wave_should_be_processed(wave_idx))
-    return token::invalid(*this);
-
-  /* For the possible but improbable scenario where a thread gets stuck on a tile in an old wave...
-      Having a dense representation of the tiles really reeks of "you're doing something wrong".
-      But hey, it's fast.
-  */
-  while (not m_force_stop) {
-    wave_index_t tile_wave = m_tile_wave[tile_idx].load(std::memory_order_relaxed);
-
-    /*
-    Threads will set tile_wave to wave_idx AFTER they finish running.
-    Because only one thread gets to run a specific tile/wave pair:
-    - if tile_wave == wave_idx - 1, then this tile has been fully processed in the previous wave.
-    - if tile_wave < wave_idx - 1, then this tile is still being processed in one of the previous waves.
-    */
-
-    // If the tile wave index is the one before ours, then we can take it - it's not busy.
-    if (tile_wave == wave_idx - 1)
+    m_num_views(std::max<size_t>(1, num_views)),
+    m_queues(std::max(1u, num_workers)),
+    m_outstanding_jobs(0),
+    m_completed_jobs(0),
+    m_skipped_jobs(0),
+    m_generation(0),
+    m_num_waiting(0),
+    m_restored_jobs(0),
+    m_tile_wave(m_num_tiles.x() * m_num_tiles.y() * m_num_views),
+    m_tile_converged(m_tile_wave.size()),
+    m_checkpoint_period(0)
+{
+  if (waves == 0)
+    return;
+
+  std::vector<job> jobs(m_tile_wave.size());
+  for (size_t t = 0; t < jobs.size(); ++t)
+    jobs[t] = { static_cast<tile_index_t>(t), 1 };
+
+  distribute(jobs);
+}
+
+void TileProvider::distribute(std::vector<job> jobs) {
+  m_outstanding_jobs = jobs.size();
+
+  if (m_tile_rank.empty()) {
+    for (size_t w = 0; w < m_queues.size(); ++w) {
+      size_t begin = w * jobs.size() / m_queues.size();
+      size_t end = (w + 1) * jobs.size() / m_queues.size();
+
+      m_queues[w].jobs.assign(jobs.begin() + begin, jobs.begin() + end);
+    }
+    return;
+  }
+
+  // The views of a tile stay together, as they are interleaved
+  std::ranges::stable_sort(jobs, {}, [&](const job& j) { return m_tile_rank[view_tile(j.tile_idx)]; });
+
+  for (worker_queue& queue : m_queues)
+    queue.jobs.clear();
+  for (size_t i = 0; i < jobs.size(); ++i)
+    m_queues[i % m_queues.size()].jobs.push_back(jobs[i]);
+}
+
+void TileProvider::set_order(std::span<const tile_index_t> order) {
+  assert(order.size() == m_tile_wave.size() / m_num_views);
+
+  m_tile_rank.resize(order.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    m_tile_rank[order[i]] = static_cast<tile_index_t>(i);
+
+  // The jobs queued so far, in tile order
+  std::vector<job> jobs;
+  for (worker_queue& queue : m_queues)
+    jobs.insert(jobs.end(), queue.jobs.begin(), queue.jobs.end());
+  std::ranges::sort(jobs, {}, &job::tile_idx);
+
+  distribute(std::move(jobs));
+}
+
+void TileProvider::restore(std::span<const tile_state> tiles) {
+  assert(tiles.size() == m_tile_wave.size());
+
+  const wave_index_t requested_waves = m_wave_start_monitor.requested_waves;
+
+  std::vector<job> jobs;
+  m_restored_jobs = 0;
+  m_wave_start_monitor.max_wave_idx = 0;
+
+  for (size_t t = 0; t < tiles.size(); ++t) {
+    m_tile_wave[t] = tiles[t].wave;
+    m_tile_converged[t] = tiles[t].converged;
+
+    // A converged tile counts as done, as its missing waves are skipped
+    m_restored_jobs += tiles[t].converged ? requested_waves : std::min(tiles[t].wave, requested_waves);
+    m_wave_start_monitor.max_wave_idx = std::max(m_wave_start_monitor.max_wave_idx, tiles[t].wave);
+
+    if (not tiles[t].converged and tiles[t].wave < requested_waves)
+      jobs.push_back({ static_cast<tile_index_t>(t), tiles[t].wave + 1 });
+  }
+
+  distribute(jobs);
+}
+
+std::vector<TileProvider::tile_state> TileProvider::tile_states() const {
+  std::vector<tile_state> ans(m_tile_wave.size());
+  for (size_t t = 0; t < ans.size(); ++t)
+    ans[t] = { m_tile_wave[t].load(std::memory_order_relaxed), m_tile_converged[t].load(std::memory_order_relaxed) };
+  return ans;
+}
+
+void TileProvider::set_preview(unsigned int levels) {
+  for (worker_queue& queue : m_queues) {
+    for (job& j : queue.jobs) {
+      if (j.wave_idx == 1)
+        j.preview_level = levels;
+    }
+  }
+}
+
+void TileProvider::set_checkpoint(wave_index_t period, checkpoint_fn fn) {
+  m_checkpoint_period = period;
+  m_checkpoint_fn = std::move(fn);
+}
+
+void TileProvider::park(worker_index_t worker_idx, const job& j) {
+  {
+    std::lock_guard lock(m_barrier_mtx);
+    m_parked.push_back({ worker_idx, j });
+  }
+
+  try_checkpoint();
+}
+
+void TileProvider::try_checkpoint() {
+  std::unique_lock lock(m_barrier_mtx);
+
+  // Parked jobs are still outstanding. If they are all that's left, no job is running and every tile is either done with the wave or converged.
+  if (m_parked.empty() or m_parked.size() != m_outstanding_jobs.load(std::memory_order_acquire))
+    return;
+
+  if (not m_force_stop.load(std::memory_order_acquire)) {
+    vptINFO("Writing a checkpoint at wave " << m_parked.front().j.wave_idx - 1);
+    m_checkpoint_fn(tile_states());
+  }
+
+  for (const parked_job& p : m_parked) {
+    std::lock_guard queue_lock(m_queues[p.worker_idx].mtx);
+    m_queues[p.worker_idx].jobs.push_back(p.j);
+  }
+  m_parked.clear();
+
+  m_generation.fetch_add(1, std::memory_order_release);
+  m_generation.notify_all();
+}
+
+std::optional<TileProvider::job> TileProvider::pop(worker_queue& queue) {
+  std::lock_guard lock(queue.mtx);
+
+  if (queue.jobs.empty())
+    return std::nullopt;
+
+  job j = queue.jobs.front();
+  queue.jobs.pop_front();
+  return j;
+}
+
+void TileProvider::push(worker_queue& queue, const job& j) {
+  {
+    std::lock_guard lock(queue.mtx);
+    queue.jobs.push_back(j);
+  }
+
+  // Bumped whether or not a worker waits, for those about to (see next). The waiter count is loaded after it, so either we see them or they see the bump.
+  m_generation.fetch_add(1, std::memory_order_seq_cst);
+
+  // A single job, so a single worker is enough - and there's no one to wake up when they are all busy, which is most of the time
+  if (m_num_waiting.load(std::memory_order_seq_cst) > 0)
+    m_generation.notify_one();
+}
+
+void TileProvider::retire_job() {
+  if (m_outstanding_jobs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    // That was the last one - wake up the idle workers so they can quit.
+    m_generation.fetch_add(1, std::memory_order_release);
+    m_generation.notify_all();
+  } else if (m_checkpoint_period > 0) {
+    // It may have been the last one the checkpoint was waiting for.
+    try_checkpoint();
+  }
+}
+
+void TileProvider::complete(worker_index_t worker_idx, tile_index_t tile_idx, wave_index_t wave_idx, unsigned int preview_level, bool converged, std::chrono::steady_clock::duration job_time) {
+  worker_queue& queue = m_queues[worker_idx];
+  {
+    std::lock_guard lock(queue.mtx);
+    ++queue.processed;
+  }
+
+  // A preview level is not a wave of the tile, which goes on with the next level - or with the wave
+  if (preview_level > 0) {
+    if (m_force_stop.load(std::memory_order_acquire))
+      retire_job();
+    else
+      push(queue, { tile_idx, wave_idx, preview_level - 1 });
+    return;
+  }
+
+  m_tile_wave[tile_idx].store(wave_idx, std::memory_order_relaxed);
+  m_job_ns.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(job_time).count()), std::memory_order_relaxed);
+  m_completed_jobs.fetch_add(1, std::memory_order_relaxed);
+
+  if (converged) {
+    m_tile_converged[tile_idx].store(true, std::memory_order_relaxed);
+
+    wave_index_t requested_waves = m_wave_start_monitor.requested_waves;
+    if (wave_idx < requested_waves)
+      m_skipped_jobs.fetch_add(requested_waves - wave_idx, std::memory_order_relaxed);
+
+    retire_job();
+    return;
+  }
+
+  // The next wave of this tile can start now. The worker which did this one gets it, as it has the tile in cache.
+  // It is checked again against the requested waves when popped, as it may be lowered in the meantime.
+  if (not m_force_stop.load(std::memory_order_acquire) and wave_idx < m_wave_start_monitor.requested_waves) {
+    if (m_checkpoint_period > 0 and wave_idx % m_checkpoint_period == 0)
+      park(worker_idx, { tile_idx, wave_idx + 1 });
+    else
+      push(queue, { tile_idx, wave_idx + 1 });
+  } else {
+    retire_job();
+  }
+}
+
+TileProvider::token TileProvider::next(worker_index_t worker_idx, bool wait) {
+  assert(worker_idx < m_queues.size());
+
+  while (true) {
+    // Loaded before the stop flag: stop_now() sets it before bumping the generation, so either we see it, or the wait below returns right away.
+    uint32_t generation = m_generation.load(std::memory_order_acquire);
+    if (m_force_stop.load(std::memory_order_acquire))
       break;
 
-    assert(tile_wave < wave_idx - 1);
-    
-    vptWARN("TILE PROVIDER: Need to process wave " << wave_idx << " for tile " << tile_idx << ", but it's stuck in wave " << tile_wave << "...");
+    // Our own jobs first, then steal the oldest job of the other workers - this keeps the waves roughly in order.
+    std::optional<job> j = pop(m_queues[worker_idx]);
+    for (size_t i = 1; not j and i < m_queues.size(); ++i) {
+      worker_queue& victim = m_queues[(worker_idx + i) % m_queues.size()];
+      j = pop(victim);
+
+      if (j) {
+        std::lock_guard lock(m_queues[worker_idx].mtx);
+        ++m_queues[worker_idx].stolen;
+      }
+    }
+
+    if (not j) {
+      // Nothing queued and nothing running - we're done.
+      if (m_outstanding_jobs.load(std::memory_order_acquire) == 0)
+        break;
+
+      // Some jobs are still running, and they will queue their successors. Wait for them.
+      if (not wait)
+        break;
+
+      // Counted before the wait checks the generation again, for push() to notify us (see there)
+      m_num_waiting.fetch_add(1, std::memory_order_seq_cst);
+      m_generation.wait(generation, std::memory_order_seq_cst);
+      m_num_waiting.fetch_sub(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    wave_verdict verdict = judge_wave(worker_idx, *j);
+    if (verdict == wave_verdict::Drop) {
+      // This tile is done.
+      retire_job();
+      continue;
+    }
+
+    // Held back until the wave is decided, and queued again if it starts
+    if (verdict == wave_verdict::Hold)
+      continue;
 
-    // The tile is still being processed in an old wave. We need to wait for our turn.
-    m_tile_wave[tile_idx].wait(tile_wave, std::memory_order_relaxed);
+    // Only one job for each tile is ever queued or running, and its predecessor is done by now.
+    assert(m_tile_wave[j->tile_idx].load(std::memory_order_relaxed) == j->wave_idx - 1);
+
+    // Same job index as if the jobs were handed out in order, wave by wave - so that the RNG streams don't depend on the scheduling.
+    // Counted within the view, so a view renders the same as it would on its own.
+    // The preview levels count down from the last index, so the waves get the same streams with or without them.
+    size_t view_tiles = m_tile_wave.size() / m_num_views;
+    size_t jid = static_cast<size_t>(j->wave_idx - 1) * view_tiles + view_tile(j->tile_idx);
+    if (j->preview_level > 0)
+      jid = std::numeric_limits<size_t>::max() - (static_cast<size_t>(j->preview_level - 1) * view_tiles + view_tile(j->tile_idx));
+
+    return token(*this, worker_idx, j->tile_idx, j->wave_idx, j->preview_level, jid);
   }
 
-  if (m_force_stop) {
-    return token::invalid(*this);
+  return token::invalid(*this);
+}
+
+void TileProvider::log_stats() const {
+  size_t processed = 0, stolen = 0;
+
+  for (size_t w = 0; w < m_queues.size(); ++w) {
+    vptINFO("TILE PROVIDER: Worker " << w << " processed " << m_queues[w].processed << " jobs (" << m_queues[w].stolen << " stolen)");
+    processed += m_queues[w].processed;
+    stolen += m_queues[w].stolen;
   }
 
-  return token(*this, tile_idx, wave_idx, job_idx);
+  vptINFO("TILE PROVIDER: " << processed << " jobs processed, " << stolen << " stolen");
 }
 
-bool TileProvider::wave_should_be_processed(wave_index_t idx) {
+TileProvider::wave_verdict TileProvider::judge_wave(worker_index_t worker_idx, const job& j) {
   // Fast path. If the wave has already started, we are good to go.
-  if (idx <= m_wave_start_monitor.max_wave_idx)
-    return true;
+  if (j.wave_idx <= m_wave_start_monitor.max_wave_idx)
+    return wave_verdict::Process;
   
   std::unique_lock lock(m_wave_start_monitor.mtx);
 
   // Same check as above, but after locking the mutex.
-  if (idx <= m_wave_start_monitor.max_wave_idx)
-    return true;
+  if (j.wave_idx <= m_wave_start_monitor.max_wave_idx)
+    return wave_verdict::Process;
 
   // So, this thread is starting a new wave.
   // Are we supposed to process this wave?
-  if (idx > m_wave_start_monitor.requested_waves) {
-    return false;
+  if (j.wave_idx > m_wave_start_monitor.requested_waves) {
+    return wave_verdict::Drop;
   }
 
-  // Register the fact that this wave started.
-  m_wave_start_monitor.max_wave_idx = idx;
+  // If all the other outstanding jobs are held too, nothing is left running to measure: decide now.
+  bool final = m_wave_start_monitor.held.size() + 1 >= m_outstanding_jobs.load(std::memory_order_acquire);
+
+  switch (wave_fits_in_budget(j.wave_idx, final)) {
+    case budget_fit::Yes:
+      // Register the fact that this wave started.
+      m_wave_start_monitor.max_wave_idx = j.wave_idx;
+
+      lock.unlock();
+      vptINFO("Starting wave " << j.wave_idx);
+      return wave_verdict::Process;
+
+    case budget_fit::No:
+      // Then this is the end, for all tiles - so that they all get the same number of waves.
+      m_wave_start_monitor.requested_waves = m_wave_start_monitor.max_wave_idx;
+
+      lock.unlock();
+      vptINFO("Wave " << j.wave_idx << " would not be done within the time budget - stopping after wave " << j.wave_idx - 1);
+      return wave_verdict::Drop;
+
+    case budget_fit::Unsure:
+      m_wave_start_monitor.held.push_back({ worker_idx, j });
+      m_num_held.store(m_wave_start_monitor.held.size(), std::memory_order_release);
+      return wave_verdict::Hold;
+  }
+
+  std::unreachable();
+}
+
+void TileProvider::review_held_jobs() {
+  if (m_num_held.load(std::memory_order_acquire) == 0)
+    return;
 
+  std::unique_lock lock(m_wave_start_monitor.mtx);
+  if (m_wave_start_monitor.held.empty())
+    return;
+
+  const wave_index_t idx = m_wave_start_monitor.held.front().j.wave_idx;
+  bool start;
+
+  if (idx > m_wave_start_monitor.requested_waves) {
+    // Stopped meanwhile
+    start = false;
+  } else {
+    bool final = m_wave_start_monitor.held.size() >= m_outstanding_jobs.load(std::memory_order_acquire);
+
+    budget_fit fit = wave_fits_in_budget(idx, final);
+    if (fit == budget_fit::Unsure)
+      return;
+
+    start = fit == budget_fit::Yes;
+    if (start)
+      m_wave_start_monitor.max_wave_idx = idx;
+    else
+      m_wave_start_monitor.requested_waves = m_wave_start_monitor.max_wave_idx;
+  }
+
+  std::vector<parked_job> held = std::move(m_wave_start_monitor.held);
+  m_wave_start_monitor.held.clear();
+  m_num_held.store(0, std::memory_order_release);
   lock.unlock();
-  vptINFO("Starting wave " << idx);
 
-  return true;
+  if (start) {
+    vptINFO("Starting wave " << idx);
+
+    for (const parked_job& p : held) {
+      std::lock_guard queue_lock(m_queues[p.worker_idx].mtx);
+      m_queues[p.worker_idx].jobs.push_back(p.j);
+    }
+
+    m_generation.fetch_add(1, std::memory_order_release);
+    m_generation.notify_all();
+  } else {
+    vptINFO("Wave " << idx << " would not be done within the time budget - stopping after wave " << idx - 1);
+
+    for (size_t i = 0; i < held.size(); ++i)
+      retire_job();
+  }
 }
 
-image_rect_t TileProvider::compute_tile_rect(tile_index_t tile_idx) const {
+TileProvider::budget_fit TileProvider::wave_fits_in_budget(wave_index_t idx, bool final) const {
+  // The first wave always runs, or there would be no image at all.
+  if (m_time_limit.count() <= 0 or idx <= 1)
+    return budget_fit::Yes;
+
+  const size_t num_tiles = m_tile_wave.size();
+  size_t done_jobs = m_completed_jobs + m_skipped_jobs;
+  float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - m_start_t).count();
+
+  // Once a wave worth of jobs is done (or there's nothing else to go by), the wall clock gives the throughput, including all the overheads.
+  bool measured = done_jobs >= num_tiles or final;
+
+  float jobs_per_second = 0.0f;
+  if (measured) {
+    jobs_per_second = static_cast<float>(done_jobs) / elapsed;
+  } else if (m_expected_jobs_per_second > 0) {
+    jobs_per_second = m_expected_jobs_per_second;
+  } else if (uint64_t job_ns = m_job_ns.load(std::memory_order_relaxed); job_ns > 0) {
+    // Before that, the jobs done over the elapsed time miss the ones the other workers have in flight. But they all run at once, each of them taking about as long as those done.
+    float busy_workers = static_cast<float>(std::min(m_queues.size(), num_tiles));
+    jobs_per_second = busy_workers * static_cast<float>(m_completed_jobs) / (static_cast<float>(job_ns) * 1e-9f);
+  }
+
+  // Nothing to go by yet, i.e. the first wave after restoring from a checkpoint.
+  if (jobs_per_second <= 0)
+    return measured ? budget_fit::Yes : budget_fit::Unsure;
+
+  // Pessimistic, as some of the tiles may converge early.
+  size_t total_jobs = static_cast<size_t>(idx) * num_tiles;
+  size_t remaining_jobs = total_jobs - std::min(total_jobs, m_restored_jobs + done_jobs);
+  if (elapsed + static_cast<float>(remaining_jobs) / jobs_per_second <= m_time_limit.count())
+    return budget_fit::Yes;
+
+  return measured ? budget_fit::No : budget_fit::Unsure;
+}
+
+void TileProvider::set_time_budget(std::chrono::duration<float> time_limit, float samples_per_second) {
+  m_time_limit = time_limit;
+
+  // Each job renders one sample for each pixel of a tile
+  float pixels_per_job = static_cast<float>(m_img_size.prod() * m_num_views) / static_cast<float>(m_tile_wave.size());
+  m_expected_jobs_per_second = samples_per_second / pixels_per_job;
+}
+
+image_rect_t TileProvider::compute_tile_rect(tile_index_t view_tile_idx) const {
   tile_point_t x0_tile = {
-    tile_idx % m_num_tiles.x(),
-    tile_idx / m_num_tiles.x()
+    view_tile_idx % m_num_tiles.x(),
+    view_tile_idx / m_num_tiles.x()
   };
   
   image_point_t x0 = x0_tile.cast<image_index_t>().cwiseProduct(m_tile_size);
@@ -105,10 +473,21 @@ image_rect_t TileProvider::compute_tile_rect(tile_index_t tile_idx) const {
 }
   
 void TileProvider::stop_at_next_wave() {
-  std::unique_lock lock(m_wave_start_monitor.mtx);
-  m_wave_start_monitor.requested_waves = m_wave_start_monitor.max_wave_idx;
+  {
+    std::unique_lock lock(m_wave_start_monitor.mtx);
+    m_wave_start_monitor.requested_waves = m_wave_start_monitor.max_wave_idx;
+  }
+
+  // The held jobs won't start now
+  review_held_jobs();
+}
+void TileProvider::stop_now() {
+  m_force_stop.store(true, std::memory_order_release);
+
+  // Wake up the idle workers so they notice
+  m_generation.fetch_add(1, std::memory_order_release);
+  m_generation.notify_all();
 }
-void TileProvider::stop_now() { m_force_stop = true; }
 
 
 } // namespace vpt
\ No newline at end of file
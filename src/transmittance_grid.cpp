@@ -0,0 +1,113 @@
+#include <vpt/transmittance_grid.hpp>
+#include <vpt/density_sampler.hpp>
+#include <vpt/nanovdb_utils.hpp>
+#include <vpt/parallel.hpp>
+#include <vpt/utils.hpp>
+
+namespace vpt {
+
+template <typename BuildT>
+TransmittanceGrid::TransmittanceGrid(const nanovdb::NanoGrid<BuildT>& density, const Eigen::Vector3f& wi, float sigma_t, float cell_size, unsigned int num_threads, const LeafPager* pager) {
+  assert(cell_size > 0.0f);
+
+  Eigen::Vector3f x, y;
+  Eigen::Vector3f z = wi.normalized();
+  coordinate_system(z, x, y);
+  m_world_to_light.row(0) = x;
+  m_world_to_light.row(1) = y;
+  m_world_to_light.row(2) = z;
+
+  // Bound the density world bbox in light space
+  const auto& wbbox = density.worldBBox();
+  Eigen::Vector3f wmin(wbbox.min()[0], wbbox.min()[1], wbbox.min()[2]);
+  Eigen::Vector3f wmax(wbbox.max()[0], wbbox.max()[1], wbbox.max()[2]);
+
+  Eigen::Vector3f lmin = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+  Eigen::Vector3f lmax = -lmin;
+  for (int c = 0; c < 8; ++c) {
+    Eigen::Vector3f corner((c & 4) ? wmax.x() : wmin.x(), (c & 2) ? wmax.y() : wmin.y(), (c & 1) ? wmax.z() : wmin.z());
+    Eigen::Vector3f l = m_world_to_light * corner;
+    lmin = lmin.cwiseMin(l);
+    lmax = lmax.cwiseMax(l);
+  }
+
+  m_cell_size = cell_size * static_cast<float>(density.voxelSize()[0]);
+  m_origin = lmin;
+  m_resolution = ((lmax - lmin) / m_cell_size).array().ceil().cast<int>().max(1).matrix();
+
+  m_transmittance.resize(static_cast<size_t>(m_resolution.prod()));
+
+  const Eigen::Matrix3f light_to_world = m_world_to_light.transpose();
+  const float h = m_cell_size / 2.0f;
+
+  /*
+  Sweep each column from the side facing the light, accumulating the optical depth in steps of half a cell.
+  The density is sampled at the midpoint of each step - so we pass through each cell center, where we store the transmittance.
+  */
+  const size_t num_columns = static_cast<size_t>(m_resolution.x()) * m_resolution.y();
+  parallel_for(num_columns, num_threads, [&]() { return density.getAccessor(); }, [&](const typename GridTypes<BuildT>::AccessorT& acc, size_t column) {
+    DensitySampler<BuildT> sampler(acc, pager);
+
+    const int cx = static_cast<int>(column % m_resolution.x());
+    const int cy = static_cast<int>(column / m_resolution.x());
+
+    auto density_at = [&](float lz) {
+      Eigen::Vector3f l = m_origin + Eigen::Vector3f((cx + 0.5f) * m_cell_size, (cy + 0.5f) * m_cell_size, lz - m_origin.z());
+      Eigen::Vector3f world = light_to_world * l;
+      return sampler(density.worldToIndexF(eigen_to_nanovdb_f(world)));
+    };
+
+    float tau = 0.0f;
+    float lz = m_origin.z() + m_resolution.z() * m_cell_size;
+
+    for (int cz = m_resolution.z() - 1; cz >= 0; --cz) {
+      // From the top of the cell to its center
+      tau += sigma_t * density_at(lz - h / 2.0f) * h;
+      lz -= h;
+
+      m_transmittance[linear_index(cx, cy, cz)] = std::exp(-tau);
+
+      // From the center to the bottom of the cell
+      tau += sigma_t * density_at(lz - h / 2.0f) * h;
+      lz -= h;
+    }
+  }, 16);
+}
+
+float TransmittanceGrid::transmittance(const Eigen::Vector3f& world) const {
+  // Continuous coordinates, with the cell centers at integers
+  Eigen::Vector3f p = (m_world_to_light * world - m_origin) / m_cell_size - Eigen::Vector3f::Constant(0.5f);
+
+  Eigen::Vector3f p0 = p.array().floor();
+  Eigen::Vector3f f = p - p0;
+
+  Eigen::Vector3i i0 = p0.cast<int>();
+  Eigen::Vector3i max_idx = m_resolution - Eigen::Vector3i::Ones();
+
+  // Beyond the side facing the light there is nothing but empty space
+  if (i0.z() >= m_resolution.z())
+    return 1.0f;
+
+  auto at = [&](int dx, int dy, int dz) {
+    Eigen::Vector3i i = (i0 + Eigen::Vector3i(dx, dy, dz)).cwiseMax(0).cwiseMin(max_idx);
+
+    // Above the top cell the transmittance is 1
+    if (i0.z() + dz > max_idx.z())
+      return 1.0f;
+
+    return m_transmittance[linear_index(i.x(), i.y(), i.z())];
+  };
+
+  return lerp(
+    lerp(lerp(at(0, 0, 0), at(0, 0, 1), f.z()), lerp(at(0, 1, 0), at(0, 1, 1), f.z()), f.y()),
+    lerp(lerp(at(1, 0, 0), at(1, 0, 1), f.z()), lerp(at(1, 1, 0), at(1, 1, 1), f.z()), f.y()),
+    f.x()
+  );
+}
+
+#define VPT_INSTANTIATE(BuildT) \
+  template TransmittanceGrid::TransmittanceGrid(const nanovdb::NanoGrid<BuildT>&, const Eigen::Vector3f&, float, float, unsigned int, const LeafPager*);
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
+} // namespace vpt
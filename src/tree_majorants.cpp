@@ -0,0 +1,533 @@
+#include <array>
+#include <cstring>
+#include <fstream>
+
+#include <vpt/tree_majorants.hpp>
+#include <vpt/nanovdb_utils.hpp>
+#include <vpt/parallel.hpp>
+#include <vpt/logging.hpp>
+#include <vpt/hash.hpp>
+#include <vpt/temp_file.hpp>
+
+namespace vpt {
+
+using CoordT = nanovdb::math::Coord;
+
+/*
+The majorant of a node (or tile) must bound the interpolated density anywhere inside of it.
+The interpolator stencil reads voxels which are just outside the node, so we need an upper bound of the values on the faces of its neighbours.
+
+Face f = 2 * axis + side is the slab of voxels at the lower (side = 0) or upper (side = 1) end of a node along axis.
+*/
+using Faces = std::array<float, 6>;
+
+static inline Faces uniform_faces(float value) {
+  Faces ans;
+  ans.fill(value);
+  return ans;
+}
+
+/**
+  @return An upper bound of the values in the neighbour at offset d (in units of the neighbour dimension) which are adjacent to us.
+  These lie on all the faces of the neighbour pointing towards -d, so we can take the tightest of them.
+*/
+static inline float facing_bound(const Faces& faces, const CoordT& d) {
+  float ans = std::numeric_limits<float>::infinity();
+  for (int a = 0; a < 3; ++a) {
+    if (d[a] > 0)
+      ans = std::min(ans, faces[2 * a + 0]);
+    else if (d[a] < 0)
+      ans = std::min(ans, faces[2 * a + 1]);
+  }
+  return ans;
+}
+
+/** Call f(d) for each of the 26 neighbour offsets. */
+template <typename F>
+static inline void for_each_neighbour(F&& f) {
+  for (int i = -1; i <= 1; ++i)
+    for (int j = -1; j <= 1; ++j)
+      for (int k = -1; k <= 1; ++k)
+        if (i != 0 or j != 0 or k != 0)
+          f(CoordT(i, j, k));
+}
+
+static inline CoordT scale(const CoordT& d, uint32_t dim) {
+  const int s = static_cast<int>(dim);
+  return CoordT(d[0] * s, d[1] * s, d[2] * s);
+}
+
+namespace {
+
+template <typename BuildT>
+struct Builder {
+  using GridT = typename GridTypes<BuildT>::GridT;
+  using LeafT = typename GridTypes<BuildT>::LeafT;
+  using LowerT = typename GridTypes<BuildT>::LowerT;
+  using UpperT = typename GridTypes<BuildT>::UpperT;
+  using RootT = typename GridTypes<BuildT>::RootT;
+
+  const GridT& density;
+  const RootT& root;
+
+  const LeafT* first_leaf;
+  const LowerT* first_lower;
+  const UpperT* first_upper;
+
+  std::vector<Faces> leaf_faces;
+  std::vector<Faces> lower_faces;
+  std::vector<Faces> upper_faces;
+
+  /** @return The face bounds of the node (or tile) of dimension dim containing ijk. */
+  Faces faces_at(const CoordT& ijk, uint32_t dim) const {
+    const auto* tile = root.data()->probeTile(ijk);
+    if (tile == nullptr)
+      return uniform_faces(root.background());
+    if (not tile->isChild())
+      return uniform_faces(tile->value);
+
+    const UpperT* upper = root.data()->getChild(tile);
+    if (dim == UpperT::DIM)
+      return upper_faces[upper - first_upper];
+
+    uint32_t n = UpperT::CoordToOffset(ijk);
+    if (not upper->childMask().isOn(n))
+      return uniform_faces(upper->data()->getValue(n));
+
+    const LowerT* lower = upper->data()->getChild(n);
+    if (dim == LowerT::DIM)
+      return lower_faces[lower - first_lower];
+
+    n = LowerT::CoordToOffset(ijk);
+    if (not lower->childMask().isOn(n))
+      return uniform_faces(lower->data()->getValue(n));
+
+    return leaf_faces[lower->data()->getChild(n) - first_leaf];
+  }
+
+  /**
+    @brief Compute the majorants of the tiles of an internal node and the bounds of its faces.
+    @return The majorant of the node.
+  */
+  template <typename NodeT, typename ChildFaces, typename ChildMajorant>
+  float process_internal(const NodeT& node, const ChildFaces& child_faces, const ChildMajorant& child_majorant, float* tile_majorants, Faces& node_faces) const {
+    using ChildT = typename NodeT::ChildNodeType;
+    constexpr int N = 1 << NodeT::LOG2DIM;
+
+    std::vector<Faces> entry_faces(NodeT::SIZE);
+    for (uint32_t n = 0; n < NodeT::SIZE; ++n) {
+      entry_faces[n] = node.childMask().isOn(n) ?
+        child_faces(node.data()->getChild(n)) :
+        uniform_faces(node.data()->getValue(n));
+    }
+
+    float node_majorant = 0.0f;
+    node_faces = uniform_faces(-std::numeric_limits<float>::infinity());
+
+    for (uint32_t n = 0; n < NodeT::SIZE; ++n) {
+      CoordT local = NodeT::OffsetToLocalCoord(n);
+
+      for (int a = 0; a < 3; ++a) {
+        if (local[a] == 0)
+          node_faces[2 * a + 0] = std::max(node_faces[2 * a + 0], entry_faces[n][2 * a + 0]);
+        if (local[a] == N - 1)
+          node_faces[2 * a + 1] = std::max(node_faces[2 * a + 1], entry_faces[n][2 * a + 1]);
+      }
+
+      if (node.childMask().isOn(n)) {
+        node_majorant = std::max(node_majorant, child_majorant(node.data()->getChild(n)));
+        continue;
+      }
+
+      float majorant = node.data()->getValue(n);
+
+      for_each_neighbour([&](const CoordT& d) {
+        CoordT nb = local + d;
+
+        bool inside = nb[0] >= 0 and nb[0] < N and nb[1] >= 0 and nb[1] < N and nb[2] >= 0 and nb[2] < N;
+        if (inside) {
+          majorant = std::max(majorant, facing_bound(entry_faces[NodeT::CoordToOffset(node.origin() + scale(nb, ChildT::DIM))], d));
+        } else {
+          majorant = std::max(majorant, facing_bound(faces_at(node.offsetToGlobalCoord(n) + scale(d, ChildT::DIM), ChildT::DIM), d));
+        }
+      });
+
+      tile_majorants[n] = majorant;
+      node_majorant = std::max(node_majorant, majorant);
+    }
+
+    return node_majorant;
+  }
+};
+
+} // namespace
+
+/** Call f(value) for each voxel outside of the leaf which may be read by the interpolator stencil of a point inside of it. */
+template <typename LeafT, typename AccessorT, typename F>
+static inline void for_each_stencil_spill_value(const LeafT& leaf, const AccessorT& acc, unsigned int order, F&& f) {
+  constexpr auto LEAF_DIM = LeafT::DIM;
+
+  // Compute the leaf bounding box
+  nanovdb::math::BBox<nanovdb::math::Coord> leaf_bbox(leaf.origin(), leaf.origin().offsetBy(LEAF_DIM-1));
+
+  // Compute the interpolation AoE
+  auto aoe_bbox = leaf_bbox.expandBy(order);
+
+  // For each neighbouring leaf-sized bbox (don't look at the compiler output with -O3...)
+  for_each_neighbour([&](const CoordT& d) {
+    // Compute the neighbour bbox
+    auto neighbour_bbox = leaf_bbox;
+    neighbour_bbox.translate(scale(d, LEAF_DIM));
+
+    // Intersect the neighbour with the interpolator stencil AoE
+    neighbour_bbox.intersect(aoe_bbox);
+
+    for (const nanovdb::math::Coord& c : neighbour_bbox) {
+      f(acc.getValue(c));
+    }
+  });
+}
+
+/**
+  @brief Compute the majorant density of a leaf, accounting for the effect of interpolation.
+*/
+template <typename BuildT>
+static inline float fix_leaf_majorant_for_interpolation(const typename GridTypes<BuildT>::LeafT& leaf, const typename GridTypes<BuildT>::AccessorT& acc, unsigned int order) {
+  // The maximum raw voxel data value in each leaf is already stored in the grid (but for the quantized ones).
+  float majorant_density = GridTypes<BuildT>::leaf_max(leaf);
+
+  /*
+  However, it does not account for interpolation:
+  Values near the edges, where the interpolator stencil leaves the current leaves, may be larger!
+  In the following we account for interpolation.
+  */
+  for_each_stencil_spill_value(leaf, acc, order, [&](float value) {
+    // You COULD use a tighter upper bound... but is it really going to change much? (and do i even care)
+    majorant_density = std::max(majorant_density, value);
+  });
+
+  return majorant_density;
+}
+
+/**
+  @brief Compute a lower bound of the interpolated density in a leaf, to be used as a control density.
+*/
+template <typename LeafT, typename AccessorT>
+static inline float leaf_minorant_for_interpolation(const LeafT& leaf, const AccessorT& acc, unsigned int order) {
+  // The stored minimum only accounts for the active voxels - but the interpolator reads the inactive ones too.
+  float minorant_density = std::numeric_limits<float>::infinity();
+  for (uint32_t i = 0; i < LeafT::SIZE; ++i) {
+    minorant_density = std::min(minorant_density, leaf.getValue(i));
+  }
+
+  for_each_stencil_spill_value(leaf, acc, order, [&](float value) {
+    minorant_density = std::min(minorant_density, value);
+  });
+
+  // Densities are never negative
+  return std::max(0.0f, minorant_density);
+}
+
+template <typename LeafT>
+static inline Faces leaf_faces(const LeafT& leaf) {
+  Faces ans = uniform_faces(-std::numeric_limits<float>::infinity());
+
+  for (uint32_t i = 0; i < LeafT::SIZE; ++i) {
+    CoordT local = LeafT::OffsetToLocalCoord(i);
+    float value = leaf.getValue(i);
+
+    for (int a = 0; a < 3; ++a) {
+      if (local[a] == 0)
+        ans[2 * a + 0] = std::max(ans[2 * a + 0], value);
+      if (local[a] == static_cast<int>(LeafT::DIM) - 1)
+        ans[2 * a + 1] = std::max(ans[2 * a + 1], value);
+    }
+  }
+
+  return ans;
+}
+
+template <typename BuildT>
+TreeMajorants<BuildT>::TreeMajorants(const GridT& density, unsigned int order)
+  : m_density(density),
+    m_order(order),
+    m_first_leaf(density.tree().getFirstLeaf()),
+    m_first_lower(density.tree().getFirstLower()),
+    m_first_upper(density.tree().getFirstUpper()),
+    m_background(density.tree().root().background())
+{
+  const auto& tree = density.tree();
+
+  m_leaf.resize(tree.template nodeCount<LeafT>());
+  m_leaf_min.resize(m_leaf.size());
+  m_lower.resize(tree.template nodeCount<LowerT>());
+  m_upper.resize(tree.template nodeCount<UpperT>());
+  m_lower_tiles.resize(m_lower.size() * LowerT::SIZE);
+  m_upper_tiles.resize(m_upper.size() * UpperT::SIZE);
+  m_root_tiles.resize(tree.root().tileCount());
+}
+
+template <typename BuildT>
+TreeMajorants<BuildT>::TreeMajorants(const GridT& density, unsigned int order, unsigned int num_threads)
+  : TreeMajorants(density, order)
+{
+  // The tiles only look at their direct neighbours
+  assert(order > 0 and order <= LeafT::DIM);
+
+  const auto& root = density.tree().root();
+
+  Builder<BuildT> builder {
+    .density = density,
+    .root = root,
+    .first_leaf = m_first_leaf,
+    .first_lower = m_first_lower,
+    .first_upper = m_first_upper,
+    .leaf_faces = std::vector<Faces>(m_leaf.size()),
+    .lower_faces = std::vector<Faces>(m_lower.size()),
+    .upper_faces = std::vector<Faces>(m_upper.size()),
+  };
+
+  /*
+  Each level only reads the levels below it, and each node only writes its own entries - so the nodes of a level can be processed in parallel.
+  The accessor is not thread safe, so each thread gets its own.
+  */
+
+  // Leaves
+  parallel_for(m_leaf.size(), num_threads, [&]() { return density.getAccessor(); }, [&](const AccessorT& acc, size_t i) {
+    m_leaf[i] = fix_leaf_majorant_for_interpolation<BuildT>(m_first_leaf[i], acc, order);
+    m_leaf_min[i] = leaf_minorant_for_interpolation(m_first_leaf[i], acc, order);
+    builder.leaf_faces[i] = leaf_faces(m_first_leaf[i]);
+  });
+
+  // Lower internal nodes
+  parallel_for(m_lower.size(), num_threads, []() { return 0; }, [&](int, size_t i) {
+    m_lower[i] = builder.process_internal(
+      m_first_lower[i],
+      [&](const LeafT* leaf) -> const Faces& { return builder.leaf_faces[leaf - m_first_leaf]; },
+      [&](const LeafT* leaf) { return m_leaf[leaf - m_first_leaf]; },
+      &m_lower_tiles[i * LowerT::SIZE],
+      builder.lower_faces[i]
+    );
+  }, 1);
+
+  // Upper internal nodes
+  parallel_for(m_upper.size(), num_threads, []() { return 0; }, [&](int, size_t i) {
+    m_upper[i] = builder.process_internal(
+      m_first_upper[i],
+      [&](const LowerT* lower) -> const Faces& { return builder.lower_faces[lower - m_first_lower]; },
+      [&](const LowerT* lower) { return m_lower[lower - m_first_lower]; },
+      &m_upper_tiles[i * UpperT::SIZE],
+      builder.upper_faces[i]
+    );
+  }, 1);
+
+  // Root tiles, and the background regions next to them. There are very few of them.
+  for (uint32_t i = 0; i < root.tileCount(); ++i) {
+    const auto* tile = root.data()->tile(i);
+
+    Faces faces = tile->isChild() ?
+      builder.upper_faces[root.data()->getChild(tile) - m_first_upper] :
+      uniform_faces(tile->value);
+
+    float majorant = tile->isChild() ? 0.0f : tile->value;
+
+    for_each_neighbour([&](const CoordT& d) {
+      CoordT nb = tile->origin() + scale(d, UpperT::DIM);
+
+      if (not tile->isChild())
+        majorant = std::max(majorant, facing_bound(builder.faces_at(nb, UpperT::DIM), d));
+
+      // Our faces pointing towards d are the ones adjacent to the background region
+      if (root.data()->probeTile(nb) == nullptr)
+        m_background = std::max(m_background, facing_bound(faces, CoordT(-d[0], -d[1], -d[2])));
+    });
+
+    m_root_tiles[i] = majorant;
+  }
+}
+
+/*
+Cache file layout: a CacheHeader, followed by the leaf majorants and minorants, then the other majorant arrays in the same order as the header counts, followed by the background majorant.
+Everything is stored in the native (little endian) representation.
+*/
+namespace {
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint64_t grid_hash;
+  uint64_t num_leaves;
+  uint64_t num_lower;
+  uint64_t num_upper;
+  uint64_t num_root_tiles;
+};
+
+constexpr char CACHE_MAGIC[8] = { 'V', 'P', 'T', 'M', 'A', 'J', '\0', '\0' };
+
+// Bump this whenever the way the majorants are computed changes, so stale caches get discarded.
+constexpr uint32_t CACHE_VERSION = 2;
+
+} // namespace
+
+template <typename T>
+static inline bool read_array(std::istream& is, std::vector<T>& v) {
+  return static_cast<bool>(is.read(reinterpret_cast<char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T))));
+}
+
+template <typename T>
+static inline bool write_array(std::ostream& os, const std::vector<T>& v) {
+  return static_cast<bool>(os.write(reinterpret_cast<const char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T))));
+}
+
+template <typename BuildT>
+std::optional<TreeMajorants<BuildT>> TreeMajorants<BuildT>::load(const std::filesystem::path& path, const GridT& density, unsigned int order, uint64_t grid_hash) {
+  std::ifstream is(path, std::ios::binary);
+  if (not is)
+    return std::nullopt;
+
+  TreeMajorants ans(density, order);
+
+  CacheHeader header;
+  if (not is.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    vptWARN("Majorant cache " << path << " is truncated - ignoring it.");
+    return std::nullopt;
+  }
+
+  if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 or header.version != CACHE_VERSION) {
+    vptWARN("Majorant cache " << path << " has an unknown format or version - ignoring it.");
+    return std::nullopt;
+  }
+
+  if (header.grid_hash != grid_hash or header.order != order) {
+    vptINFO("Majorant cache " << path << " is stale - ignoring it.");
+    return std::nullopt;
+  }
+
+  if (header.num_leaves != ans.m_leaf.size() or header.num_lower != ans.m_lower.size() or
+      header.num_upper != ans.m_upper.size() or header.num_root_tiles != ans.m_root_tiles.size()) {
+    vptWARN("Majorant cache " << path << " does not match the grid topology - ignoring it.");
+    return std::nullopt;
+  }
+
+  bool ok = read_array(is, ans.m_leaf) and read_array(is, ans.m_leaf_min) and read_array(is, ans.m_lower) and read_array(is, ans.m_upper) and
+    read_array(is, ans.m_lower_tiles) and read_array(is, ans.m_upper_tiles) and read_array(is, ans.m_root_tiles) and
+    is.read(reinterpret_cast<char*>(&ans.m_background), sizeof(ans.m_background));
+
+  if (not ok) {
+    vptWARN("Majorant cache " << path << " is truncated - ignoring it.");
+    return std::nullopt;
+  }
+
+  return ans;
+}
+
+template <typename BuildT>
+void TreeMajorants<BuildT>::save(const std::filesystem::path& path, uint64_t grid_hash) const {
+  CacheHeader header {
+    .magic = {},
+    .version = CACHE_VERSION,
+    .order = m_order,
+    .grid_hash = grid_hash,
+    .num_leaves = m_leaf.size(),
+    .num_lower = m_lower.size(),
+    .num_upper = m_upper.size(),
+    .num_root_tiles = m_root_tiles.size(),
+  };
+  std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+
+  // Write to a temporary file of our own and rename it, so a concurrent (or killed) render never sees a partial cache.
+  std::optional<std::filesystem::path> tmp = create_temp_file(path);
+  if (not tmp) {
+    vptWARN("Failed to create a temporary file for the majorant cache " << path << ": " << std::strerror(errno));
+    return;
+  }
+  const std::filesystem::path& tmp_path = *tmp;
+
+  {
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+
+    bool ok = os and os.write(reinterpret_cast<const char*>(&header), sizeof(header)) and
+      write_array(os, m_leaf) and write_array(os, m_leaf_min) and write_array(os, m_lower) and write_array(os, m_upper) and
+      write_array(os, m_lower_tiles) and write_array(os, m_upper_tiles) and write_array(os, m_root_tiles) and
+      os.write(reinterpret_cast<const char*>(&m_background), sizeof(m_background));
+
+    if (not ok) {
+      vptWARN("Failed to write the majorant cache " << tmp_path);
+      std::error_code ec;
+      std::filesystem::remove(tmp_path, ec);
+      return;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    vptWARN("Failed to write the majorant cache " << path << ": " << ec.message());
+    std::filesystem::remove(tmp_path, ec);
+  }
+}
+
+template <typename BuildT>
+uint64_t TreeMajorants<BuildT>::grid_hash(const GridT& density, unsigned int num_threads) {
+  // NanoVDB grids are a single contiguous, 32 byte aligned, buffer - so we can hash it directly. Hash chunks in parallel, then hash the hashes.
+  constexpr size_t CHUNK_SIZE = 64 << 20;
+
+  const char* data = reinterpret_cast<const char*>(&density);
+  const size_t size = density.gridSize();
+  assert(size % 8 == 0);
+
+  std::vector<uint64_t> chunk_hashes(ceildiv(size, CHUNK_SIZE) + 1);
+  chunk_hashes.back() = size;
+
+  parallel_for(chunk_hashes.size() - 1, num_threads, []() { return 0; }, [&](int, size_t i) {
+    size_t begin = i * CHUNK_SIZE;
+    size_t len = std::min(CHUNK_SIZE, size - begin);
+    chunk_hashes[i] = detail::MurmurHash64A_padded(data + begin, static_cast<int>(len), i);
+  }, 1);
+
+  return detail::MurmurHash64A_padded(chunk_hashes.data(), static_cast<int>(chunk_hashes.size() * sizeof(uint64_t)), 0);
+}
+
+template <typename BuildT>
+typename TreeMajorants<BuildT>::Node TreeMajorants<BuildT>::lookup(const CoordT& ijk, const AccessorT& acc) const {
+  // Fast path - the accessor caches the leaf
+  if (const LeafT* leaf = acc.probeLeaf(ijk))
+    return { leaf_majorant(leaf), leaf_minorant(leaf), LeafT::DIM };
+
+  const auto& root = m_density.tree().root();
+
+  const auto* tile = root.data()->probeTile(ijk);
+  if (tile == nullptr)
+    return { m_background, 0.0f, UpperT::DIM };
+  if (not tile->isChild())
+    return { m_root_tiles[tile - root.data()->tile(0)], 0.0f, UpperT::DIM };
+
+  const UpperT* upper = root.data()->getChild(tile);
+  size_t upper_idx = upper - m_first_upper;
+
+  // The whole node is empty, even when accounting for interpolation - we can skip it in one step.
+  if (m_upper[upper_idx] <= 0.0f)
+    return { 0.0f, 0.0f, UpperT::DIM };
+
+  uint32_t n = UpperT::CoordToOffset(ijk);
+  if (not upper->childMask().isOn(n))
+    return { m_upper_tiles[upper_idx * UpperT::SIZE + n], 0.0f, LowerT::DIM };
+
+  const LowerT* lower = upper->data()->getChild(n);
+  size_t lower_idx = lower - m_first_lower;
+
+  if (m_lower[lower_idx] <= 0.0f)
+    return { 0.0f, 0.0f, LowerT::DIM };
+
+  // This must be a tile, as there is no leaf.
+  n = LowerT::CoordToOffset(ijk);
+  assert(not lower->childMask().isOn(n));
+  return { m_lower_tiles[lower_idx * LowerT::SIZE + n], 0.0f, LeafT::DIM };
+}
+
+#define VPT_INSTANTIATE(BuildT) template struct TreeMajorants<BuildT>;
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
+} // namespace vpt
@@ -6,222 +6,302 @@
 
 namespace vpt {
 
-
-/** @return The dimension at which HDDA should step to not skip any active leaf, when starting at the specified coordinate. */
-inline static uint32_t get_hdda_dim(const RayMajorantIterator::CoordT& ijk, const RayMajorantIterator::GridT::AccessorType& acc, const RayMajorantIterator::RayT& ray) {
-  // Note that we only want to iterate up to the leaf level, not up to the voxel level.
-  return std::max<uint32_t>(8, acc.getDim(ijk, ray));
-}
-
-
-
-void RayMajorantIterator::update_current_majorant() {
-  auto ijk = m_dda.voxel();
-  
-  if (const auto* leaf = m_acc.probeLeaf(ijk)) {
-    // This is a leaf. The majorant is stored in maximum.
-    m_majorant = leaf->getMax();
-    return;
-  } else { 
-    // Not a leaf. It may still have a value which is constant value across its range.
-
-    float value;
-    if (m_acc.probeValue(ijk, value)) {
-      m_majorant = value;
+template <typename BuildT>
+void RayMajorantIterator<BuildT>::update_current_majorant() {
+  for (;;) {
+    typename TreeMajorants<BuildT>::Node node = m_tree_majorants.lookup(m_dda->voxel(), m_acc);
+
+    // The HDDA may be stepping at a coarser level than the region bounded by the majorant (e.g. a tile next to a leaf).
+    // In that case, refine the step and look again.
+    if (static_cast<int>(node.dim) >= m_dda->dim()) {
+      m_majorant = node.majorant;
+      m_minorant = node.minorant;
       return;
     }
-    
-    m_majorant = 0.0f;
+
+    m_dda->update(m_ray, node.dim);
   }
 }
 
-std::optional<RayMajorantIterator::Segment> RayMajorantIterator::next() {
+template <typename BuildT>
+std::optional<typename RayMajorantIterator<BuildT>::Segment> RayMajorantIterator<BuildT>::next() {
+  return m_majorant_grid ? next_grid() : next_tree();
+}
+
+template <typename BuildT>
+std::optional<typename RayMajorantIterator<BuildT>::Segment> RayMajorantIterator<BuildT>::next_tree() {
   // We already left the bounding box. There's nothing left.
-  if (m_dda.time() >= m_dda.maxTime()) {
+  if (m_dda->time() >= m_dda->maxTime()) {
     return std::nullopt;
   }
 
   Segment ans;
-  ans.t0 = m_dda.time();
+  ans.t0 = m_dda->time();
   
   // Get this node's majorant value.
   if (std::isnan(m_majorant)) {
     update_current_majorant();
-    record_step();
+    record_tree_step();
   }
 
   do {
     ans.d_maj = m_majorant;
+    ans.d_min = m_minorant;
 
-    if (not m_dda.step()) {
+    if (not m_dda->step()) {
       // We're leaving the bounding box - this is the last segment and we're done.
-      ans.t1 = m_dda.maxTime();
+      ans.t1 = m_dda->maxTime();
       return ans;
     }
 
     // Update the HDDA with the new step dimension.
-    uint32_t new_dim = get_hdda_dim(m_ray(m_dda.time() + 1.0001f).floor(), m_acc, m_ray);
-    m_dda.update(m_ray, new_dim);
+    uint32_t new_dim = m_tree_majorants.lookup(m_ray(m_dda->time() + 1.0001f).floor(), m_acc).dim;
+    m_dda->update(m_ray, new_dim);
 
     // Try to compute the majorant after the step. If it is the same, we'll bundle the two segments together.
     // This is useful when traversing empty space, because although efficient the stepping can be quite pessimistic.
     update_current_majorant();
 
-    record_step();
-  } while (m_majorant == ans.d_maj);
+    record_tree_step();
+  } while (m_majorant == ans.d_maj and m_minorant == ans.d_min);
 
   // We stepped - so the current HDDA time is the start of the next segment - equivalently, the end of the current one.
-  ans.t1 = m_dda.time();
+  ans.t1 = m_dda->time();
   return ans;
 }
 
-std::optional<RayMajorantIterator> Volume::intersect(const vpt::Ray& ray, const VolumeGrids::AccessorT& density_accessor) const {
+template <typename BuildT>
+std::optional<typename RayMajorantIterator<BuildT>::Segment> RayMajorantIterator<BuildT>::next_grid() {
+  if (m_grid_dda->done()) {
+    return std::nullopt;
+  }
+
+  Segment ans;
+  ans.t0 = m_grid_dda->time();
+
+  if (std::isnan(m_majorant)) {
+    m_majorant = m_majorant_grid->majorant(m_grid_dda->cell());
+    m_minorant = m_majorant_grid->minorant(m_grid_dda->cell());
+    record_grid_step();
+  }
+
+  do {
+    ans.d_maj = m_majorant;
+    ans.d_min = m_minorant;
+
+    float t_exit = m_grid_dda->exit_time();
+    if (not m_grid_dda->step()) {
+      // We're leaving the grid - this is the last segment.
+      ans.t1 = t_exit;
+      return ans;
+    }
+
+    // Same as the tree traversal - bundle together consecutive cells with the same majorant.
+    m_majorant = m_majorant_grid->majorant(m_grid_dda->cell());
+    m_minorant = m_majorant_grid->minorant(m_grid_dda->cell());
+
+    record_grid_step();
+  } while (m_majorant == ans.d_maj and m_minorant == ans.d_min);
+
+  ans.t1 = m_grid_dda->time();
+  return ans;
+}
+
+template <typename BuildT>
+std::optional<RayMajorantIterator<BuildT>> Volume::intersect(const vpt::Ray& ray, const typename GridTypes<BuildT>::AccessorT& density_accessor) const {
+  const auto& density = m_grids.density<BuildT>();
+
   nanovdb::math::Ray<float> w_ray(eigen_to_nanovdb_f(ray.origin()), eigen_to_nanovdb_f(ray.direction()));
-  nanovdb::math::Ray<float> i_ray = w_ray.worldToIndexF(m_grids.density());
+  nanovdb::math::Ray<float> i_ray = w_ray.worldToIndexF(density);
 
   // Check intersection and clip the ray if there is one
-  if (not i_ray.clip(m_grids.density().indexBBox())) {
+  if (not i_ray.clip(density.indexBBox())) {
     return std::nullopt; // no intersection -> no iterator
   }
 
-  return RayMajorantIterator(i_ray, m_grids.density(), density_accessor);
+  return RayMajorantIterator<BuildT>(i_ray, density, density_accessor, std::get<TreeMajorants<BuildT>>(m_tree_majorants), majorant_grid());
 }
 
-RayMajorantIterator::RayMajorantIterator(const RayT& ray, const GridT& density, const GridT::AccessorType& density_accessor)
+template <typename BuildT>
+RayMajorantIterator<BuildT>::RayMajorantIterator(const RayT& ray, const GridT& density, const AccessorT& density_accessor, const TreeMajorants<BuildT>& tree_majorants, const MajorantGrid* majorant_grid)
   : m_scale(1 / density.worldToIndexDirF(ray.dir()).length()),
     m_ray(ray), 
     m_majorant(std::numeric_limits<float>::signaling_NaN()),
+    m_minorant(0.0f),
     m_acc(density_accessor),
-    m_dda(ray, get_hdda_dim(ray.start().floor(), density_accessor, ray)),
+    m_tree_majorants(tree_majorants),
+    m_majorant_grid(majorant_grid),
     m_step_record_dst(nullptr)
 {
+  if (m_majorant_grid) {
+    m_grid_dda.emplace(*m_majorant_grid, ray);
+  } else {
+    m_dda.emplace(ray, tree_majorants.lookup(ray.start().floor(), density_accessor).dim);
+  }
 }
 
-/**
-  @brief Update the maximum value in each leaf to act as the majorant density, accounting for the effect of interpolation.
-  @param order The size of the stencil used by the interpolator minus 1 divided by 2. For example, for the trilinear interpolator this is 1.
-*/
-static inline void fix_majorants_for_interpolation(VolumeGrids::GridT& density, unsigned int order) {
-  /*
-    TODO: OK, for leaves this is fine... What about the rest?
-  */
-
-  assert(order > 0);
-
-  auto leaf_begin = density.tree().getFirstLeaf();
-  auto leaf_end = leaf_begin + density.tree().nodeCount<VolumeGrids::GridT::LeafNodeType>();
-
-  auto acc = density.getAccessor();
-
-  // For each leaf
-  for (auto& leaf : std::ranges::subrange(leaf_begin, leaf_end)) {
-    // The maximum raw voxel data value in each leaf is already stored in the grid.    
-    float majorant_density = leaf.getMax();
-
-    /*
-    However, it does not account for interpolation:
-    Values near the edges, where the interpolator stencil leaves the current leaves, may be larger!
-    In the following we account for interpolation.
-    */
-
-    constexpr auto LEAF_DIM = VolumeGrids::GridT::LeafNodeType::DIM;
-
-    // Compute the leaf bounding box
-    nanovdb::math::BBox<nanovdb::math::Coord> leaf_bbox(leaf.origin(), leaf.origin().offsetBy(LEAF_DIM-1));
-
-    // Compute the interpolation AoE
-    auto aoe_bbox = leaf_bbox.expandBy(order);
-
-    // For each neighbouring leaf-sized bbox (don't look at the compiler output with -O3...)
-    for (int i = -1; i <= 1; ++i) {
-      for (int j = -1; j <= 1; ++j) {
-        for (int k = -1; k <= 1; ++k) {
-          if (i == 0 and j == 0 and k == 0)
-            continue;
-
-          // Compute the neighbour bbox
-          auto neighbour_bbox = leaf_bbox;
-          neighbour_bbox.translate(eigen_to_nanovdb_i(Eigen::Vector3i{ i, j, k } * LEAF_DIM));
-
-          // Intersect the neighbour with the interpolator stencil AoE
-          neighbour_bbox.intersect(aoe_bbox);
-          
-          // Compute the upper bound value at this intersection
-          for (const nanovdb::math::Coord& c : neighbour_bbox) {
-            // You COULD use a tighter upper bound... but is it really going to change much? (and do i even care)
-            majorant_density = std::max(majorant_density, acc.getValue(c));
-          }
-        } 
-      }
-    }
+/** @brief Load the tree majorants from the cache, or compute them (and update the cache) if it is missing or stale. */
+template <typename BuildT>
+static TreeMajorants<BuildT> load_or_compute_tree_majorants(const nanovdb::NanoGrid<BuildT>& density, const VolumeParameters& params, unsigned int num_threads, const std::filesystem::path& cache_path) {
+  // We use trilinear interpolation
+  constexpr unsigned int order = 1;
 
-    leaf.setMax(majorant_density);
+  Stopwatch sw;
+
+  if (not params.cache_majorants or cache_path.empty()) {
+    TreeMajorants<BuildT> ans(density, order, num_threads);
+    vptINFO("Computed tree majorants in " << sw.elapsed_ms() << " ms (" << num_threads << " threads)");
+    return ans;
   }
+
+  uint64_t grid_hash = TreeMajorants<BuildT>::grid_hash(density, num_threads);
+  vptINFO("Hashed density grid (" << density.gridSize() / (1024 * 1024) << " MiB) in " << sw.elapsed_ms() << " ms");
+
+  sw.restart();
+  if (std::optional<TreeMajorants<BuildT>> cached = TreeMajorants<BuildT>::load(cache_path, density, order, grid_hash)) {
+    vptINFO("Loaded tree majorants from " << cache_path << " in " << sw.elapsed_ms() << " ms");
+    return std::move(*cached);
+  }
+
+  sw.restart();
+  TreeMajorants<BuildT> ans(density, order, num_threads);
+  vptINFO("Computed tree majorants in " << sw.elapsed_ms() << " ms (" << num_threads << " threads)");
+
+  sw.restart();
+  ans.save(cache_path, grid_hash);
+  vptINFO("Saved tree majorants to " << cache_path << " in " << sw.elapsed_ms() << " ms");
+
+  return ans;
 }
 
-Volume::Volume(const VolumeGrids& grids, const VolumeParameters& params)
-    : m_grids(grids), m_params(params) {
+Volume::Volume(const VolumeGrids& grids, const VolumeParameters& params, unsigned int num_threads, const std::filesystem::path& majorant_cache_path)
+    : m_grids(grids),
+      m_params(params),
+      m_tree_majorants(grids.visit_density([&](const auto& density) -> TreeMajorantsV {
+        return load_or_compute_tree_majorants(density, params, num_threads, majorant_cache_path);
+      }))
+{
+  const auto& wbbox = m_grids.visit_density([](const auto& density) -> const auto& { return density.worldBBox(); });
 
-  nanovdb::Vec3f span = m_grids.density().worldBBox().max() - m_grids.density().worldBBox().min();
-  m_bsphere_center = nanovdb_to_eigen_f(m_grids.density().worldBBox().min() + span / 2.0f);
+  nanovdb::Vec3f span = wbbox.max() - wbbox.min();
+  m_bsphere_center = nanovdb_to_eigen_f(wbbox.min() + span / 2.0f);
   m_bsphere_radius = (span / 2).length();
 
-  fix_majorants_for_interpolation(m_grids.density(), 1);
+  if (m_params.majorant_grid_cell_size > 0) {
+    Stopwatch sw;
+    m_grids.visit_density([&](const auto& density) { m_majorant_grid.emplace(density, m_params.majorant_grid_cell_size); });
+
+    const Eigen::Vector3i& res = m_majorant_grid->resolution();
+    vptINFO("Built majorant grid with " << res.x() << 'x' << res.y() << 'x' << res.z() << " cells of " << m_params.majorant_grid_cell_size << " voxels (" << m_majorant_grid->size_bytes() / 1024 << " KiB) in " << sw.elapsed_ms() << " ms");
+  }
 }
 
-Eigen::Vector3f Volume::world_to_density_index(const Eigen::Vector3f& world) const {
-  return nanovdb_to_eigen_f(m_grids.density().worldToIndexF(eigen_to_nanovdb_f(world)));
+void Volume::set_params(const VolumeParameters& params) {
+  VolumeParameters ans = params;
+  ans.majorant_grid_cell_size = m_params.majorant_grid_cell_size;
+  ans.cache_majorants = m_params.cache_majorants;
+  m_params = ans;
+}
+
+void Volume::precompute_shadows(const WorkerParameters& params, unsigned int num_threads) {
+  m_transmittance_grid.reset();
+
+  if (params.shadows.mode != ShadowParameters::Mode::Cached)
+    return;
+
+  Stopwatch sw;
+  m_grids.visit_density([&](const auto& density) {
+    m_transmittance_grid.emplace(
+      density,
+      params.distant_light.inv_direction,
+      m_params.sigma_a + m_params.sigma_s,
+      params.shadows.cell_size,
+      num_threads,
+      leaf_pager()
+    );
+  });
+
+  const Eigen::Vector3i& res = m_transmittance_grid->resolution();
+  vptINFO("Built transmittance grid with " << res.x() << 'x' << res.y() << 'x' << res.z() << " cells of " << params.shadows.cell_size << " voxels (" << m_transmittance_grid->size_bytes() / 1024 << " KiB) in " << sw.elapsed_ms() << " ms");
 }
 
-void Volume::log_majorant_trace(const Ray& ray, const VolumeGrids::AccessorT& density_accessor) const {
-  std::optional<RayMajorantIterator> intersection = intersect(ray, density_accessor);
+bool Volume::page_leaves(size_t budget_bytes) {
+  if (not m_grids.is_mapped())
+    return false;
 
+  // A temperature grid which is a copy must stay resident: evicting its pages would zero them
+  const VolumeGrids::TemperatureGridT* temperature = m_grids.is_temperature_mapped() ? &m_grids.temperature() : nullptr;
+  m_grids.visit_density([&](const auto& density) { m_leaf_pager.emplace(density, temperature, budget_bytes); });
+  return true;
+}
+
+Eigen::Vector3f Volume::world_to_density_index(const Eigen::Vector3f& world) const {
+  return m_grids.visit_density([&](const auto& density) { return nanovdb_to_eigen_f(density.worldToIndexF(eigen_to_nanovdb_f(world))); });
+}
+
+void Volume::log_majorant_trace(const Ray& ray) const {
   std::ofstream log("majorant_trace.csv");
   print_csv(log, "X0", "Y0", "Z0", "X1", "Y1", "Z1", "T0", "T1", "Majorant") << '\n';
 
-  if (intersection) {
-    RayMajorantIterator iter = *intersection;
+  m_grids.visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>& density) {
+    auto density_accessor = density.getAccessor();
+
+    std::optional<RayMajorantIterator<BuildT>> intersection = intersect<BuildT>(ray, density_accessor);
+    if (not intersection)
+      return;
+
+    RayMajorantIterator<BuildT> iter = *intersection;
     while (auto seg_opt = iter.next()) {
-      const RayMajorantIterator::Segment& segment = *seg_opt;
+      const typename RayMajorantIterator<BuildT>::Segment& segment = *seg_opt;
 
       Eigen::Vector3f p0 = world_to_density_index(ray.eval(segment.t0 * iter.idx_to_world_scale()));
       Eigen::Vector3f p1 = world_to_density_index(ray.eval(segment.t1 * iter.idx_to_world_scale()));
       print_csv(log, p0.x(), p0.y(), p0.z(), p1.x(), p1.y(), p1.z(), segment.t0 * iter.idx_to_world_scale(), segment.t1 * iter.idx_to_world_scale(), segment.d_maj) << '\n';
     }
-  }
+  });
 }
 
-void Volume::log_dda_trace(const Ray& vpt_ray, const VolumeGrids::AccessorT& density_accessor) const {
-  nanovdb::math::Ray<float> w_ray(eigen_to_nanovdb_f(vpt_ray.origin()), eigen_to_nanovdb_f(vpt_ray.direction()));
-  w_ray.setMaxTime(10000.0f);
+void Volume::log_dda_trace(const Ray& vpt_ray) const {
+  m_grids.visit_density([&](const auto& density) {
+    auto density_accessor = density.getAccessor();
 
-  nanovdb::math::Ray<float> ray = w_ray.worldToIndexF(m_grids.density());
+    nanovdb::math::Ray<float> w_ray(eigen_to_nanovdb_f(vpt_ray.origin()), eigen_to_nanovdb_f(vpt_ray.direction()));
+    w_ray.setMaxTime(10000.0f);
 
-  if (not ray.clip(m_grids.density().indexBBox())) {
-    return;
-  }
+    nanovdb::math::Ray<float> ray = w_ray.worldToIndexF(density);
+
+    if (not ray.clip(density.indexBBox())) {
+      return;
+    }
 
-  ray.setMinTime(ray.t0() - 16.0f);
-  ray.setMaxTime(ray.t1() + 16.0f);
+    ray.setMinTime(ray.t0() - 16.0f);
+    ray.setMaxTime(ray.t1() + 16.0f);
 
-  std::ofstream out("dda_trace.csv");
+    std::ofstream out("dda_trace.csv");
 
-  print_csv(out, "X", "Y", "Z", "T", "Value", "Dim_getdim", "Dim_nodeinfo", "Active", "Maximum") << "\n";
+    print_csv(out, "X", "Y", "Z", "T", "Value", "Dim_getdim", "Dim_nodeinfo", "Active", "Maximum") << "\n";
 
-  nanovdb::math::DDA<decltype(ray), nanovdb::math::Coord> dda(ray);
-  do {
-    nanovdb::Coord ijk = dda.voxel();
-    float value = density_accessor.getValue(ijk);
+    nanovdb::math::DDA<decltype(ray), nanovdb::math::Coord> dda(ray);
+    do {
+      nanovdb::Coord ijk = dda.voxel();
+      float value = density_accessor.getValue(ijk);
 
-    auto ni = density_accessor.getNodeInfo(ijk);
-    uint32_t dim_getdim = density_accessor.getDim(ijk, ray);
-    uint32_t dim_nodeinfo = ni.dim;
-    float max_value = ni.maximum;
+      auto ni = density_accessor.getNodeInfo(ijk);
+      uint32_t dim_getdim = density_accessor.getDim(ijk, ray);
+      uint32_t dim_nodeinfo = ni.dim;
+      float max_value = ni.maximum;
 
-    bool active = density_accessor.isActive(ijk);
+      bool active = density_accessor.isActive(ijk);
 
-    print_csv(out, ijk.x(), ijk.y(), ijk.z(), dda.time(), value, dim_getdim, dim_nodeinfo, active, max_value) << std::endl;
-  } while (dda.step());
+      print_csv(out, ijk.x(), ijk.y(), ijk.z(), dda.time(), value, dim_getdim, dim_nodeinfo, active, max_value) << std::endl;
+    } while (dda.step());
+  });
 }
 
+#define VPT_INSTANTIATE(BuildT) \
+  template struct RayMajorantIterator<BuildT>; \
+  template std::optional<RayMajorantIterator<BuildT>> Volume::intersect<BuildT>(const vpt::Ray&, const typename GridTypes<BuildT>::AccessorT&) const;
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
 } // namespace vpt
\ No newline at end of file
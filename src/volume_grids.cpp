@@ -1,5 +1,15 @@
 #include <utility>
 #include <optional>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-private-field"
@@ -10,27 +20,119 @@
 #include <nanovdb/tools/CreatePrimitives.h>
 #include <nanovdb/io/IO.h>
 #include <nanovdb/tools/GridBuilder.h>
+#include <nanovdb/tools/CreateNanoGrid.h>
 #pragma GCC diagnostic pop
 
 
 #include <vpt/logging.hpp>
+#include <vpt/utils.hpp>
+#include <vpt/temp_file.hpp>
 #include <vpt/volume_grids.hpp>
 
+/** @brief Throw a VolumeLoadError with the message streamed into it. */
+#define vptLOAD_ERROR(x) do { std::ostringstream msg_; msg_ << x; throw VolumeLoadError(msg_.str()); } while(false)
+
 namespace vpt {
 
+/** @return A copy of the grid, encoded with DstBuildT. */
+template <typename DstBuildT, typename SrcBuildT>
+static VolumeGrids::GridHandleT reencode(const nanovdb::NanoGrid<SrcBuildT>& grid) {
+  // The leaf statistics are needed to bound the density - see GridTypes::leaf_max.
+  return nanovdb::tools::createNanoGrid<nanovdb::NanoGrid<SrcBuildT>, DstBuildT>(grid, nanovdb::tools::StatsMode::All);
+}
+
+/** @return Whether density grids of the type are rendered as they are (see VPT_FOR_EACH_DENSITY_BUILD_TYPE). */
+static bool is_rendered_as_is(nanovdb::GridType type) {
+  return type == nanovdb::GridType::Float or type == nanovdb::GridType::Fp16 or type == nanovdb::GridType::Fp8;
+}
+
+/** @brief Re-encode the density grid, unless it is rendered as it is. */
+static VolumeGrids::GridHandleT renderable_density(VolumeGrids::GridHandleT&& handle) {
+  switch (handle.gridType()) {
+    case nanovdb::GridType::Float:
+    case nanovdb::GridType::Fp16:
+    case nanovdb::GridType::Fp8:
+      return std::move(handle);
+
+    // The smallest fixed size encodings which hold them losslessly
+    case nanovdb::GridType::Fp4:
+      vptINFO("Re-encoding the Fp4 density grid as Fp8");
+      return reencode<nanovdb::Fp8>(*handle.grid<nanovdb::Fp4>());
+    case nanovdb::GridType::FpN:
+      vptINFO("Re-encoding the FpN density grid as Fp16");
+      return reencode<nanovdb::Fp16>(*handle.grid<nanovdb::FpN>());
+
+    default:
+      vptLOAD_ERROR("The density grid has an unsupported type (" << static_cast<int>(handle.gridType()) << ") - it must be Float, Fp4, Fp8, Fp16 or FpN.");
+  }
+}
+
+/** @brief Decode the temperature grid to float. */
+static VolumeGrids::GridHandleT float_temperature(VolumeGrids::GridHandleT&& handle) {
+  switch (handle.gridType()) {
+    case nanovdb::GridType::Float:
+      return std::move(handle);
+    case nanovdb::GridType::Fp4:
+      return reencode<float>(*handle.grid<nanovdb::Fp4>());
+    case nanovdb::GridType::Fp8:
+      return reencode<float>(*handle.grid<nanovdb::Fp8>());
+    case nanovdb::GridType::Fp16:
+      return reencode<float>(*handle.grid<nanovdb::Fp16>());
+    case nanovdb::GridType::FpN:
+      return reencode<float>(*handle.grid<nanovdb::FpN>());
+
+    default:
+      vptLOAD_ERROR("The temperature grid has an unsupported type (" << static_cast<int>(handle.gridType()) << ") - it must be Float, Fp4, Fp8, Fp16 or FpN.");
+  }
+}
+
 VolumeGrids::VolumeGrids(GridHandleT&& h_density)
-  : m_density_handle(std::forward<GridHandleT>(h_density)),
-    m_temperature_handle(std::nullopt),
-    m_density(m_density_handle.grid<float>()),
-    m_temperature(nullptr)
-{}
+  : m_density_handle(renderable_density(std::forward<GridHandleT>(h_density))),
+    m_temperature_handle(std::nullopt)
+{
+  set_grids();
+}
 
 VolumeGrids::VolumeGrids(GridHandleT&& h_density, GridHandleT&& h_temperature)
-  : m_density_handle(std::forward<GridHandleT>(h_density)),
-    m_temperature_handle(std::forward<GridHandleT>(h_temperature)),
-    m_density(m_density_handle.grid<float>()),
-    m_temperature(m_temperature_handle->grid<float>())
-{}
+  : m_density_handle(renderable_density(std::forward<GridHandleT>(h_density))),
+    m_temperature_handle(float_temperature(std::forward<GridHandleT>(h_temperature)))
+{
+  set_grids();
+}
+
+VolumeGrids::VolumeGrids(std::shared_ptr<const MappedFile> mapping, GridHandleT&& h_density, std::optional<GridHandleT>&& h_temperature)
+  : m_mapping(std::move(mapping)),
+    m_density_handle(renderable_density(std::forward<GridHandleT>(h_density)))
+{
+  if (h_temperature)
+    m_temperature_handle = float_temperature(std::move(*h_temperature));
+
+  set_grids();
+}
+
+nanovdb::GridType VolumeGrids::density_type() const {
+  return visit_density([](const auto& grid) { return grid.gridType(); });
+}
+
+VolumeGrids VolumeGrids::reencoded(nanovdb::GridType density_type) const {
+  GridHandleT density = visit_density([&](const auto& grid) {
+    switch (density_type) {
+      case nanovdb::GridType::Float:
+        return reencode<float>(grid);
+      case nanovdb::GridType::Fp16:
+        return reencode<nanovdb::Fp16>(grid);
+      case nanovdb::GridType::Fp8:
+        return reencode<nanovdb::Fp8>(grid);
+      default:
+        vptFATAL("Can't re-encode the density grid as type " << static_cast<int>(density_type) << " - it must be Float, Fp16 or Fp8.");
+    }
+  });
+
+  if (m_temperature_handle)
+    return VolumeGrids { std::move(density), m_temperature_handle->copy() };
+
+  return VolumeGrids { std::move(density) };
+}
 
 VolumeGrids VolumeGrids::generate_donut() {
   return VolumeGrids { nanovdb::tools::createFogVolumeTorus() };
@@ -39,24 +141,410 @@ VolumeGrids VolumeGrids::generate_donut() {
 static inline std::optional<VolumeGrids::GridHandleT> nanovdb_try_read_grid(const std::filesystem::path& path, const std::string& grid_name) {
   try {
     return nanovdb::io::readGrid<VolumeGrids::GridHandleT::BufferType>(path, grid_name);
-  } catch (const std::runtime_error& e) {
+  } catch (const std::exception& e) {
     vptWARN("NanoVDB failed to read grid \"" << grid_name << "\" from file \"" << path << "\": " << e.what());
   }
   return std::nullopt;
 }
 
-static inline VolumeGrids::GridHandleT nanovdb_read_grid_or_die(const std::filesystem::path& path, const std::string& grid_name) {
+static inline VolumeGrids::GridHandleT nanovdb_read_grid(const std::filesystem::path& path, const std::string& grid_name) {
   auto grid = nanovdb_try_read_grid(path, grid_name);
   
   if (not grid) {
-    vptFATAL("NanoVDB file " << path << " does not contain the \"" << grid_name << "\" grid.");
+    vptLOAD_ERROR("NanoVDB file " << path << " does not contain the \"" << grid_name << "\" grid.");
   }
 
   return std::move(*grid);
 }
 
-VolumeGrids VolumeGrids::read_from_file(const std::filesystem::path& path) {
-  GridHandleT density = nanovdb_read_grid_or_die(path, "density");
+/** @brief A private, copy on write mapping of a whole file. Until written, its pages are shared with the page cache. */
+struct MappedFile {
+  uint8_t* data = nullptr;
+  size_t size = 0;
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data)
+      munmap(data, size);
+  }
+
+  static std::shared_ptr<const MappedFile> map(const std::filesystem::path& path, bool populate, bool huge_pages) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      vptWARN("Failed to open " << path << ": " << std::strerror(errno));
+      return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 or st.st_size == 0) {
+      vptWARN("Failed to stat " << path << " or it is empty");
+      close(fd);
+      return nullptr;
+    }
+
+    auto ans = std::make_shared<MappedFile>();
+    ans->size = static_cast<size_t>(st.st_size);
+
+    void* ptr = mmap(nullptr, ans->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED) {
+      vptWARN("Failed to map " << path << ": " << std::strerror(errno));
+      return nullptr;
+    }
+    ans->data = static_cast<uint8_t*>(ptr);
+
+    if (huge_pages and madvise(ptr, ans->size, MADV_HUGEPAGE) != 0)
+      vptWARN("The kernel refused huge pages for " << path << ": " << std::strerror(errno));
+
+    return ans;
+  }
+};
+
+void VolumeGrids::set_grids() {
+  switch (m_density_handle.gridType()) {
+    case nanovdb::GridType::Fp16:
+      m_density = m_density_handle.grid<nanovdb::Fp16>();
+      break;
+    case nanovdb::GridType::Fp8:
+      m_density = m_density_handle.grid<nanovdb::Fp8>();
+      break;
+    default:
+      m_density = m_density_handle.grid<float>();
+      break;
+  }
+
+  m_temperature = m_temperature_handle ? m_temperature_handle->grid<float>() : nullptr;
+
+  // A re-encoded density grid is a copy, even if the other grids point into the mapping.
+  auto in_mapping = [&](const GridHandleT& handle) {
+    uintptr_t data = reinterpret_cast<uintptr_t>(handle.data());
+    uintptr_t mapping = reinterpret_cast<uintptr_t>(m_mapping->data);
+    return data >= mapping and data < mapping + m_mapping->size;
+  };
+
+  m_density_mapped = m_mapping and in_mapping(m_density_handle);
+  m_temperature_mapped = m_mapping and m_temperature_handle and in_mapping(*m_temperature_handle);
+}
+
+namespace {
+
+/** The location of a grid within a mapped NanoVDB file. */
+struct MappedGrid {
+  std::string name;
+  size_t offset;
+  uint64_t file_size;
+  uint64_t grid_size;
+  nanovdb::io::Codec codec;
+};
+
+/**
+  A NanoVDB file is a sequence of segments, each made of a header, the metadata and name of each of its grids, then the grids themselves.
+  See nanovdb/io/IO.h.
+*/
+std::optional<std::vector<MappedGrid>> index_mapped_grids(const MappedFile& file) {
+  std::vector<MappedGrid> ans;
+
+  size_t pos = 0;
+  auto read = [&](void* dst, size_t size) {
+    if (file.size - pos < size)
+      return false;
+    std::memcpy(dst, file.data + pos, size);
+    pos += size;
+    return true;
+  };
+
+  while (pos < file.size) {
+    nanovdb::io::FileHeader header;
+    if (not read(&header, sizeof(header)) or not header.isValid())
+      return std::nullopt;
+
+    size_t first = ans.size();
+    for (uint16_t i = 0; i < header.gridCount; ++i) {
+      nanovdb::io::FileMetaData meta;
+      if (not read(&meta, sizeof(meta)) or file.size - pos < meta.nameSize)
+        return std::nullopt;
+
+      // The name is null terminated
+      const char* name = reinterpret_cast<const char*>(file.data + pos);
+      ans.push_back({ std::string(name, strnlen(name, meta.nameSize)), 0, meta.fileSize, meta.gridSize, header.codec });
+      pos += meta.nameSize;
+    }
+
+    for (size_t i = first; i < ans.size(); ++i) {
+      if (file.size - pos < ans[i].file_size)
+        return std::nullopt;
+
+      ans[i].offset = pos;
+      pos += ans[i].file_size;
+    }
+  }
+
+  return ans;
+}
+
+/*
+The grids in a NanoVDB file are usually not aligned as NanoVDB needs them to be, so they can't be used in place.
+The aligned cache is a sidecar file with a copy of the grids which are: a header, a table of grids, then the grids at page aligned offsets.
+*/
+struct AlignedCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_grids;
+
+  // Of the volume file, to detect stale caches
+  uint64_t source_size;
+  int64_t source_mtime;
+};
+
+struct AlignedCacheEntry {
+  char name[48];
+  uint64_t offset;
+  uint64_t size;
+};
+
+constexpr char ALIGNED_CACHE_MAGIC[8] = { 'V', 'P', 'T', 'G', 'R', 'I', 'D', '\0' };
+constexpr uint32_t ALIGNED_CACHE_VERSION = 1;
+constexpr uint64_t ALIGNED_CACHE_ALIGNMENT = 4096;
+
+std::optional<std::vector<MappedGrid>> index_aligned_cache(const MappedFile& file, const AlignedCacheHeader& expected, const std::filesystem::path& path) {
+  AlignedCacheHeader header;
+  if (file.size < sizeof(header))
+    return std::nullopt;
+  std::memcpy(&header, file.data, sizeof(header));
+
+  if (std::memcmp(header.magic, ALIGNED_CACHE_MAGIC, sizeof(ALIGNED_CACHE_MAGIC)) != 0 or header.version != ALIGNED_CACHE_VERSION) {
+    vptWARN("Aligned grid cache " << path << " has an unknown format or version - ignoring it.");
+    return std::nullopt;
+  }
+
+  if (header.source_size != expected.source_size or header.source_mtime != expected.source_mtime) {
+    vptINFO("Aligned grid cache " << path << " is stale - ignoring it.");
+    return std::nullopt;
+  }
+
+  std::vector<MappedGrid> ans;
+  for (uint32_t i = 0; i < header.num_grids; ++i) {
+    AlignedCacheEntry entry;
+    size_t pos = sizeof(header) + i * sizeof(entry);
+    if (file.size < pos + sizeof(entry))
+      return std::nullopt;
+    std::memcpy(&entry, file.data + pos, sizeof(entry));
+
+    if (entry.offset > file.size or file.size - entry.offset < entry.size) {
+      vptWARN("Aligned grid cache " << path << " is truncated - ignoring it.");
+      return std::nullopt;
+    }
+
+    ans.push_back({ std::string(entry.name, strnlen(entry.name, sizeof(entry.name))), entry.offset, entry.size, entry.size, nanovdb::io::Codec::NONE });
+  }
+
+  return ans;
+}
+
+} // namespace
+
+static std::optional<AlignedCacheHeader> aligned_cache_header(const std::filesystem::path& volume_path, uint32_t num_grids) {
+  std::error_code ec;
+  uint64_t size = std::filesystem::file_size(volume_path, ec);
+  if (ec)
+    return std::nullopt;
+
+  auto mtime = std::filesystem::last_write_time(volume_path, ec);
+  if (ec)
+    return std::nullopt;
+
+  AlignedCacheHeader ans { {}, ALIGNED_CACHE_VERSION, num_grids, size, static_cast<int64_t>(mtime.time_since_epoch().count()) };
+  std::memcpy(ans.magic, ALIGNED_CACHE_MAGIC, sizeof(ALIGNED_CACHE_MAGIC));
+  return ans;
+}
+
+static void save_aligned_cache(const std::filesystem::path& path, const std::filesystem::path& volume_path, const VolumeGrids& grids) {
+  struct Grid {
+    const char* name;
+    const void* data;
+    uint64_t size;
+  };
+
+  std::vector<Grid> to_save { grids.visit_density([](const auto& density) { return Grid { "density", &density, density.gridSize() }; }) };
+  if (grids.has_temperature())
+    to_save.push_back({ "temperature", &grids.temperature(), grids.temperature().gridSize() });
+
+  std::optional<AlignedCacheHeader> header = aligned_cache_header(volume_path, static_cast<uint32_t>(to_save.size()));
+  if (not header)
+    return;
+
+  std::vector<AlignedCacheEntry> entries;
+  uint64_t offset = sizeof(AlignedCacheHeader) + to_save.size() * sizeof(AlignedCacheEntry);
+  for (const Grid& grid : to_save) {
+    offset = ceildiv(offset, ALIGNED_CACHE_ALIGNMENT) * ALIGNED_CACHE_ALIGNMENT;
+
+    AlignedCacheEntry entry { {}, offset, grid.size };
+    std::strncpy(entry.name, grid.name, sizeof(entry.name) - 1);
+    entries.push_back(entry);
+
+    offset += entry.size;
+  }
+
+  // Write to a temporary file of our own and rename it, so a concurrent (or killed) render never sees a partial cache.
+  std::optional<std::filesystem::path> tmp = create_temp_file(path);
+  if (not tmp) {
+    vptWARN("Failed to create a temporary file for the aligned grid cache " << path << ": " << std::strerror(errno));
+    return;
+  }
+  const std::filesystem::path& tmp_path = *tmp;
+
+  {
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+
+    bool ok = os and os.write(reinterpret_cast<const char*>(&*header), sizeof(*header)) and
+      os.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(AlignedCacheEntry)));
+
+    for (size_t i = 0; ok and i < entries.size(); ++i) {
+      std::vector<char> padding(entries[i].offset - static_cast<uint64_t>(os.tellp()), '\0');
+      ok = os.write(padding.data(), static_cast<std::streamsize>(padding.size())) and
+        os.write(static_cast<const char*>(to_save[i].data), static_cast<std::streamsize>(entries[i].size));
+    }
+
+    if (not ok) {
+      vptWARN("Failed to write the aligned grid cache " << tmp_path);
+      std::error_code ec;
+      std::filesystem::remove(tmp_path, ec);
+      return;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    vptWARN("Failed to write the aligned grid cache " << path << ": " << ec.message());
+    std::filesystem::remove(tmp_path, ec);
+  }
+}
+
+/**
+  @brief Make a handle for a grid of the mapping - pointing straight into it if possible, otherwise copying it out.
+  Compressed grids can't be mapped: in that case, return nullopt and let NanoVDB read them.
+*/
+static std::optional<VolumeGrids::GridHandleT> map_grid(const MappedFile& file, const MappedGrid& grid, bool& in_place) {
+  using BufferT = VolumeGrids::GridHandleT::BufferType;
+
+  if (grid.codec != nanovdb::io::Codec::NONE or grid.file_size != grid.grid_size) {
+    in_place = false;
+    return std::nullopt;
+  }
+
+  uint8_t* data = file.data + grid.offset;
+
+  // NanoVDB needs its data to be aligned, and the alignment only depends on the offset in the file.
+  if (reinterpret_cast<uintptr_t>(data) % NANOVDB_DATA_ALIGNMENT != 0) {
+    in_place = false;
+
+    BufferT buffer = BufferT::create(grid.grid_size);
+    std::memcpy(buffer.data(), data, grid.grid_size);
+    return VolumeGrids::GridHandleT(std::move(buffer));
+  }
+
+  return VolumeGrids::GridHandleT(BufferT::createFull(grid.grid_size, data));
+}
+
+/**
+  @brief Make the grids out of a mapped file.
+  in_place is set to whether they all point into the mapping, as they are rendered (i.e. without being re-encoded).
+*/
+static std::optional<VolumeGrids> map_grids(std::shared_ptr<const MappedFile> file, const std::vector<MappedGrid>& grids, const std::filesystem::path& path, bool& in_place) {
+  in_place = true;
+  bool any_in_place = false;
+
+  auto find = [&](const std::string& name) -> std::optional<VolumeGrids::GridHandleT> {
+    auto it = std::ranges::find(grids, name, &MappedGrid::name);
+    if (it == grids.end())
+      return std::nullopt;
+
+    bool grid_in_place = true;
+    std::optional<VolumeGrids::GridHandleT> handle = map_grid(*file, *it, grid_in_place);
+    if (not handle)
+      handle = nanovdb_try_read_grid(path, name);
+
+    in_place = in_place and grid_in_place;
+    any_in_place = any_in_place or grid_in_place;
+    return handle;
+  };
+
+  std::optional<VolumeGrids::GridHandleT> density = find("density");
+  if (not density)
+    return std::nullopt;
+
+  std::optional<VolumeGrids::GridHandleT> temperature = find("temperature");
+
+  if (not is_rendered_as_is(density->gridType()) or (temperature and temperature->gridType() != nanovdb::GridType::Float))
+    in_place = false;
+
+  // Don't keep the mapping around just for copies
+  if (not any_in_place)
+    file.reset();
+
+  return VolumeGrids { std::move(file), std::move(*density), std::move(temperature) };
+}
+
+static std::optional<VolumeGrids> map_from_file(const std::filesystem::path& path, const VolumeLoading& loading) {
+  std::filesystem::path cache_path = path;
+  cache_path += ".vptgrids";
+
+  bool in_place;
+
+  if (loading.aligned_cache and std::filesystem::exists(cache_path)) {
+    std::shared_ptr<const MappedFile> cache = MappedFile::map(cache_path, loading.populate, loading.huge_pages);
+    std::optional<AlignedCacheHeader> expected = aligned_cache_header(path, 0);
+
+    if (cache and expected) {
+      if (std::optional<std::vector<MappedGrid>> grids = index_aligned_cache(*cache, *expected, cache_path)) {
+        if (std::optional<VolumeGrids> ans = map_grids(std::move(cache), *grids, path, in_place)) {
+          vptINFO("Mapped the grids of " << path << " from " << cache_path);
+          return ans;
+        }
+      }
+    }
+  }
+
+  std::shared_ptr<const MappedFile> file = MappedFile::map(path, loading.populate, loading.huge_pages);
+  if (not file)
+    return std::nullopt;
+
+  std::optional<std::vector<MappedGrid>> grids = index_mapped_grids(*file);
+  if (not grids) {
+    vptWARN(path << " is not a valid NanoVDB file - can't map it");
+    return std::nullopt;
+  }
+
+  std::optional<VolumeGrids> ans = map_grids(std::move(file), *grids, path, in_place);
+  if (not ans)
+    vptLOAD_ERROR("NanoVDB file " << path << " does not contain the \"density\" grid.");
+
+  if (in_place) {
+    vptINFO("Mapped the grids of " << path);
+  } else if (loading.aligned_cache) {
+    vptINFO("The grids of " << path << " are compressed, not aligned or re-encoded - copied them, and saving an aligned copy to " << cache_path << " to map on later runs");
+    save_aligned_cache(cache_path, path, *ans);
+  } else {
+    vptINFO("The grids of " << path << " are compressed, not aligned or re-encoded - copied them instead of mapping them");
+  }
+
+  return ans;
+}
+
+VolumeGrids VolumeGrids::read_from_file(const std::filesystem::path& path, const VolumeLoading& loading) {
+  if (loading.mmap) {
+    if (std::optional<VolumeGrids> ans = map_from_file(path, loading))
+      return std::move(*ans);
+
+    vptWARN("Failed to map " << path << " - reading it instead");
+  }
+
+  GridHandleT density = nanovdb_read_grid(path, "density");
   std::optional<GridHandleT> temperature = nanovdb_try_read_grid(path, "temperature");
 
   if (temperature) {
@@ -66,4 +554,4 @@ VolumeGrids VolumeGrids::read_from_file(const std::filesystem::path& path) {
   return VolumeGrids { std::move(density) };
 }
 
-} // namespace vpt
\ No newline at end of file
+} // namespace vpt
@@ -0,0 +1,338 @@
+#include <vpt/worker.hpp>
+#include <vpt/spectral.hpp>
+#include <vpt/color.hpp>
+#include <vpt/majorant_transmittance_sampler.hpp>
+#include <vpt/density_sampler.hpp>
+#include <vpt/nanovdb_utils.hpp>
+
+namespace vpt {
+
+/*
+The wavefront engine keeps the state of the paths of a batch of tiles in a structure of arrays, and moves them through queues of path indices.
+Each stage is a tight loop over its input queue, which fills the input queues of the following stages:
+
+              +-------> shadows --(shadow)--> done
+              |
+  rays --(collision)--> scatters --(scatter)--> rays
+              |
+              +-------> escapes --(escape)--> done
+
+A worker takes tiles until the batch has about BATCH_PATHS paths, so that the queues stay long after the first bounces, when most paths are gone.
+Each tile of the batch draws from its own random number generator, seeded for its job: the paths of a tile consume it in the same order
+whatever the other tiles of the batch, so the image does not depend on how the tiles are batched.
+The density lookups along the rays are batched too, by the majorant sampler (see DensitySampler).
+*/
+
+namespace {
+
+using path_index_t = uint32_t;
+using batch_tile_index_t = uint32_t;
+
+// Enough for the paths left after a few bounces to keep the stages busy, while the path states still fit in the L2 cache
+static constexpr size_t BATCH_PATHS = 1024;
+
+/** A tile of the batch. */
+struct BatchTile {
+  TileProvider::token tok;
+  const View* view;
+  image_rect_t rect;
+  image_index_t block; // The size of the blocks of pixels which share a path, if this is a preview level of the tile
+  RandomNumberGenerator rng;
+};
+
+/** The state of the paths of a batch, as a structure of arrays indexed by path. */
+struct PathStates {
+  std::vector<batch_tile_index_t> tile;
+  std::vector<image_point_t> pixel;
+
+  // The current ray
+  std::vector<Eigen::Vector3f> origin;
+  std::vector<Eigen::Vector3f> direction;
+
+  // The point of the last real scattering collision
+  std::vector<Eigen::Vector3f> scatter_point;
+
+  std::vector<Eigen::Vector3f> L;
+  std::vector<unsigned int> depth;
+
+  void resize(size_t n) {
+    tile.resize(n);
+    pixel.resize(n);
+    origin.resize(n);
+    direction.resize(n);
+    scatter_point.resize(n);
+    L.resize(n);
+    depth.resize(n);
+  }
+
+  size_t size() const { return pixel.size(); }
+};
+
+struct Queues {
+  std::vector<path_index_t> rays;     // Paths with a ray to be traced through the medium
+  std::vector<path_index_t> shadows;  // Paths with a shadow ray to be traced from their scattering collision
+  std::vector<path_index_t> scatters; // Paths which had a real scattering collision
+  std::vector<path_index_t> escapes;  // Paths which left the medium without being absorbed
+
+  void clear() {
+    rays.clear();
+    shadows.clear();
+    scatters.clear();
+    escapes.clear();
+  }
+};
+
+template <typename BuildT>
+struct WavefrontWorker {
+  using AccessorT = typename GridTypes<BuildT>::AccessorT;
+
+  WavefrontWorker(const WorkerParameters& params, const Volume& vol, RandomNumberGenerator rng)
+    : m_params(params),
+      m_vol(vol),
+      m_rng(rng),
+      m_density_acc(vol.grids().density<BuildT>().getAccessor())
+  {
+    if (vol.grids().has_temperature())
+      m_temp_sampler.emplace(vol.grids(), vol.leaf_pager());
+  }
+
+  /** @return The number of paths of the tiles added since the last render_batch(). */
+  size_t num_paths() const { return m_paths.size(); }
+
+  bool empty() const { return m_tiles.empty(); }
+
+  /** @brief Add the job of a tile to the batch, with its camera rays. */
+  void add_tile(TileProvider::token tok, std::span<const View> views) {
+    image_rect_t rect = tok.compute_rect();
+    const View& view = views[tok.view()];
+    image_index_t block = tok.preview_block();
+
+    RandomNumberGenerator rng = m_rng;
+    rng.begin_job(tok.jid());
+
+    m_tiles.push_back({ std::move(tok), &view, rect, block, rng });
+    generate_camera_rays(static_cast<batch_tile_index_t>(m_tiles.size() - 1));
+  }
+
+  /** @brief Trace all the paths of the batch to the end, add them to the films, and complete the jobs of its tiles. */
+  void render_batch() {
+    while (not m_queues.rays.empty()) {
+      trace_collisions();
+      trace_shadow_rays();
+      scatter();
+    }
+
+    escape();
+    accumulate();
+
+    for (BatchTile& tile : m_tiles)
+      finish_tile(m_params.adaptive_sampling, tile.view->film, tile.tok, tile.rect);
+
+    m_tiles.clear();
+    m_paths.resize(0);
+    m_queues.clear();
+  }
+
+private:
+  /** Stage: add the camera rays of a tile to the path states. In a preview level, the pixel of a path is the start of its block. */
+  void generate_camera_rays(batch_tile_index_t t) {
+    BatchTile& tile = m_tiles[t];
+    const image_rect_t& rect = tile.rect;
+
+    size_t first = m_paths.size();
+    m_paths.resize(first + static_cast<size_t>(rect.size.prod()));
+
+    path_index_t n = static_cast<path_index_t>(first);
+    for (image_index_t y = 0; y < rect.size.y(); y += tile.block) {
+      for (image_index_t x = 0; x < rect.size.x(); x += tile.block) {
+        image_rect_t block_rect = preview_block_rect(rect, rect.start + image_point_t { x, y }, tile.block);
+        image_point_t pt = block_rect.start + block_rect.size / 2;
+
+        if (m_params.single_pixel.enabled and m_params.single_pixel.coord != pt)
+          continue;
+
+        Eigen::Vector2f jitter { tile.rng.uniform<float>(), tile.rng.uniform<float>() };
+        jitter *= m_params.use_jitter? 0.5 : 0.0;
+
+        Ray r = tile.view->camera.generate_ray(pt, jitter);
+
+        m_paths.tile[n] = t;
+        m_paths.pixel[n] = block_rect.start;
+        m_paths.origin[n] = r.origin();
+        m_paths.direction[n] = r.direction();
+        m_paths.L[n] = Eigen::Vector3f::Zero();
+        m_paths.depth[n] = 0;
+
+        m_queues.rays.push_back(n);
+        ++n;
+      }
+    }
+
+    m_paths.resize(n);
+  }
+
+  /**
+    Stage: delta tracking along the rays of the queue, until a real collision or until the ray leaves the medium.
+    Absorbed paths are done, the others are moved to the scatter or escape queues.
+  */
+  void trace_collisions() {
+    const float sigma_a = m_vol.params().sigma_a;
+    const float sigma_s = m_vol.params().sigma_s;
+
+    const bool has_light = m_params.distant_light.xyz * m_params.distant_light.multiplier != Eigen::Vector3f::Zero();
+
+    for (path_index_t i : m_queues.rays) {
+      RandomNumberGenerator& rng = m_tiles[m_paths.tile[i]].rng;
+      Ray r(m_paths.origin[i], m_paths.direction[i]);
+
+      auto intersection = m_vol.intersect<BuildT>(r, m_density_acc);
+      if (not intersection) {
+        m_queues.escapes.push_back(i);
+        continue;
+      }
+
+      MajorantTransmittanceSampler<BuildT> sampler(*intersection, rng, m_vol.grids().density<BuildT>(), m_density_acc, sigma_a + sigma_s, m_vol.leaf_pager());
+
+      bool collided = false;
+      while (auto props = sampler.next()) {
+        float p_a = (sigma_a * props->density) / props->sigma_maj;
+        float p_s = (sigma_s * props->density) / props->sigma_maj;
+        float p_n = std::max<float>(1.0f - p_a - p_s, 0.0f);
+
+        if (m_temp_sampler) {
+          nanovdb::Vec3f temp_coord = m_vol.grids().temperature().worldToIndexF(eigen_to_nanovdb_f(props->point));
+          float temp_adim = (*m_temp_sampler)(temp_coord);
+          float temp_K = temp_adim * m_vol.params().temperature_scale + m_vol.params().temperature_offset;
+          m_paths.L[i] += p_a * m_vol.params().le_scale * blackbody_radiation_xyz(temp_K);
+        }
+
+        ScatterEvent event = sample_discrete<ScatterEvent>({
+          { ScatterEvent::Null, p_n },
+          { ScatterEvent::Absorption, p_a },
+          { ScatterEvent::Scatter, p_s },
+        }, rng.uniform<float>());
+
+        if (event == ScatterEvent::Null)
+          continue;
+
+        collided = true;
+
+        if (event == ScatterEvent::Scatter) {
+          // Same depth accounting as the megakernel, so that both engines converge to the same image.
+          if (m_paths.depth[i]++ < m_params.max_depth) {
+            m_paths.scatter_point[i] = props->point;
+            if (has_light)
+              m_queues.shadows.push_back(i);
+            m_queues.scatters.push_back(i);
+          }
+        }
+
+        // Otherwise, the path was absorbed (or terminated) and it is done.
+        break;
+      }
+
+      if (not collided)
+        m_queues.escapes.push_back(i);
+    }
+
+    m_queues.rays.clear();
+  }
+
+  /** Stage: direct lighting at the scattering points. */
+  void trace_shadow_rays() {
+    Eigen::Vector3f wi = m_params.distant_light.inv_direction.normalized();
+    Eigen::Vector3f Li = m_params.distant_light.xyz * m_params.distant_light.multiplier;
+
+    for (path_index_t i : m_queues.shadows) {
+      float T_ray = shadow_transmittance<BuildT>(m_params.shadows, m_vol, m_tiles[m_paths.tile[i]].rng, m_paths.scatter_point[i], wi, m_density_acc);
+      if (T_ray <= 0.0f)
+        continue;
+
+      float p = henyey_greenstein(m_paths.direction[i].dot(wi), m_vol.params().henyey_greenstein_g);
+      m_paths.L[i] += p * T_ray * Li;
+    }
+
+    m_queues.shadows.clear();
+  }
+
+  /** Stage: sample the phase function at the scattering points, producing the rays of the next bounce. */
+  void scatter() {
+    for (path_index_t i : m_queues.scatters) {
+      RandomNumberGenerator& rng = m_tiles[m_paths.tile[i]].rng;
+      m_paths.direction[i] = sample_henyey_greenstein(m_paths.direction[i], { rng.uniform<float>(), rng.uniform<float>() }, m_vol.params().henyey_greenstein_g);
+      m_paths.origin[i] = m_paths.scatter_point[i];
+
+      // The bounce itself
+      if (++m_paths.depth[i] < m_params.max_depth)
+        m_queues.rays.push_back(i);
+      else
+        m_queues.escapes.push_back(i);
+    }
+
+    m_queues.scatters.clear();
+  }
+
+  /** Stage: the rays are going to infinity and beyond. */
+  void escape() {
+    Eigen::Vector3f Le = m_params.infinite_light.xyz * m_params.infinite_light.multiplier;
+
+    for (path_index_t i : m_queues.escapes)
+      m_paths.L[i] += Le;
+
+    m_queues.escapes.clear();
+  }
+
+  /** Stage: add the radiance of all the paths to the film - or to the blocks of the preview. */
+  void accumulate() {
+    for (size_t i = 0; i < m_paths.size(); ++i) {
+      const BatchTile& tile = m_tiles[m_paths.tile[i]];
+      Eigen::Vector3f L = tile.view->camera.params().imaging_ratio * m_paths.L[i];
+
+      if (tile.block > 1)
+        tile.view->film.add_preview_sample(preview_block_rect(tile.rect, m_paths.pixel[i], tile.block), L);
+      else
+        tile.view->film.add_sample(m_paths.pixel[i], L);
+    }
+  }
+
+  const WorkerParameters& m_params;
+  const Volume& m_vol;
+  RandomNumberGenerator m_rng; // Seeded for each tile of the batch
+
+  AccessorT m_density_acc;
+  std::optional<TemperatureSampler> m_temp_sampler;
+
+  std::vector<BatchTile> m_tiles;
+  PathStates m_paths;
+  Queues m_queues;
+};
+
+} // namespace
+
+template <typename BuildT>
+void run_wavefront(const WorkerParameters& params, const Volume& vol, std::span<const View> views, TileProvider& tp, TileProvider::worker_index_t worker_idx, RandomNumberGenerator rng) {
+  WavefrontWorker<BuildT> worker(params, vol, rng);
+
+  while (true) {
+    // Only wait for the first tile of a batch: the jobs we'd wait for with tiles in hand may be the next waves of those tiles
+    while (worker.num_paths() < BATCH_PATHS) {
+      TileProvider::token tok = tp.next(worker_idx, worker.empty());
+      if (not tok)
+        break;
+
+      worker.add_tile(std::move(tok), views);
+    }
+
+    if (worker.empty())
+      break;
+
+    worker.render_batch();
+  }
+}
+
+#define VPT_INSTANTIATE(BuildT) \
+  template void run_wavefront<BuildT>(const WorkerParameters&, const Volume&, std::span<const View>, TileProvider&, TileProvider::worker_index_t, RandomNumberGenerator);
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
+} // namespace vpt
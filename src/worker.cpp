@@ -2,16 +2,11 @@
 #include <vpt/spectral.hpp>
 #include <vpt/color.hpp>
 #include <vpt/majorant_transmittance_sampler.hpp>
+#include <vpt/density_sampler.hpp>
 #include <vpt/nanovdb_utils.hpp>
 
 namespace vpt {
 
-enum class ScatterEvent {
-  Null,
-  Absorption,
-  Scatter
-};
-
 template <bool Enabled>
 struct Logger {
   void new_ray(const Ray& r) {
@@ -49,66 +44,163 @@ private:
 };
 
 
-Eigen::Vector3f sample_Ld(const WorkerParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Eigen::Vector3f& pos, const Eigen::Vector3f& w, VolumeGrids::AccessorT density_acc) {
-  // Only one distant light
-  Eigen::Vector3f wi = params.distant_light.inv_direction.normalized();
-  Eigen::Vector3f Li = params.distant_light.xyz * params.distant_light.multiplier;
-
-  if (Li == Eigen::Vector3f::Zero())
-    return Li;
+/** Russian roulette on the transmittance estimate, once it gets low enough. */
+static inline void roulette_transmittance(RandomNumberGenerator& rng, float& T_ray) {
+  if (T_ray <= 0.05f) {
+    float q = 0.75f;
+    if (rng.uniform<float>() < q) {
+      T_ray = 0.0f;
+    } else {
+      T_ray /= 1 - q;
+    }
+  }
+}
 
+template <typename BuildT>
+static float ratio_tracking(const Volume& vol, RandomNumberGenerator& rng, const Ray& r, const typename GridTypes<BuildT>::AccessorT& density_acc) {
   float sigma_t = vol.params().sigma_a + vol.params().sigma_s;
 
-  // Trace the shadow ray to estimate transmittance
   float T_ray = 1.0f;
-  Ray r(pos, wi);
-  if (auto maj_iter = vol.intersect(r, density_acc)) {
-    MajorantTransmittanceSampler sampler(*maj_iter, rng, vol.grids().density(), density_acc, sigma_t);
+  if (auto maj_iter = vol.intersect<BuildT>(r, density_acc)) {
+    MajorantTransmittanceSampler<BuildT> sampler(*maj_iter, rng, vol.grids().density<BuildT>(), density_acc, sigma_t, vol.leaf_pager());
 
     while (auto props = sampler.next()) {
       float sigma_n = std::max(0.0f, props->sigma_maj - sigma_t * props->density);
 
       T_ray *= sigma_n / props->sigma_maj;
 
-      if (T_ray <= 0.05f) {
-        float q = 0.75f;
-        if (rng.uniform<float>() < q) {
-          T_ray = 0.0f;
-        } else {
-          T_ray /= 1 - q;
-        }
+      roulette_transmittance(rng, T_ray);
+      if (T_ray <= 0.0f) {
+        return 0.0f;
       }
+    }
+  }
+
+  return T_ray;
+}
+
+/*
+Residual ratio tracking (Novak et al. 2014): in each segment the minorant acts as control density.
+Its transmittance is computed analytically, and only the residual density is tracked, against the residual majorant d_maj - d_min.
+*/
+template <typename BuildT>
+static float residual_ratio_tracking(const Volume& vol, RandomNumberGenerator& rng, const Ray& r, const typename GridTypes<BuildT>::AccessorT& density_acc) {
+  float sigma_t = vol.params().sigma_a + vol.params().sigma_s;
+
+  auto maj_iter = vol.intersect<BuildT>(r, density_acc);
+  if (not maj_iter)
+    return 1.0f;
 
+  DensitySampler<BuildT> density_sampler(density_acc, vol.leaf_pager());
+
+  float T_ray = 1.0f;
+  while (auto segment = maj_iter->next()) {
+    if (segment->d_maj <= 0.0f)
+      continue;
+
+    // Control
+    float dt_segment = (segment->t1 - segment->t0) * maj_iter->idx_to_world_scale();
+    T_ray *= std::exp(-sigma_t * segment->d_min * dt_segment);
+
+    // Residual
+    float sigma_r = sigma_t * (segment->d_maj - segment->d_min);
+    if (sigma_r <= 0.0f)
+      continue;
+
+    float t = segment->t0;
+    while (true) {
+      t += sample_exponential(rng.uniform<float>(), sigma_r) / maj_iter->idx_to_world_scale();
+      if (t >= segment->t1)
+        break;
+
+      float density = density_sampler(maj_iter->ray()(t));
+      T_ray *= std::max(0.0f, 1.0f - (density - segment->d_min) / (segment->d_maj - segment->d_min));
+
+      roulette_transmittance(rng, T_ray);
       if (T_ray <= 0.0f) {
-        return Eigen::Vector3f::Zero();
+        return 0.0f;
       }
     }
   }
 
+  return T_ray;
+}
+
+template <typename BuildT>
+float estimate_transmittance(const ShadowParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Ray& r, const typename GridTypes<BuildT>::AccessorT& density_acc) {
+  switch (params.estimator) {
+    case ShadowParameters::Estimator::RatioTracking:
+      return ratio_tracking<BuildT>(vol, rng, r, density_acc);
+    case ShadowParameters::Estimator::ResidualRatioTracking:
+      return residual_ratio_tracking<BuildT>(vol, rng, r, density_acc);
+  }
+
+  std::unreachable();
+}
+
+template <typename BuildT>
+float shadow_transmittance(const ShadowParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Eigen::Vector3f& pos, const Eigen::Vector3f& wi, const typename GridTypes<BuildT>::AccessorT& density_acc) {
+  if (const TransmittanceGrid* grid = vol.transmittance_grid())
+    return grid->transmittance(pos);
+
+  // Trace the shadow ray to estimate transmittance
+  return estimate_transmittance<BuildT>(params, vol, rng, Ray(pos, wi), density_acc);
+}
+
+template <typename BuildT>
+Eigen::Vector3f sample_Ld(const WorkerParameters& params, const Volume& vol, RandomNumberGenerator& rng, const Eigen::Vector3f& pos, const Eigen::Vector3f& w, const typename GridTypes<BuildT>::AccessorT& density_acc) {
+  // Only one distant light
+  Eigen::Vector3f wi = params.distant_light.inv_direction.normalized();
+  Eigen::Vector3f Li = params.distant_light.xyz * params.distant_light.multiplier;
+
+  if (Li == Eigen::Vector3f::Zero())
+    return Li;
+
+  float T_ray = shadow_transmittance<BuildT>(params.shadows, vol, rng, pos, wi, density_acc);
+  if (T_ray <= 0.0f)
+    return Eigen::Vector3f::Zero();
+
   float p = henyey_greenstein(w.dot(wi), vol.params().henyey_greenstein_g);
   return p * T_ray * Li;
 }
 
-void run(const WorkerParameters& params, const Volume& vol, const Camera& camera, TileProvider& tp, Image<float, 4>& m_film, RandomNumberGenerator rng) {
-  auto density_acc = vol.grids().density().getAccessor();
+void finish_tile(const AdaptiveSamplingParameters& params, Film& film, TileProvider::token& tok, const image_rect_t& rect) {
+  film.mark_dirty(rect);
 
-  std::optional<VolumeGrids::AccessorT> temp_accessor;
-  std::optional<nanovdb::math::SampleFromVoxels<VolumeGrids::AccessorT, 1>> temp_sampler; 
-  if (vol.grids().has_temperature()) {
-    temp_accessor = vol.grids().temperature().getAccessor();
-    temp_sampler.emplace(*temp_accessor);
-  }
+  if (tok.preview_block() > 1)
+    return;
+
+  if (not params.enabled or tok.wave() < params.min_waves)
+    return;
+
+  if (film.relative_error(rect) < params.relative_error)
+    tok.mark_converged();
+}
+
+template <typename BuildT>
+static void run_megakernel(const WorkerParameters& params, const Volume& vol, std::span<const View> views, TileProvider& tp, TileProvider::worker_index_t worker_idx, RandomNumberGenerator rng) {
+  auto density_acc = vol.grids().density<BuildT>().getAccessor();
+
+  std::optional<TemperatureSampler> temp_sampler;
+  if (vol.grids().has_temperature())
+    temp_sampler.emplace(vol.grids(), vol.leaf_pager());
 
   Logger<false> logger;
 
-  while (auto tok = tp.next()) {
+  while (auto tok = tp.next(worker_idx)) {
     image_rect_t rect = tok.compute_rect();
+    const Camera& camera = views[tok.view()].camera;
+    Film& film = views[tok.view()].film;
     
     rng.begin_job(tok.jid());
 
-    for (image_index_t y = 0; y < rect.size.y(); ++y) {
-      for (image_index_t x = 0; x < rect.size.x(); ++x) {
-        image_point_t pt = rect.start + image_point_t { x, y };
+    // One path per pixel - or, in a preview level, per block of pixels, through its centre
+    image_index_t block = tok.preview_block();
+
+    for (image_index_t y = 0; y < rect.size.y(); y += block) {
+      for (image_index_t x = 0; x < rect.size.x(); x += block) {
+        image_rect_t block_rect = preview_block_rect(rect, rect.start + image_point_t { x, y }, block);
+        image_point_t pt = block_rect.start + block_rect.size / 2;
 
         if (params.single_pixel.enabled) {
           if (params.single_pixel.coord != pt) {
@@ -130,17 +222,18 @@ void run(const WorkerParameters& params, const Volume& vol, const Camera& camera
         for (unsigned int depth = 0; depth < params.max_depth; ++depth) {
           bool scattered = false;
 
-          auto intersection = vol.intersect(r, density_acc);
+          auto intersection = vol.intersect<BuildT>(r, density_acc);
           if (not intersection)
             break;
           
           // Sample on the current ray
-          MajorantTransmittanceSampler sampler(
+          MajorantTransmittanceSampler<BuildT> sampler(
             *intersection,
             rng,
-            vol.grids().density(),
+            vol.grids().density<BuildT>(),
             density_acc,
-            vol.params().sigma_a + vol.params().sigma_s
+            vol.params().sigma_a + vol.params().sigma_s,
+            vol.leaf_pager()
           );
           while (auto props = sampler.next()) {
             logger.sampled_point(*props);
@@ -172,7 +265,7 @@ void run(const WorkerParameters& params, const Volume& vol, const Camera& camera
                 break;
               }
 
-              L += sample_Ld(params, vol, rng, props->point, r.direction(), density_acc);
+              L += sample_Ld<BuildT>(params, vol, rng, props->point, r.direction(), density_acc);
               
               // Evaluate phase function and compute new ray
               Eigen::Vector3f new_dir = sample_henyey_greenstein(r.direction(), { rng.uniform<float>(), rng.uniform<float>() }, vol.params().henyey_greenstein_g);
@@ -200,11 +293,38 @@ void run(const WorkerParameters& params, const Volume& vol, const Camera& camera
         }
         
         // add to the film
-        m_film.data()(pt.y(), pt.x()).w() += 1.0f;
-        m_film.data()(pt.y(), pt.x()).topRows<3>() += camera.params().imaging_ratio * L;
+        if (block > 1)
+          film.add_preview_sample(block_rect, camera.params().imaging_ratio * L);
+        else
+          film.add_sample(pt, camera.params().imaging_ratio * L);
       }
     }
+
+    finish_tile(params.adaptive_sampling, film, tok, rect);
   }
 }
 
+void run(const WorkerParameters& params, const Volume& vol, std::span<const View> views, TileProvider& tp, TileProvider::worker_index_t worker_idx, RandomNumberGenerator rng) {
+  // Dispatch once, so that the whole render loop is compiled for the build type of the density grid
+  vol.grids().visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>&) {
+    switch (params.engine) {
+      case WorkerParameters::Engine::Megakernel:
+        run_megakernel<BuildT>(params, vol, views, tp, worker_idx, rng);
+        return;
+      case WorkerParameters::Engine::Wavefront:
+        run_wavefront<BuildT>(params, vol, views, tp, worker_idx, rng);
+        return;
+    }
+
+    std::unreachable();
+  });
+}
+
+#define VPT_INSTANTIATE(BuildT) \
+  template float estimate_transmittance<BuildT>(const ShadowParameters&, const Volume&, RandomNumberGenerator&, const Ray&, const typename GridTypes<BuildT>::AccessorT&); \
+  template float shadow_transmittance<BuildT>(const ShadowParameters&, const Volume&, RandomNumberGenerator&, const Eigen::Vector3f&, const Eigen::Vector3f&, const typename GridTypes<BuildT>::AccessorT&); \
+  template Eigen::Vector3f sample_Ld<BuildT>(const WorkerParameters&, const Volume&, RandomNumberGenerator&, const Eigen::Vector3f&, const Eigen::Vector3f&, const typename GridTypes<BuildT>::AccessorT&);
+VPT_FOR_EACH_DENSITY_BUILD_TYPE(VPT_INSTANTIATE)
+#undef VPT_INSTANTIATE
+
 } // namespace vpt
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include <vpt/worker_pool.hpp>
+
+namespace vpt {
+
+WorkerPool::WorkerPool(unsigned int num_workers) {
+  // Until the first task is started, there's nothing to wait for
+  m_done = num_workers;
+
+  for (unsigned int i = 0; i < num_workers; ++i)
+    m_threads.emplace_back([this, i]() { work(i); });
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard lock(m_mtx);
+    m_stop = true;
+  }
+  m_cv.notify_all();
+}
+
+void WorkerPool::start(Task task) {
+  {
+    std::lock_guard lock(m_mtx);
+    m_task = std::move(task);
+    m_done = 0;
+    ++m_generation;
+  }
+  m_cv.notify_all();
+}
+
+bool WorkerPool::wait_for(std::chrono::milliseconds timeout) {
+  std::unique_lock lock(m_mtx);
+  return m_cv.wait_for(lock, timeout, [&]() { return m_done == m_threads.size(); });
+}
+
+void WorkerPool::work(TileProvider::worker_index_t worker_idx) {
+  uint64_t generation = 0;
+
+  std::unique_lock lock(m_mtx);
+  while (true) {
+    m_cv.wait(lock, [&]() { return m_stop or m_generation != generation; });
+    if (m_stop)
+      return;
+
+    generation = m_generation;
+    Task task = m_task;
+
+    lock.unlock();
+    run(*task.params, *task.vol, task.views, *task.tp, worker_idx, RandomNumberGenerator(task.seed));
+    task.state.reset();
+    lock.lock();
+
+    // Only the task of the current generation counts - a newer one may have been started meanwhile
+    if (generation == m_generation and ++m_done == m_threads.size())
+      m_cv.notify_all();
+  }
+}
+
+} // namespace vpt
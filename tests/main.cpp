@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <string_view>
+
+#include "tests.hpp"
+
+namespace {
+
+struct Test {
+  std::string_view name;
+  std::function<bool(const vpt::Configuration&)> fn;
+};
+
+const Test TESTS[] = {
+  { "wave_ranges", vpt::tests::test_wave_ranges },
+  { "resume", vpt::tests::test_resume },
+  { "density_sampler", vpt::tests::test_density_sampler },
+  { "time_budget", vpt::tests::test_time_budget },
+  { "leaf_pager", vpt::tests::test_leaf_pager },
+  { "wavefront", vpt::tests::test_wavefront },
+};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::clog << "Usage: " << argv[0] << " test_name scene_path\nTests:";
+    for (const Test& test : TESTS)
+      std::clog << ' ' << test.name;
+    std::clog << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto it = std::ranges::find(TESTS, std::string_view(argv[1]), &Test::name);
+  if (it == std::end(TESTS))
+    vptFATAL("No such test: " << argv[1]);
+
+  vpt::Configuration cfg = vpt::tests::test_configuration(argv[2]);
+
+  if (not it->fn(cfg)) {
+    vptWARN(it->name << ": FAILED");
+    return EXIT_FAILURE;
+  }
+
+  vptINFO(it->name << ": passed");
+  return EXIT_SUCCESS;
+}
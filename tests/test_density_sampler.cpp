@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-private-field"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include <nanovdb/tools/GridBuilder.h>
+#include <nanovdb/tools/CreateNanoGrid.h>
+#pragma GCC diagnostic pop
+
+#include <vpt/density_sampler.hpp>
+#include <vpt/random.hpp>
+#include <vpt/utils.hpp>
+
+#include "tests.hpp"
+
+/*
+The density sampler reads the stencils from the pinned leaves, and only falls back to the NanoVDB trilinear sampler when they need other voxels.
+It must interpolate the same values as the NanoVDB sampler everywhere, whatever the encoding of the grid, and with or without the AVX2 path of the batches.
+The grid is a block of leaves of random values, with a hole, so that the stencils cross into present and missing neighbours along each axis.
+*/
+
+namespace vpt::tests {
+
+using CoordT = nanovdb::math::Coord;
+
+static constexpr int LEAF_DIM = GridTypes<float>::LeafT::DIM;
+
+// The block is made of the leaves with origins in [-1, 2)^3 * LEAF_DIM, except the one at HOLE
+static constexpr int BLOCK_BEGIN = -LEAF_DIM;
+static constexpr int BLOCK_END = 2 * LEAF_DIM;
+static const CoordT HOLE(LEAF_DIM, 0, 0);
+
+static VolumeGrids noise_grids(RandomNumberGenerator& rng) {
+  nanovdb::tools::build::Grid<float> grid(0.0f, "density", nanovdb::GridClass::FogVolume);
+  auto acc = grid.getAccessor();
+
+  for (int i = BLOCK_BEGIN; i < BLOCK_END; ++i) {
+    for (int j = BLOCK_BEGIN; j < BLOCK_END; ++j) {
+      for (int k = BLOCK_BEGIN; k < BLOCK_END; ++k) {
+        CoordT ijk(i, j, k);
+        if ((ijk & ~(LEAF_DIM - 1)) != HOLE)
+          acc.setValue(ijk, rng.uniform<float>());
+      }
+    }
+  }
+
+  // With the leaf statistics, as the renderer needs them
+  return VolumeGrids(nanovdb::tools::createNanoGrid(grid, nanovdb::tools::StatsMode::All));
+}
+
+/**
+  @return Points whose stencils are in the middle of the leaves, on their faces, edges and corners,
+  and so read the voxels of their +x, +y and +z neighbours, and of the neighbours of those.
+*/
+static std::vector<nanovdb::Vec3f> boundary_points(RandomNumberGenerator& rng) {
+  constexpr int LOCAL[] = { 0, 3, LEAF_DIM - 2, LEAF_DIM - 1 };
+
+  std::vector<nanovdb::Vec3f> ans;
+  for (int x = BLOCK_BEGIN - LEAF_DIM; x < BLOCK_END; x += LEAF_DIM) {
+    for (int y = BLOCK_BEGIN - LEAF_DIM; y < BLOCK_END; y += LEAF_DIM) {
+      for (int z = BLOCK_BEGIN - LEAF_DIM; z < BLOCK_END; z += LEAF_DIM) {
+        for (int a : LOCAL) {
+          for (int b : LOCAL) {
+            for (int c : LOCAL) {
+              // On the voxel itself, and anywhere in the stencil
+              ans.emplace_back(static_cast<float>(x + a), static_cast<float>(y + b), static_cast<float>(z + c));
+              ans.emplace_back(static_cast<float>(x + a) + rng.uniform<float>(), static_cast<float>(y + b) + rng.uniform<float>(), static_cast<float>(z + c) + rng.uniform<float>());
+            }
+          }
+        }
+      }
+    }
+  }
+
+  return ans;
+}
+
+/** @return Points spaced along random rays through the block, as the renderer looks them up: mostly several in a row in the same leaf. */
+static std::vector<nanovdb::Vec3f> ray_points(RandomNumberGenerator& rng, size_t num_points) {
+  constexpr float SIZE = static_cast<float>(BLOCK_END - BLOCK_BEGIN);
+
+  auto random_point = [&]() {
+    return nanovdb::Vec3f(
+      static_cast<float>(BLOCK_BEGIN) + SIZE * rng.uniform<float>(),
+      static_cast<float>(BLOCK_BEGIN) + SIZE * rng.uniform<float>(),
+      static_cast<float>(BLOCK_BEGIN) + SIZE * rng.uniform<float>()
+    );
+  };
+
+  std::vector<nanovdb::Vec3f> ans;
+  while (ans.size() < num_points) {
+    nanovdb::Vec3f start = random_point();
+    nanovdb::Vec3f dir = random_point() - start;
+    float length = dir.length();
+    if (length < 1.0f)
+      continue;
+    dir = dir * (1.0f / length);
+
+    for (float t = 0.0f; t < length and ans.size() < num_points; t += 0.5f * rng.uniform<float>())
+      ans.push_back(start + dir * t);
+  }
+
+  return ans;
+}
+
+static std::string to_string(const nanovdb::Vec3f& p) {
+  std::ostringstream os;
+  os << '(' << p[0] << ", " << p[1] << ", " << p[2] << ')';
+  return os.str();
+}
+
+/** @return Whether the sampler gives the same densities as the NanoVDB one, looking up the points one at a time and in a batch. */
+template <typename BuildT>
+static bool check_sampler(const nanovdb::NanoGrid<BuildT>& grid, std::span<const nanovdb::Vec3f> points) {
+  auto acc = grid.getAccessor();
+  nanovdb::math::SampleFromVoxels<decltype(acc), 1> reference(acc);
+
+  std::vector<float> expected(points.size());
+  for (size_t i = 0; i < points.size(); ++i)
+    expected[i] = reference(points[i]);
+
+  auto close = [](float a, float b) { return std::abs(a - b) <= 1e-5f * std::max(1.0f, std::abs(b)); };
+
+  {
+    DensitySampler<BuildT> sampler(acc);
+    for (size_t i = 0; i < points.size(); ++i) {
+      float density = sampler(points[i]);
+      vptCHECK(close(density, expected[i]), "the density at " << to_string(points[i]) << " is " << density << " instead of " << expected[i]);
+    }
+  }
+
+  {
+    DensitySampler<BuildT> sampler(acc);
+    std::vector<float> densities(points.size());
+    sampler(points, densities);
+
+    for (size_t i = 0; i < points.size(); ++i)
+      vptCHECK(close(densities[i], expected[i]), "the density at " << to_string(points[i]) << " is " << densities[i] << " in a batch instead of " << expected[i]);
+  }
+
+  return true;
+}
+
+/** @brief Log how much faster the sampler looks up the points than the NanoVDB one, one at a time and in batches as the transmittance sampler does. */
+template <typename BuildT>
+static void log_speedup(const char* encoding, const nanovdb::NanoGrid<BuildT>& grid, std::span<const nanovdb::Vec3f> points) {
+  constexpr int REPETITIONS = 16;
+  constexpr size_t BATCH_SIZE = 16;
+
+  auto acc = grid.getAccessor();
+  std::vector<float> out(points.size());
+
+  auto time_s = [&](auto&& f) {
+    f(); // Warm up
+    Stopwatch sw;
+    for (int r = 0; r < REPETITIONS; ++r)
+      f();
+    return static_cast<double>(sw.elapsed_ms()) / 1000.0;
+  };
+
+  double reference_s = time_s([&]() {
+    nanovdb::math::SampleFromVoxels<decltype(acc), 1> reference(acc);
+    for (size_t i = 0; i < points.size(); ++i)
+      out[i] = reference(points[i]);
+  });
+
+  double single_s = time_s([&]() {
+    DensitySampler<BuildT> sampler(acc);
+    for (size_t i = 0; i < points.size(); ++i)
+      out[i] = sampler(points[i]);
+  });
+
+  double batched_s = time_s([&]() {
+    DensitySampler<BuildT> sampler(acc);
+    for (size_t i = 0; i < points.size(); i += BATCH_SIZE) {
+      size_t n = std::min(BATCH_SIZE, points.size() - i);
+      sampler(points.subspan(i, n), std::span<float>(out).subspan(i, n));
+    }
+  });
+
+  vptINFO(encoding << ": " << reference_s / single_s << "x as fast as SampleFromVoxels one point at a time, " << reference_s / batched_s << "x in batches of " << BATCH_SIZE);
+}
+
+bool test_density_sampler(const Configuration& cfg) {
+  RandomNumberGenerator rng(cfg.seed);
+  rng.begin_job(0);
+
+  VolumeGrids grids = noise_grids(rng);
+  std::vector<nanovdb::Vec3f> boundary = boundary_points(rng);
+  std::vector<nanovdb::Vec3f> rays = ray_points(rng, 1 << 18);
+
+  struct Encoding {
+    const char* name;
+    nanovdb::GridType type;
+  };
+
+  const Encoding encodings[] = {
+    { "float", nanovdb::GridType::Float },
+    { "fp16", nanovdb::GridType::Fp16 },
+    { "fp8", nanovdb::GridType::Fp8 },
+  };
+
+  for (const Encoding& encoding : encodings) {
+    VolumeGrids encoded = grids.reencoded(encoding.type);
+
+    bool ok = encoded.visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>& grid) {
+      vptCHECK(check_sampler(grid, boundary), encoding.name << ": the densities differ on the leaf boundaries");
+      vptCHECK(check_sampler(grid, rays), encoding.name << ": the densities differ along the rays");
+
+      log_speedup(encoding.name, grid, rays);
+      return true;
+    });
+
+    if (not ok)
+      return false;
+  }
+
+  return true;
+}
+
+} // namespace vpt::tests
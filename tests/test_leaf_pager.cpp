@@ -0,0 +1,109 @@
+#include <cmath>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-private-field"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include <nanovdb/tools/GridBuilder.h>
+#include <nanovdb/tools/CreateNanoGrid.h>
+#include <nanovdb/io/IO.h>
+#pragma GCC diagnostic pop
+
+#include <vpt/density_sampler.hpp>
+
+#include "tests.hpp"
+
+/*
+With the leaves paged, the leaves mapped in the process must stay within the budget, whatever reads them.
+The volume is a cube of leaves several times the budget, written to a file and mapped. It is rendered, then looked up on the edges and corners
+of all its leaves, whose stencils need leaves the density sampler doesn't pin. The mapped leaves are measured in the page tables after each.
+*/
+
+namespace vpt::tests {
+
+static constexpr int LEAF_DIM = GridTypes<float>::LeafT::DIM;
+
+// About 16 MiB of float leaves, around the origin which the camera looks at
+static constexpr int CUBE_LEAVES = 20;
+static constexpr int CUBE_BEGIN = -CUBE_LEAVES / 2 * LEAF_DIM;
+static constexpr int CUBE_END = CUBE_LEAVES / 2 * LEAF_DIM;
+
+static constexpr size_t BUDGET_BYTES = size_t(4) << 20;
+
+static void write_cube(const std::filesystem::path& path) {
+  nanovdb::tools::build::Grid<float> grid(0.0f, "density", nanovdb::GridClass::FogVolume);
+  auto acc = grid.getAccessor();
+
+  // Varying, so that the majorants don't skip over the whole cube
+  for (int i = CUBE_BEGIN; i < CUBE_END; ++i)
+    for (int j = CUBE_BEGIN; j < CUBE_END; ++j)
+      for (int k = CUBE_BEGIN; k < CUBE_END; ++k)
+        acc.setValue(nanovdb::math::Coord(i, j, k), 0.5f + 0.5f * std::sin(0.1f * static_cast<float>(i + 2 * j + 3 * k)));
+
+  nanovdb::io::writeGrid(path.string(), nanovdb::tools::createNanoGrid(grid, nanovdb::tools::StatsMode::All));
+}
+
+static bool check_within_budget(const LeafPager& pager, const char* after) {
+  LeafPager::Stats stats = pager.stats();
+  vptINFO("After " << after << ": " << (stats.mapped_bytes >> 10) << " KiB of leaves mapped, " << (stats.resident_bytes >> 10) << " KiB accounted for, "
+    << stats.misses << " misses, " << stats.evictions << " evictions, " << stats.adopted << " blocks adopted");
+
+  // The last reads of the workers may fault pages back into blocks being evicted, until the next faults find them
+  constexpr size_t SLACK_BYTES = size_t(1) << 20;
+
+  vptCHECK(stats.resident_bytes <= stats.budget_bytes, after << ": " << stats.resident_bytes << " bytes resident for a budget of " << stats.budget_bytes);
+  vptCHECK(stats.mapped_bytes <= stats.budget_bytes + SLACK_BYTES, after << ": " << stats.mapped_bytes << " bytes mapped for a budget of " << stats.budget_bytes);
+  return true;
+}
+
+bool test_leaf_pager(const Configuration& cfg) {
+  std::filesystem::path dir = temp_directory("leaf_pager");
+  std::filesystem::path path = dir / "cube.nvdb";
+  write_cube(path);
+
+  // The file is mapped in place, or copied and saved aligned the first time - then the aligned copy is mapped
+  VolumeLoading loading { .mmap = true, .aligned_cache = true, .populate = false, .huge_pages = false, .leaf_cache_mib = 0 };
+  VolumeGrids::read_from_file(path, loading);
+  VolumeGrids grids = VolumeGrids::read_from_file(path, loading);
+  vptCHECK(grids.is_mapped(), "the grids of " << path << " are not mapped");
+
+  Volume vol(grids, cfg.volume_parameters, cfg.num_workers);
+  vol.precompute_shadows(cfg.worker_parameters, cfg.num_workers);
+  vptCHECK(vol.page_leaves(BUDGET_BYTES), "the leaves are not paged");
+  const LeafPager& pager = *vol.leaf_pager();
+
+  Camera camera(cfg.camera_parameters, cfg.output_size);
+  TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+  Film film(cfg.output_size);
+  render(cfg, vol, camera, provider, film);
+
+  if (not check_within_budget(pager, "the render"))
+    return false;
+
+  // Every stencil here reads the leaves across an edge or a corner, so none of them are served by the pinned leaves
+  grids.visit_density([&]<typename BuildT>(const nanovdb::NanoGrid<BuildT>& grid) {
+    auto acc = grid.getAccessor();
+    DensitySampler<BuildT> sampler(acc, &pager);
+
+    constexpr float EDGE = static_cast<float>(LEAF_DIM) - 0.5f;
+    for (int x = CUBE_BEGIN; x < CUBE_END; x += LEAF_DIM) {
+      for (int y = CUBE_BEGIN; y < CUBE_END; y += LEAF_DIM) {
+        for (int z = CUBE_BEGIN; z < CUBE_END; z += LEAF_DIM) {
+          nanovdb::Vec3f origin(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z));
+          sampler(origin + nanovdb::Vec3f(EDGE, EDGE, 0.5f));
+          sampler(origin + nanovdb::Vec3f(EDGE, 0.5f, EDGE));
+          sampler(origin + nanovdb::Vec3f(0.5f, EDGE, EDGE));
+          sampler(origin + nanovdb::Vec3f(EDGE, EDGE, EDGE));
+        }
+      }
+    }
+  });
+
+  bool ok = check_within_budget(pager, "the edge lookups");
+  std::filesystem::remove_all(dir);
+  return ok;
+}
+
+} // namespace vpt::tests
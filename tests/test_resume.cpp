@@ -0,0 +1,57 @@
+#include <vpt/checkpoint.hpp>
+
+#include "tests.hpp"
+
+/*
+A render interrupted at a checkpoint and resumed from it (as by vpt --resume) must give the same film, bit for bit, as an uninterrupted one.
+*/
+
+namespace vpt::tests {
+
+bool test_resume(const Configuration& cfg) {
+  TestVolume volume(cfg);
+  Camera camera(cfg.camera_parameters, cfg.output_size);
+
+  Film reference(cfg.output_size);
+  {
+    TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+    render(cfg, volume.vol, camera, provider, reference);
+  }
+
+  std::filesystem::path dir = temp_directory("resume");
+  std::filesystem::path path = dir / "render.vptckpt";
+  const unsigned int period = cfg.num_waves / 3;
+
+  // Stopped right after the first checkpoint, as if the process was killed
+  {
+    Film film(cfg.output_size);
+    TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+
+    bool saved = false;
+    provider.set_checkpoint(period, [&](std::span<const TileProvider::tile_state> tiles) {
+      saved = Checkpoint { cfg.seed, render_hash(cfg), { tiles.begin(), tiles.end() } }.save(path, film);
+      provider.stop_now();
+    });
+
+    render(cfg, volume.vol, camera, provider, film);
+    vptCHECK(saved, "the checkpoint was not saved to " << path);
+  }
+
+  Film film(cfg.output_size);
+  std::optional<Checkpoint> ckpt = Checkpoint::load(path, film);
+  std::filesystem::remove_all(dir);
+
+  vptCHECK(ckpt, "can't load " << path);
+  vptCHECK(ckpt->seed == cfg.seed and ckpt->config_hash == render_hash(cfg), "the checkpoint belongs to another render");
+  for (const TileProvider::tile_state& tile : ckpt->tiles)
+    vptCHECK(tile.wave == period and not tile.converged, "a tile was checkpointed at wave " << tile.wave << " instead of " << period);
+
+  TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+  provider.restore(ckpt->tiles);
+  render(cfg, volume.vol, camera, provider, film);
+
+  vptCHECK(same_film(film, reference), "the resumed film differs from the uninterrupted one");
+  return true;
+}
+
+} // namespace vpt::tests
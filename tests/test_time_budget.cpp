@@ -0,0 +1,46 @@
+#include <thread>
+
+#include "tests.hpp"
+
+/*
+A time budget which leaves room for all the waves must not stop the render early.
+The workers don't render, they sleep for each job - so the time a job takes is known, and they run in parallel whatever the number of cores.
+The tiles go to their next wave independently, so the second wave is decided when a single job is done: going by the jobs done over the elapsed time,
+which ignores those of the other workers in flight, the budget below would look too short for it.
+*/
+
+namespace vpt::tests {
+
+bool test_time_budget(const Configuration&) {
+  constexpr unsigned int NUM_WORKERS = 8;
+  constexpr unsigned int NUM_WAVES = 2;
+
+  // One worker is faster than the others, so that the first job is done well before the next ones
+  auto job_time = [](unsigned int worker_idx) { return std::chrono::milliseconds(worker_idx == 0 ? 10 : 30); };
+
+  // 16 tiles, so 32 jobs: about 130 ms with all the workers (1/10 + 7/30 jobs per ms, and the last ones), 320 ms at one job per 10 ms
+  const image_size_t size(32, 32);
+  const image_size_t tile_size(8, 8);
+  const std::chrono::duration<float> time_limit(0.25f);
+
+  TileProvider provider(size, NUM_WAVES, tile_size, NUM_WORKERS);
+  provider.reset_eta();
+  provider.set_time_budget(time_limit, 0.0f);
+
+  {
+    std::vector<std::jthread> threads;
+    for (unsigned int i = 0; i < NUM_WORKERS; ++i) {
+      threads.emplace_back([&, i]() {
+        while (auto tok = provider.next(i))
+          std::this_thread::sleep_for(job_time(i));
+      });
+    }
+  }
+
+  for (const TileProvider::tile_state& tile : provider.tile_states())
+    vptCHECK(tile.wave == NUM_WAVES, "a tile stopped at wave " << tile.wave << " of " << NUM_WAVES << " within a budget of " << time_limit.count() << " s");
+
+  return true;
+}
+
+} // namespace vpt::tests
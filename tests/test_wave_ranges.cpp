@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cmath>
+
+#include "tests.hpp"
+
+/*
+A render split into wave ranges, each of them saved as a film and merged (as by vpt --waves and vpt_merge), must match the render of all the waves at once.
+The sample counts must be exact. The sums only up to the rounding, as they are added in a different order.
+The ranges are merged out of order, as vpt_merge may be given them. Overlapping ranges must be refused, and missing waves reported.
+*/
+
+namespace vpt::tests {
+
+/** @return The film of the waves [begin, end), rendered as vpt --waves does: as if the earlier waves were done. */
+static Film render_waves(const Configuration& cfg, const Volume& vol, const Camera& camera, unsigned int begin, unsigned int end) {
+  TileProvider provider(cfg.output_size, end, cfg.tile_size, cfg.num_workers);
+
+  std::vector<TileProvider::tile_state> tiles = provider.tile_states();
+  std::ranges::fill(tiles, TileProvider::tile_state { begin, false });
+  provider.restore(tiles);
+
+  Film film(cfg.output_size);
+  render(cfg, vol, camera, provider, film);
+  return film;
+}
+
+/** @return Whether the merger accepts films of the same render with the specified wave ranges, and if so whether it finds them contiguous. */
+static std::optional<bool> merge_ranges(const Configuration& cfg, std::span<const std::pair<unsigned int, unsigned int>> ranges) {
+  FilmMerger merger;
+  for (auto [begin, end] : ranges)
+    merger.add("range" + std::to_string(begin), FilmInfo { cfg.seed, render_hash(cfg), begin, end }, Film(cfg.output_size));
+
+  std::optional<FilmMerger::Result> merged = merger.finish();
+  if (not merged)
+    return std::nullopt;
+  return merged->contiguous;
+}
+
+static bool check_range_checks(const Configuration& cfg) {
+  const std::pair<unsigned int, unsigned int> overlapping[] = { { 4, 8 }, { 0, 5 } };
+  vptCHECK(not merge_ranges(cfg, overlapping), "the overlapping waves [0, 5) and [4, 8) were merged");
+
+  const std::pair<unsigned int, unsigned int> same[] = { { 0, 4 }, { 0, 4 } };
+  vptCHECK(not merge_ranges(cfg, same), "the waves [0, 4) were merged twice");
+
+  const std::pair<unsigned int, unsigned int> gap[] = { { 6, 8 }, { 0, 4 } };
+  std::optional<bool> contiguous = merge_ranges(cfg, gap);
+  vptCHECK(contiguous and not *contiguous, "the waves [0, 4) and [6, 8) were " << (contiguous ? "found contiguous" : "refused"));
+
+  FilmMerger merger;
+  vptCHECK(merger.add("a", FilmInfo { cfg.seed, render_hash(cfg), 0, 4 }, Film(cfg.output_size)), "the first film was refused");
+  vptCHECK(not merger.add("b", FilmInfo { cfg.seed + 1, render_hash(cfg), 4, 8 }, Film(cfg.output_size)), "a film with another seed was merged");
+  vptCHECK(not merger.add("c", FilmInfo { cfg.seed, render_hash(cfg), 4, 8 }, Film(cfg.output_size + image_size_t(1, 1))), "a film of another size was merged");
+  return true;
+}
+
+bool test_wave_ranges(const Configuration& cfg) {
+  if (not check_range_checks(cfg))
+    return false;
+
+  TestVolume volume(cfg);
+  Camera camera(cfg.camera_parameters, cfg.output_size);
+
+  const unsigned int split1 = cfg.num_waves / 3;
+  const unsigned int split2 = 2 * cfg.num_waves / 3;
+  Film full = render_waves(cfg, volume.vol, camera, 0, cfg.num_waves);
+
+  std::filesystem::path dir = temp_directory("wave_ranges");
+  const std::pair<unsigned int, unsigned int> ranges[] = { { split2, cfg.num_waves }, { 0, split1 }, { split1, split2 } };
+
+  FilmMerger merger;
+  for (auto [begin, end] : ranges) {
+    std::filesystem::path path = dir / ("part" + std::to_string(begin) + ".vptfilm");
+    Film part = render_waves(cfg, volume.vol, camera, begin, end);
+    vptCHECK(save_film(path, FilmInfo { cfg.seed, render_hash(cfg), begin, end }, part), "can't save " << path);
+
+    FilmInfo info;
+    std::optional<Film> loaded = load_film(path, info);
+    vptCHECK(loaded, "can't load " << path);
+    vptCHECK(info.wave_begin == begin and info.wave_end == end, "the film of " << path << " has waves [" << info.wave_begin << ", " << info.wave_end << ")");
+    vptCHECK(same_film(*loaded, part), "the film of " << path << " changed when saved and loaded");
+
+    vptCHECK(merger.add(path, info, std::move(*loaded)), path << " was not merged");
+  }
+
+  std::filesystem::remove_all(dir);
+
+  std::optional<FilmMerger::Result> merged = merger.finish();
+  vptCHECK(merged, "the ranges were not merged");
+  vptCHECK(merged->contiguous, "the ranges were not found contiguous");
+  vptCHECK(merged->info.wave_begin == 0 and merged->info.wave_end == cfg.num_waves, "the merged film has waves [" << merged->info.wave_begin << ", " << merged->info.wave_end << ")");
+
+  const auto& a = merged->film.radiance().data();
+  const auto& b = full.radiance().data();
+  double luminance = 0.0;
+
+  for (image_index_t y = 0; y < full.size().y(); ++y) {
+    for (image_index_t x = 0; x < full.size().x(); ++x) {
+      vptCHECK(a(y, x).w() == b(y, x).w() and b(y, x).w() == static_cast<float>(cfg.num_waves), "pixel (" << x << ", " << y << ") has " << a(y, x).w() << " samples merged, " << b(y, x).w() << " in one go");
+
+      for (int c = 0; c < 3; ++c) {
+        float tolerance = 1e-5f * std::abs(b(y, x)[c]) + 1e-6f;
+        vptCHECK(std::abs(a(y, x)[c] - b(y, x)[c]) <= tolerance, "pixel (" << x << ", " << y << ") has " << a(y, x).transpose() << " merged, " << b(y, x).transpose() << " in one go");
+      }
+
+      luminance += b(y, x).y();
+    }
+  }
+
+  // Or the test would not show much
+  vptCHECK(luminance > 0.0, "the image is black");
+  return true;
+}
+
+} // namespace vpt::tests
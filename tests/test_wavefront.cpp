@@ -0,0 +1,34 @@
+#include <algorithm>
+
+#include "tests.hpp"
+
+/*
+The wavefront engine renders several tiles per batch, each with the random numbers of its own job - so the film must not depend on which tiles are batched together.
+One worker takes its tiles in order, several workers take and steal them in different batches: both must give the same film, bit for bit.
+*/
+
+namespace vpt::tests {
+
+static Film render_wavefront(Configuration cfg, const Volume& vol, unsigned int num_workers) {
+  cfg.worker_parameters.engine = WorkerParameters::Engine::Wavefront;
+  cfg.num_workers = num_workers;
+
+  Camera camera(cfg.camera_parameters, cfg.output_size);
+  TileProvider provider(cfg.output_size, cfg.num_waves, cfg.tile_size, cfg.num_workers);
+  Film film(cfg.output_size);
+  render(cfg, vol, camera, provider, film);
+  return film;
+}
+
+bool test_wavefront(const Configuration& cfg) {
+  TestVolume volume(cfg);
+
+  Film reference = render_wavefront(cfg, volume.vol, 1);
+  vptCHECK(total_samples(reference) > 0.0, "nothing was rendered");
+
+  Film film = render_wavefront(cfg, volume.vol, std::max(cfg.num_workers, 4u));
+  vptCHECK(same_film(film, reference), "the film depends on the batches of tiles");
+  return true;
+}
+
+} // namespace vpt::tests
@@ -0,0 +1,58 @@
+#include <unistd.h>
+
+#include "tests.hpp"
+
+namespace vpt::tests {
+
+TestVolume::TestVolume(const Configuration& cfg)
+  : grids(VolumeGrids::generate_donut()),
+    vol(grids, cfg.volume_parameters, cfg.num_workers)
+{
+  vol.precompute_shadows(cfg.worker_parameters, cfg.num_workers);
+}
+
+Configuration test_configuration(const std::filesystem::path& scene_path) {
+  Configuration cfg = read_configuration(scene_path);
+
+  cfg.output_size = { 64, 48 };
+  cfg.tile_size = { 8, 8 };
+  cfg.num_waves = 12;
+  cfg.num_workers = 4;
+  cfg.headless = true;
+  cfg.budget = {};
+  cfg.checkpoint_period = 0;
+  cfg.views.clear();
+
+  // Every tile gets all the waves, so the films can be compared pixel by pixel
+  cfg.worker_parameters.adaptive_sampling.enabled = false;
+  cfg.worker_parameters.single_pixel.enabled = false;
+  cfg.worker_parameters.max_depth = 64;
+
+  // The torus has a density of 1 inside, and a radius of 100 voxels around the origin: make it translucent, and look at it from above
+  cfg.volume_parameters.sigma_s = 0.05f;
+  cfg.volume_parameters.sigma_a = 0.01f;
+  cfg.volume_parameters.cache_majorants = false;
+  cfg.camera_parameters = {
+    .position = { 0.0f, 300.0f, 300.0f },
+    .look = { 0.0f, 0.0f, 0.0f },
+    .up = { 0.0f, 1.0f, 0.0f },
+    .vfov_deg = 45.0f,
+    .imaging_ratio = 1.0f,
+  };
+
+  return cfg;
+}
+
+void render(const Configuration& cfg, const Volume& vol, const Camera& camera, TileProvider& provider, Film& film) {
+  View view { camera, film };
+  render_with_threads(cfg, vol, std::span(&view, 1), provider, cfg.num_workers);
+}
+
+std::filesystem::path temp_directory(const std::string& test_name) {
+  std::filesystem::path ans = std::filesystem::temp_directory_path() / ("vpt_test_" + test_name + "_" + std::to_string(getpid()));
+  std::filesystem::remove_all(ans);
+  std::filesystem::create_directories(ans);
+  return ans;
+}
+
+} // namespace vpt::tests
@@ -0,0 +1,56 @@
+#ifndef VPT_TESTS_HPP
+#define VPT_TESTS_HPP
+
+#include <filesystem>
+#include <string>
+
+#include <vpt/volume_grids.hpp>
+#include <vpt/volume.hpp>
+#include <vpt/configuration.hpp>
+#include <vpt/camera.hpp>
+#include <vpt/film.hpp>
+#include <vpt/tile_provider.hpp>
+#include <vpt/render_harness.hpp>
+#include <vpt/logging.hpp>
+
+/*
+Most tests render a small image of a procedural volume (the NanoVDB torus), so that they don't need a volume file.
+The rest of the configuration comes from a scene file, given on the command line.
+Each test is a function returning whether it passed, and logs why not.
+*/
+
+/** @brief If the condition is false, log the message and fail the test. */
+#define vptCHECK(cond, x) do { if (not (cond)) { vptWARN("CHECK FAILED: " #cond " - " << x); return false; } } while(false)
+
+namespace vpt::tests {
+
+/** The torus, loaded as a volume would be. */
+struct TestVolume {
+  VolumeGrids grids;
+  Volume vol; // Refers to the grids, so it's declared after them
+
+  explicit TestVolume(const Configuration& cfg);
+
+  TestVolume(const TestVolume&) = delete;
+  TestVolume& operator=(const TestVolume&) = delete;
+};
+
+/** @return The configuration of the scene, made into a quick render of the torus: a small image, a few waves, and a camera looking at it. */
+Configuration test_configuration(const std::filesystem::path& scene_path);
+
+/** @brief Render the jobs of the tile provider into the film, with all the workers of the configuration (see render_with_threads). */
+void render(const Configuration& cfg, const Volume& vol, const Camera& camera, TileProvider& provider, Film& film);
+
+/** @return A fresh directory for the files of a test, removed by the caller. */
+std::filesystem::path temp_directory(const std::string& test_name);
+
+bool test_wave_ranges(const Configuration& cfg);
+bool test_resume(const Configuration& cfg);
+bool test_density_sampler(const Configuration& cfg);
+bool test_time_budget(const Configuration& cfg);
+bool test_leaf_pager(const Configuration& cfg);
+bool test_wavefront(const Configuration& cfg);
+
+} // namespace vpt::tests
+
+#endif // !VPT_TESTS_HPP